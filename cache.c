@@ -0,0 +1,139 @@
+/* MIT License
+ * 
+ * Copyright (c) 2021 Lucas Amaro
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int event_cache_init(event_cache *c, u32 n_slots) {
+	c->n_slots = n_slots;
+	c->hits = 0;
+	c->misses = 0;
+	c->slots = NULL;
+	if (!n_slots) return 0;
+
+	c->slots = (cache_slot*)calloc(n_slots, sizeof(cache_slot));
+	if (!c->slots) return 1;
+	for (u32 i = 0; i < n_slots; i++) {
+		if (mtx_init(&c->slots[i].mutex, mtx_plain) != thrd_success) {
+			c->n_slots = i;
+			event_cache_destroy(c);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void event_cache_destroy(event_cache *c) {
+	for (u32 i = 0; i < c->n_slots; i++) {
+		cache_slot *sl = c->slots + i;
+		mtx_destroy(&sl->mutex);
+		free(sl->starts);
+		free(sl->lens);
+		free(sl->data);
+	}
+	free(c->slots);
+	c->slots = NULL;
+	c->n_slots = 0;
+}
+
+// buffers are allocated once a slot is first used
+static int cache_slot_alloc(cache_slot *sl) {
+	if (sl->data) return 0;
+	sl->starts = (u64*)malloc(CACHE_SLOT_EVENTS * sizeof(u64));
+	sl->lens = (u32*)malloc(CACHE_SLOT_EVENTS * sizeof(u32));
+	sl->data = (u8*)malloc(CACHE_SLOT_BYTES);
+	if (sl->starts && sl->lens && sl->data) return 0;
+	free(sl->starts);
+	free(sl->lens);
+	free(sl->data);
+	sl->starts = NULL;
+	sl->lens = NULL;
+	sl->data = NULL;
+	return 1;
+}
+
+// events must come in offset order, a gap starts over
+void event_cache_put(event_cache *c, int itopic, u64 offset, char *buf, u32 len) {
+	if (!c->n_slots || len > CACHE_SLOT_BYTES) return;
+
+	cache_slot *sl = c->slots + itopic % c->n_slots;
+	mtx_lock(&sl->mutex);
+
+	if (cache_slot_alloc(sl)) goto done;
+
+	if (sl->itopic != itopic || sl->next != offset) {
+		sl->itopic = itopic;
+		sl->first = offset;
+		sl->next = offset;
+	}
+
+	// contiguous: skip what is left at the end of the buffer
+	u64 pos = sl->pos;
+	u32 at = pos % CACHE_SLOT_BYTES;
+	if (at + len > CACHE_SLOT_BYTES) pos += CACHE_SLOT_BYTES - at;
+
+	// evict the oldest to make room
+	while (sl->first < sl->next && (sl->next - sl->first == CACHE_SLOT_EVENTS ||
+			pos + len - sl->starts[sl->first % CACHE_SLOT_EVENTS] > CACHE_SLOT_BYTES)) {
+		sl->first++;
+	}
+
+	u32 i = offset % CACHE_SLOT_EVENTS;
+	sl->starts[i] = pos;
+	sl->lens[i] = len;
+	memcpy(sl->data + pos % CACHE_SLOT_BYTES, buf, len);
+	sl->pos = pos + len;
+	sl->next = offset + 1;
+
+done:
+	mtx_unlock(&sl->mutex);
+}
+
+// store_read_some's codes, or -2 when offset isn't cached
+int event_cache_read(event_cache *c, int itopic, u64 offset, cache_visitor fn, void *ctx) {
+	if (!c->n_slots) return -2;
+
+	cache_slot *sl = c->slots + itopic % c->n_slots;
+	mtx_lock(&sl->mutex);
+
+	if (sl->itopic != itopic || offset < sl->first || offset > sl->next) {
+		mtx_unlock(&sl->mutex);
+		__atomic_add_fetch(&c->misses, 1, __ATOMIC_RELAXED);
+		return -2;
+	}
+	__atomic_add_fetch(&c->hits, 1, __ATOMIC_RELAXED);
+
+	int ret = 2; // done - nothing to write
+	for (; offset < sl->next; offset++) {
+		u32 i = offset % CACHE_SLOT_EVENTS;
+		if (fn(offset, (char*)sl->data + sl->starts[i] % CACHE_SLOT_BYTES, sl->lens[i], ctx)) {
+			ret = ret == 2 ? 0 : 3; // full buffer, more - write
+			break;
+		}
+		ret = 1; // done - write
+	}
+
+	mtx_unlock(&sl->mutex);
+	return ret;
+}
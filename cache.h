@@ -0,0 +1,62 @@
+/* MIT License
+ * 
+ * Copyright (c) 2021 Lucas Amaro
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "la.h"
+#include "threads.h"
+
+#define CACHE_SLOT_BYTES (1<<17)
+#define CACHE_SLOT_EVENTS 1024
+#define CACHE_SLOTS 128 // default
+
+// the most recent events of a topic, as written, so readers a little
+// behind the head don't go to the store. Topics share slots by itopic,
+// a topic writing to a slot takes it over
+typedef struct cache_slot {
+	mtx_t mutex;
+	int itopic; // 0 = free
+	u64 first; // oldest cached offset
+	u64 next; // offset after the newest
+	u64 pos; // bytes written, events are contiguous in data
+	u64 *starts; // [CACHE_SLOT_EVENTS] position of each event
+	u32 *lens;
+	u8 *data; // [CACHE_SLOT_BYTES]
+} cache_slot;
+
+typedef struct event_cache {
+	cache_slot *slots;
+	u32 n_slots; // 0 = disabled
+	u64 hits;
+	u64 misses;
+} event_cache;
+
+int event_cache_init(event_cache *c, u32 n_slots);
+void event_cache_destroy(event_cache *c);
+
+void event_cache_put(event_cache *c, int itopic, u64 offset, char *buf, u32 len);
+
+typedef int (*cache_visitor)(u64 offset, char *buf, u32 len, void *ctx);
+int event_cache_read(event_cache *c, int itopic, u64 offset, cache_visitor fn, void *ctx);
+
+#endif /* CACHE_H */
@@ -25,14 +25,23 @@
 #include "udata.h"
 #include "threads.h"
 
+#include <stdio.h>
+#include <time.h>
+
 int validate_command(char *buf, u32 len) {
 	if (!len) return -1; // invalid command
 
 	switch(*buf) {
 	case 'e': // new event -> writer -> store
-	case 'd': // drop topic -> writer?
+	case 'z': // new event, compressed by the producer -> writer -> store
+	case 'b': // new events of one topic -> writer -> store
+	case 'd': // drop topic -> writer -> store
+	case 's': // topic status
+	case 'r': // set topic retention -> writer -> store
 	case 'w': // watch topic -> writer -> store? -> reader
+	case 'T': // watch topic from a time -> writer -> store? -> reader
 	case 'u': // unwatch topic -> writer
+	case 'o': // session options -> writer
 	case 'p': // ping
 		return 1;
 	}
@@ -40,14 +49,75 @@ int validate_command(char *buf, u32 len) {
 	return -1;
 }
 
+static u32 topic_hash(char *topic, u32 topic_len) {
+	u32 hash = 2166136261;
+	for (u32 i = 0; i < topic_len; i++) {
+		hash = (hash ^ (u8)topic[i]) * 16777619;
+	}
+	return hash;
+}
+
+// commands writing to a topic are sharded by its name, keeping its events
+// in order. The rest follow their session, which keeps watches in order
+u32 command_shard(char *buf, u32 len, u32 session_id) {
+	switch (*buf) {
+	case 'e':
+	case 'z':
+	case 'b':
+		if (len < 2) break;
+		return topic_hash(buf+2, (u8)buf[1] < len-2 ? (u8)buf[1] : len-2);
+	case 'd':
+		return topic_hash(buf+1, len-1);
+	case 'r':
+		if (len <= 1 + sizeof(store_retention)) break;
+		return topic_hash(buf + 1 + sizeof(store_retention), len-(1 + sizeof(store_retention)));
+	}
+	return session_id;
+}
+
+// the store creates a topic before any event of it comes, whichever
+// writer adds it
+static void topic_added_cb(int itopic, char *topic, u32 topic_len, void *ctx) {
+	loop_userdata *u = (loop_userdata*)ctx;
+	queue_buffer_part qparts[3];
+	qparts[0].buf = "c";
+	qparts[0].len = 1;
+	qparts[1].buf = &itopic;
+	qparts[1].len = sizeof(int);
+	qparts[2].buf = topic;
+	qparts[2].len = topic_len;
+	queue_push_multi(&u->store_worker_queue, qparts, 3, 1);
+}
+
 typedef struct bcast_context {
 	i64 offset;
 	connection_iovec *parts;
+	connection_shared *frame; // parts copied once, for every plain session
+	char *compressed; // as the producer sent it, NULL = raw only
+	u32 compressed_len;
 
-	session *bcast_next;
 	queue *reader_worker_queue;
 } bcast_context;
 
+static connection_shared *bcast_frame(connection_iovec *parts) {
+	connection_shared *b = connection_shared_new(parts[0].len + parts[1].len + parts[2].len);
+	if (!b) return NULL;
+	u32 pos = 0;
+	for (int i = 0; i < 3; i++) {
+		memcpy(b->data + pos, parts[i].buf, parts[i].len);
+		pos += parts[i].len;
+	}
+	return b;
+}
+
+// > session. Readers pick up a session falling behind, never waited for
+// with watchers locked: a full queue leaves it to the next event or write
+static void bcast_behind(bcast_context *bctx, session *s) {
+	if (!s->enqueued && !queue_push(bctx->reader_worker_queue, &s, sizeof(session*), 0)) {
+		s->enqueued = 1;
+	}
+}
+
 static void bcast(session *s, void *ctx) {
 	connection *conn = (connection*)s;
 
@@ -65,40 +135,84 @@ static void bcast(session *s, void *ctx) {
 
 	if (bctx->offset != s->offset) {
 		s->live = 0;
-		if (!s->enqueued) {
-			// add to reader queue
-			s->enqueued = 1;
-			queue_push(bctx->reader_worker_queue, &s, sizeof(session*), 1);
-		}
+		bcast_behind(bctx, s);
 		goto done;
 	}
 
-	if (connection_send_multi(conn, bctx->parts, 3)) { // full send buffer
+	// live events are sent as written, framed for the session. Plain
+	// sessions share one copy of the frame
+	int full;
+	if (!s->wire) {
+		if (!bctx->frame) bctx->frame = bcast_frame(bctx->parts);
+		full = bctx->frame ? connection_send_shared(conn, bctx->frame) :
+				connection_send_multi(conn, bctx->parts, 3);
+	} else if (bctx->compressed) {
+		full = session_send_event(s, bctx->offset, WIRE_LZ4, bctx->compressed, bctx->compressed_len);
+	} else {
+		full = session_send_event(s, bctx->offset, WIRE_RAW, bctx->parts[2].buf, bctx->parts[2].len);
+	}
+	if (full) { // full send buffer
 		s->live = 0;
-		if (!s->enqueued) {
-			// add to reader queue
-			s->enqueued = 1;
-			queue_push(bctx->reader_worker_queue, &s, sizeof(session*), 1);
-		}
+		bcast_behind(bctx, s);
 		goto done;
 	}
 
 	s->offset = bctx->offset+1; // next offset to read
-
-	// add to bcast write list
-	s->bcast_next = bctx->bcast_next;
-	bctx->bcast_next = s;
+	loop_write_later(s);
 
 done:
 	session_unlock(s);
 }
 
+typedef struct drop_notice {
+	char *json;
+	int len;
+} drop_notice;
+
+// the session left a dropped topic, tell it so
+static void drop_notify(session *s, void *ctx) {
+	drop_notice *d = ctx;
+	if (!session_send_event(s, ~0ULL, WIRE_RAW, d->json, d->len)) { // not an event
+		loop_write_later(s);
+	}
+}
+
+// > watchers_mutex. The next offset of the topic goes to an event, sent to
+// every live session. Compressed is as the producer sent it, NULL = raw only
+static void publish(loop_userdata *u, int itopic, char *data, u32 data_len,
+		char *compressed, u32 compressed_len) {
+	u32 total_len = sizeof(u64) + data_len;
+	u64 offset = u->write_offsets[itopic]++;
+	connection_iovec parts[3];
+	parts[0].buf = &total_len;
+	parts[0].len = sizeof(u32);
+	parts[1].buf = &offset;
+	parts[1].len = sizeof(u64);
+	parts[2].buf = data;
+	parts[2].len = data_len;
+
+	bcast_context bctx;
+	bctx.offset = offset;
+	bctx.parts = parts;
+	bctx.frame = NULL;
+	bctx.compressed = compressed;
+	bctx.compressed_len = compressed_len;
+	bctx.reader_worker_queue = READER_QUEUE(u, itopic);
+
+	event_cache_put(&u->cache, itopic, offset, data, data_len);
+	watchers_foreach(&u->ws, itopic, bcast, &bctx);
+
+	if (bctx.frame) connection_shared_release(bctx.frame);
+}
+
 int process_command(struct ev_loop *loop, session *s, char *buf, u32 len) {
 	loop_userdata *u = (loop_userdata*)ev_userdata(loop);
 
 	switch (*buf) {
 	case 'e': // new event
+	case 'z': // new event, lz4 compressed by the producer
 		{
+		char cmd = *buf;
 		buf++;
 		len--;
 
@@ -110,73 +224,105 @@ int process_command(struct ev_loop *loop, session *s, char *buf, u32 len) {
 			break; // err
 		}
 
-		int nt;
-		int itopic = store_get_topic(&u->s, topic, topic_len, 1, &nt);
+		char *data = buf + (topic_len+1);
+		u32 data_len = len - (topic_len+1);
+		if (cmd == 'e' && data_len > MAX_EVENT_SIZE) {
+			break; // err, no response could carry it
+		}
+
+		int itopic = store_add_topic(&u->s, topic, topic_len, topic_added_cb, u);
 		if (itopic < 0) break;
 
-		if (nt) { // create topic
-			queue_buffer_part qparts[3];
-			qparts[0].buf = "c";
-			qparts[0].len = 1;
-			qparts[1].buf = &itopic;
-			qparts[1].len = sizeof(int);
-			qparts[2].buf = topic;
-			qparts[2].len = topic_len;
-			queue_push_multi(&u->store_worker_queue, qparts, 3, 1);
+		// compressed: stored as is, decompressed once for the cache and
+		// consumers taking raw events, which checks it too
+		char raw[MAX_MESSAGE_SIZE];
+		char *compressed = NULL;
+		u32 compressed_len = 0;
+		if (cmd == 'z') {
+			u32 raw_len;
+			if (data_len <= sizeof(u32)) break;
+			memcpy(&raw_len, data, sizeof(u32));
+			compressed = data + sizeof(u32);
+			compressed_len = data_len - sizeof(u32);
+			if (raw_len > MAX_EVENT_SIZE ||
+					LZ4_decompress_safe(compressed, raw, compressed_len, raw_len) != (int)raw_len) {
+				break; // err
+			}
+			data = raw;
+			data_len = raw_len;
 		}
 
-		char *data = buf + (topic_len+1);
-		u32 data_len = len - (topic_len+1);
-
-		// store
-		queue_buffer_part qparts[3];
-		qparts[0].buf = "e";
+		// store, stamped with the ingest time. Blocks compress events
+		// together, they take them raw
+		u64 now = time(NULL);
+		int as_is = compressed && !(u->s.flags & STORE_BLOCKS);
+		queue_buffer_part qparts[4];
+		qparts[0].buf = as_is ? "z" : "e";
 		qparts[0].len = 1;
 		qparts[1].buf = &itopic;
 		qparts[1].len = sizeof(int);
-		qparts[2].buf = data;
-		qparts[2].len = data_len;
-		queue_push_multi(&u->store_worker_queue, qparts, 3, 1);
-
-		// bcast
-		u64 offset = u->write_offsets[itopic]++;
-		u32 total_len = sizeof(u64) + data_len;
-		connection_iovec parts[3];
-		parts[0].buf = &total_len;
-		parts[0].len = sizeof(u32);
-		parts[1].buf = &offset;
-		parts[1].len = sizeof(u64);
-		parts[2].buf = data;
-		parts[2].len = data_len;
-
-		bcast_context bctx;
-		bctx.offset = offset; // update offset
-		bctx.parts = parts;
-		bctx.bcast_next = NULL;
-		bctx.reader_worker_queue = &u->reader_worker_queue;
+		qparts[2].buf = &now;
+		qparts[2].len = sizeof(u64);
+		qparts[3].buf = as_is ? compressed : data;
+		qparts[3].len = as_is ? compressed_len : data_len;
+		queue_push_multi(&u->store_worker_queue, qparts, 4, 1);
 
 		// > watchers_mutex > session_mutex > r_queue_mutex
-		watchers_lock(&u->ws);
-		watchers_foreach(&u->ws, itopic, bcast, &bctx);
-		watchers_unlock(&u->ws);
+		// the head moves with the topic's watchers locked, a watch starting
+		// at it gets every later event. Readers catching up find it in the cache
+		watchers_lock(&u->ws, itopic);
+		publish(u, itopic, data, data_len, compressed, compressed_len);
+		watchers_unlock(&u->ws, itopic);
 		// < r_queue_mutex < session_mutex < watchers_mutex
 
+		}
+		break;
+	case 'b': // new events of one topic, a producer's batch
+		{
+		buf++;
+		len--;
 
-		// > loop
-		session *n = bctx.bcast_next;
-		while (n) {
-			session_lock((session*)n);
-			mtx_lock(&u->mutex);
-			connection_enable_write((connection*)n, loop);
-			mtx_unlock(&u->mutex);
-			session_unlock((session*)n);
-			n = n->bcast_next;
+		u8 topic_len;
+		memcpy(&topic_len, buf, sizeof(u8));
+		char *topic = buf+1;
+
+		if (topic_len+1 >= len) {
+			break; // err
+		}
+
+		char *events = buf + (topic_len+1);
+		u32 events_len = len - (topic_len+1);
+		if (!store_batch_events(events, events_len)) {
+			break; // err
 		}
-		// < loop
 
-		if (bctx.bcast_next) {
-			ev_async_send(loop, &u->async_w);
+		// one lookup, one store push and one lock for all of them
+		int itopic = store_add_topic(&u->s, topic, topic_len, topic_added_cb, u);
+		if (itopic < 0) break;
+
+		u64 now = time(NULL);
+		queue_buffer_part qparts[4];
+		qparts[0].buf = "b";
+		qparts[0].len = 1;
+		qparts[1].buf = &itopic;
+		qparts[1].len = sizeof(int);
+		qparts[2].buf = &now;
+		qparts[2].len = sizeof(u64);
+		qparts[3].buf = events;
+		qparts[3].len = events_len;
+		queue_push_multi(&u->store_worker_queue, qparts, 4, 1);
+
+		// > watchers_mutex > session_mutex > r_queue_mutex
+		watchers_lock(&u->ws, itopic);
+		while (events_len) {
+			u32 event_len;
+			memcpy(&event_len, events, sizeof(u32));
+			publish(u, itopic, events + sizeof(u32), event_len, NULL, 0);
+			events += sizeof(u32) + event_len;
+			events_len -= sizeof(u32) + event_len;
 		}
+		watchers_unlock(&u->ws, itopic);
+		// < r_queue_mutex < session_mutex < watchers_mutex
 
 		}
 		break;
@@ -194,12 +340,95 @@ int process_command(struct ev_loop *loop, session *s, char *buf, u32 len) {
 		qparts[1].len = sizeof(int);
 		queue_push_multi(&u->store_worker_queue, qparts, 2, 1);
 
-		// update offset
-		u->write_offsets[itopic] = 0;
+		// offsets keep growing, the store reclaims everything below them.
+		// Watchers would wait on a topic that is gone, they watch nothing now
+		char notice[128];
+		int n = snprintf(notice, sizeof(notice), "{\"topic\":\"%.*s\",\"dropped\":true}",
+				(int)(len-1 > 64 ? 64 : len-1), buf+1);
+
+		// > watchers
+		watchers_lock(&u->ws, itopic);
+		watchers_detach(&u->ws, itopic, drop_notify, &(drop_notice){ notice, n });
+		watchers_unlock(&u->ws, itopic);
+		// < watchers
+
+		}
+		break;
+	case 'r': // set topic retention
+		{
+		if (len <= 1 + sizeof(store_retention)) {
+			return 1;
+		}
+
+		char *topic = buf + 1 + sizeof(store_retention);
+		u32 topic_len = len-(1 + sizeof(store_retention));
+
+		int itopic = store_add_topic(&u->s, topic, topic_len, topic_added_cb, u);
+		if (itopic < 0) break;
+
+		queue_buffer_part qparts[3];
+		qparts[0].buf = "r";
+		qparts[0].len = 1;
+		qparts[1].buf = &itopic;
+		qparts[1].len = sizeof(int);
+		qparts[2].buf = buf+1;
+		qparts[2].len = sizeof(store_retention);
+		queue_push_multi(&u->store_worker_queue, qparts, 3, 1);
+
+		}
+		break;
+	case 's': // topic status, or the server's without a topic
+		{
+		int nt;
+		int itopic = len > 1 ? store_get_topic(&u->s, buf+1, len-1, 0, &nt) : -1;
+
+		char status[1024];
+		int n;
+		if (len == 1) {
+			n = snprintf(status, sizeof(status), "{\"cache_hits\":%llu,\"cache_misses\":%llu,"
+					"\"replay_bytes\":%llu,\"replay_waits\":%llu,\"group_commit\":",
+					(unsigned long long)u->cache.hits, (unsigned long long)u->cache.misses,
+					(unsigned long long)u->replay.bytes, (unsigned long long)u->replay.waits);
+			n += group_commit_json(&u->gc, status + n, sizeof(status) - n - 1);
+			status[n++] = '}';
+		} else if (itopic < 0) {
+			n = snprintf(status, sizeof(status), "{\"topic\":\"%.*s\",\"exists\":false}",
+					(int)(len-1 > 64 ? 64 : len-1), buf+1);
+		} else {
+			store_status st;
+			store_topic_status(&u->s, itopic, &st);
+			n = snprintf(status, sizeof(status),
+					"{\"topic\":\"%.*s\",\"exists\":true,\"head\":%llu,\"low\":%llu,"
+					"\"reclaiming\":%s,\"reclaimed\":%llu,\"pending\":%llu,\"reclaimed_bytes\":%llu,"
+					"\"bytes\":%llu,\"max_age\":%llu,\"max_bytes\":%llu,\"max_events\":%llu,"
+					"\"committed\":%llu,\"durable\":%llu}",
+					(int)(len-1 > 64 ? 64 : len-1), buf+1,
+					(unsigned long long)u->write_offsets[itopic],
+					(unsigned long long)st.low,
+					st.reclaiming ? "true" : "false",
+					(unsigned long long)st.reclaimed,
+					(unsigned long long)st.pending,
+					(unsigned long long)st.reclaimed_bytes,
+					(unsigned long long)st.bytes,
+					(unsigned long long)st.retention.max_age,
+					(unsigned long long)st.retention.max_bytes,
+					(unsigned long long)st.retention.max_events,
+					(unsigned long long)st.committed,
+					(unsigned long long)st.durable);
+		}
+
+		// > session
+		session_lock(s);
+		if (!session_send_event(s, ~0ULL, WIRE_RAW, status, n)) { // not an event
+			loop_write_later(s);
+		}
+		session_unlock(s);
+		// < session
 
 		}
 		break;
 	case 'w': // watch topic
+	case 'T': // watch topic from the first event stamped at or after a time
 		{
 		if (len <= 1 + sizeof(i64)) {
 			return 1;
@@ -211,25 +440,33 @@ int process_command(struct ev_loop *loop, session *s, char *buf, u32 len) {
 		char *topic = buf + 1 + sizeof(i64);
 		u32 topic_len = len-(1 + sizeof(i64));
 
-		int nt;
-		int itopic = store_get_topic(&u->s, buf+9, len-9, 1, &nt);
+		int itopic = store_add_topic(&u->s, topic, topic_len, topic_added_cb, u);
 		if (itopic < 0) break;
 
-		if (nt) { // create topic
-			queue_buffer_part qparts[3];
-			qparts[0].buf = "c";
-			qparts[0].len = 1;
-			qparts[1].buf = &itopic;
-			qparts[1].len = sizeof(int);
-			qparts[2].buf = topic;
-			qparts[2].len = topic_len;
-			queue_push_multi(&u->store_worker_queue, qparts, 3, 1);
+		store_status st;
+		store_topic_status(&u->s, itopic, &st);
+		u64 found = 0;
+		int rc = 0;
+		if (*buf == 'T') {
+			// a seek in the sparse time index of what is committed
+			rc = store_time_lookup(&u->s, itopic, (u64)offset, &found);
+			if (rc < 0) break;
 		}
 
+		// > watchers_mutex > session_mutex > r_queue_mutex
+		// the head only moves with the topic's watchers locked
+		int from = watchers_lock_move(&u->ws, itopic, s);
 		int live = 0;
 		i64 abs_offset = 0;
 		i64 wo = u->write_offsets[itopic];
-		if (offset < 0) {
+		if (*buf == 'T') {
+			// nothing there: start with what is not committed yet
+			abs_offset = rc ? (i64)st.committed : (i64)found;
+			if (abs_offset >= wo) {
+				abs_offset = wo;
+				live = 1;
+			}
+		} else if (offset < 0) {
 			if ((-offset) <= wo) {
 				abs_offset = wo + offset;
 			} else {
@@ -246,24 +483,44 @@ int process_command(struct ev_loop *loop, session *s, char *buf, u32 len) {
 			live = 1;
 		}
 
-		// > watchers_mutex > session_mutex > r_queue_mutex
-		watchers_lock(&u->ws);
-		session_lock(s);
+		// dropped or trimmed events are gone, start at the watermark
+		if (abs_offset < (i64)st.low) {
+			abs_offset = st.low;
+			live = abs_offset == wo;
+		}
+
 		watchers_update_watcher(&u->ws, itopic, abs_offset, live, s);
 
+		int wait = 0;
 		if (!live && !s->enqueued) {
-			queue_push(&u->reader_worker_queue, &s, sizeof(session*), 1);
 			s->enqueued = 1;
+			wait = queue_push(READER_QUEUE(u, itopic), &s, sizeof(session*), 0);
 		}
 
-		session_unlock(s);
-		watchers_unlock(&u->ws);
+		watchers_unlock_move(&u->ws, from, itopic, s);
 		// < rqueue_mutex < session_mutex < watchers_mutex
 
+		// a full reader queue is waited on with nothing locked, its reader
+		// may need this stripe to make room. Marked enqueued, nobody else
+		// pushes the session meanwhile
+		if (wait) queue_push(READER_QUEUE(u, itopic), &s, sizeof(session*), 1);
+
 		}
 		break;
 	case 'u': // unwatch topic
+		{
+		int from = watchers_lock_move(&u->ws, 0, s);
 		watchers_update_watcher(&u->ws, 0, 0, 0, s);
+		watchers_unlock_move(&u->ws, from, 0, s);
+		}
+		break;
+	case 'o': // session options, for what is sent from now on
+		if (len < 2) {
+			return 1;
+		}
+		session_lock(s);
+		s->wire = buf[1] & WIRE_CODEC;
+		session_unlock(s);
 		break;
 	case 'p':
 		break;
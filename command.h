@@ -27,6 +27,7 @@
 #include "session.h"
 
 int validate_command(char *buf, u32 len);
+u32 command_shard(char *buf, u32 len, u32 session_id);
 int process_command(struct ev_loop *loop, session *s, char *buf, u32 len);
 
 #endif /* COMMAND_H */
@@ -0,0 +1,167 @@
+/* MIT License
+ * 
+ * Copyright (c) 2021 Lucas Amaro
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "commit.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+void commit_hist_add(commit_hist *h, u64 v) {
+	int i = v ? 64 - __builtin_clzll(v) : 0;
+	if (i >= COMMIT_HIST_BUCKETS) i = COMMIT_HIST_BUCKETS - 1;
+	h->counts[i]++;
+	h->n++;
+	if (v > h->max) h->max = v;
+}
+
+// upper bound of the bucket holding the q quantile
+u64 commit_hist_quantile(commit_hist *h, double q) {
+	if (!h->n) return 0;
+
+	u64 rank = (u64)(q * h->n);
+	if (rank < 1) rank = 1;
+	if (rank > h->n) rank = h->n;
+
+	u64 seen = 0;
+	for (int i = 0; i < COMMIT_HIST_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen < rank) continue;
+		u64 bound = i ? (i < 64 ? (1ULL<<i) - 1 : ~0ULL) : 0;
+		return bound < h->max ? bound : h->max;
+	}
+
+	return h->max;
+}
+
+int group_commit_init(group_commit *gc, u64 max_bytes, u64 max_events, u64 max_linger) {
+	memset(gc, 0, sizeof(group_commit));
+	gc->max_bytes = max_bytes;
+	gc->max_events = max_events;
+	gc->max_linger = max_linger;
+	return mtx_init(&gc->mutex, mtx_plain) != thrd_success;
+}
+
+void group_commit_destroy(group_commit *gc) {
+	mtx_destroy(&gc->mutex);
+}
+
+// us, same clock as queue waits
+u64 group_commit_now() {
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void group_commit_begin(group_commit *gc, u64 now, int backlog) {
+	gc->started = now;
+	gc->bytes = 0;
+	gc->events = 0;
+	gc->backlog = backlog;
+
+	// writes queued up during the last commit: worth waiting for more
+	if (backlog) {
+		gc->linger = gc->commit_avg < gc->max_linger ? gc->commit_avg : gc->max_linger;
+	}
+}
+
+// the batch is written again from its first message
+void group_commit_rewind(group_commit *gc) {
+	gc->bytes = 0;
+	gc->events = 0;
+}
+
+void group_commit_add(group_commit *gc, u32 len) {
+	gc->bytes += len;
+	gc->events++;
+}
+
+void group_commit_add_events(group_commit *gc, u32 events, u32 len) {
+	gc->bytes += len;
+	gc->events += events;
+}
+
+int group_commit_full(group_commit *gc) {
+	return (gc->max_bytes && gc->bytes >= gc->max_bytes) ||
+		(gc->max_events && gc->events >= gc->max_events);
+}
+
+// 0 and the time to wait for more messages until, 1 to commit now
+int group_commit_deadline(group_commit *gc, struct timespec *deadline) {
+	if (!gc->linger || group_commit_full(gc)) return 1;
+
+	u64 end = gc->started + gc->linger;
+	if (group_commit_now() >= end) return 1;
+
+	deadline->tv_sec = end / 1000000;
+	deadline->tv_nsec = (end % 1000000) * 1000;
+	return 0;
+}
+
+// lingering brought nothing
+void group_commit_idle(group_commit *gc) {
+	gc->linger /= 2;
+}
+
+void group_commit_done(group_commit *gc, u64 commit_start, u64 now) {
+	u64 commit_time = now - commit_start;
+
+	mtx_lock(&gc->mutex);
+	gc->commit_avg = gc->commit_avg ? (gc->commit_avg * 7 + commit_time) / 8 : commit_time;
+	gc->batches++;
+	commit_hist_add(&gc->batch_events, gc->events);
+	commit_hist_add(&gc->batch_bytes, gc->bytes);
+	commit_hist_add(&gc->commit_time, commit_time);
+	commit_hist_add(&gc->batch_time, now - gc->started);
+	mtx_unlock(&gc->mutex);
+}
+
+static int hist_json(commit_hist *h, char *name, char *buf, int size) {
+	return snprintf(buf, size, "\"%s\":{\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"max\":%llu}",
+			name,
+			(unsigned long long)commit_hist_quantile(h, .5),
+			(unsigned long long)commit_hist_quantile(h, .9),
+			(unsigned long long)commit_hist_quantile(h, .99),
+			(unsigned long long)h->max);
+}
+
+int group_commit_json(group_commit *gc, char *buf, int size) {
+	mtx_lock(&gc->mutex);
+	int n = snprintf(buf, size, "{\"batches\":%llu,\"linger_us\":%llu,\"commit_avg_us\":%llu,"
+			"\"max_bytes\":%llu,\"max_events\":%llu,\"max_linger_us\":%llu,",
+			(unsigned long long)gc->batches,
+			(unsigned long long)gc->linger,
+			(unsigned long long)gc->commit_avg,
+			(unsigned long long)gc->max_bytes,
+			(unsigned long long)gc->max_events,
+			(unsigned long long)gc->max_linger);
+	if (n < size) n += hist_json(&gc->batch_events, "events", buf + n, size - n);
+	if (n < size) n += snprintf(buf + n, size - n, ",");
+	if (n < size) n += hist_json(&gc->batch_bytes, "bytes", buf + n, size - n);
+	if (n < size) n += snprintf(buf + n, size - n, ",");
+	if (n < size) n += hist_json(&gc->commit_time, "commit_us", buf + n, size - n);
+	if (n < size) n += snprintf(buf + n, size - n, ",");
+	if (n < size) n += hist_json(&gc->batch_time, "batch_us", buf + n, size - n);
+	if (n < size) n += snprintf(buf + n, size - n, "}");
+	mtx_unlock(&gc->mutex);
+	return n < size ? n : size - 1;
+}
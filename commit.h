@@ -0,0 +1,88 @@
+/* MIT License
+ * 
+ * Copyright (c) 2021 Lucas Amaro
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef COMMIT_H
+#define COMMIT_H
+
+#include "la.h"
+#include "threads.h"
+
+#define COMMIT_HIST_BUCKETS 65
+
+#define COMMIT_MAX_BYTES (1<<22)
+#define COMMIT_MAX_EVENTS (1<<16)
+#define COMMIT_MAX_LINGER 2000 // us
+
+// log2 buckets, bucket i counts values in [2^(i-1), 2^i)
+typedef struct commit_hist {
+	u64 counts[COMMIT_HIST_BUCKETS];
+	u64 n;
+	u64 max;
+} commit_hist;
+
+void commit_hist_add(commit_hist *h, u64 v);
+u64 commit_hist_quantile(commit_hist *h, double q);
+
+// group commit policy of the store worker. A batch ends when it reaches
+// max_bytes or max_events, or when the queue stays empty for the linger
+// budget. The budget follows the commit time, waiting for more only pays
+// off while it is cheaper than the commit it saves, and while there is
+// load: it is halved every time lingering brings nothing.
+typedef struct group_commit {
+	u64 max_bytes;
+	u64 max_events;
+	u64 max_linger; // us, 0 = commit as soon as the queue is empty
+
+	u64 linger; // current budget, us
+	u64 commit_avg; // ewma, us
+
+	// current batch
+	u64 started;
+	u64 bytes;
+	u64 events;
+	int backlog; // messages were waiting when the batch started
+
+	mtx_t mutex; // stats, read by status requests
+	u64 batches;
+	commit_hist batch_events;
+	commit_hist batch_bytes;
+	commit_hist commit_time;
+	commit_hist batch_time; // first message to commit done
+} group_commit;
+
+int group_commit_init(group_commit *gc, u64 max_bytes, u64 max_events, u64 max_linger);
+void group_commit_destroy(group_commit *gc);
+
+u64 group_commit_now();
+
+void group_commit_begin(group_commit *gc, u64 now, int backlog);
+void group_commit_rewind(group_commit *gc);
+void group_commit_add(group_commit *gc, u32 len);
+void group_commit_add_events(group_commit *gc, u32 events, u32 len);
+int group_commit_full(group_commit *gc);
+int group_commit_deadline(group_commit *gc, struct timespec *deadline);
+void group_commit_idle(group_commit *gc);
+void group_commit_done(group_commit *gc, u64 commit_start, u64 now);
+
+int group_commit_json(group_commit *gc, char *buf, int size);
+
+#endif /* COMMIT_H */
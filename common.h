@@ -26,6 +26,13 @@
 #define MAX_MESSAGE_SIZE (1<<14)
 #define MAX_TOPIC_NAME_LEN 64
 #define MAX_TOPICS ((1<<16)-1)
+#define MAX_EVENT_SIZE (MAX_MESSAGE_SIZE - 13) // fits a response: size, offset, codec
+
+// session options ('o'), the wire format of what the server sends
+#define WIRE_CODEC 0x1 // a codec byte after the offset, lz4 events may be sent compressed
+
+#define WIRE_RAW 0
+#define WIRE_LZ4 1
 
 #endif /* COMMON_H */
 
@@ -23,9 +23,25 @@
 #include "connection.h"
 
 #include <errno.h>
+#include <stdlib.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+static void connection_clear_refs(connection *o) {
+	for (u32 i = 0; i < o->n_refs; i++) {
+		connection_shared_release(o->refs[(o->ref_first + i) % CONNECTION_MAX_SHARED].b);
+	}
+	o->ref_first = 0;
+	o->n_refs = 0;
+	o->ref_sent = 0;
+	o->ref_bytes = 0;
+	o->queued = 0;
+	o->sent = 0;
+}
+
 int connection_init(connection *o, u32 size) {
+	o->n_refs = 0;
+	connection_clear_refs(o);
 	if (ring_buffer_init(&o->r, size)) return 1;
 	if (ring_buffer_init(&o->w, size)) {
 		ring_buffer_destroy(&o->r);
@@ -35,11 +51,13 @@ int connection_init(connection *o, u32 size) {
 }
 
 void connection_destroy(connection *o) {
+	connection_clear_refs(o);
 	ring_buffer_destroy(&o->r);
 	ring_buffer_destroy(&o->w);
 }
 
 void connection_reset(connection *o) {
+	connection_clear_refs(o);
 	ring_buffer_clear(&o->r);
 	ring_buffer_clear(&o->w);
 }
@@ -63,6 +81,7 @@ int connection_send_multi(connection *o, connection_iovec *parts, u32 n) {
 	for (u32 i = 0; i < n; i++) {
 		ring_buffer_write(&o->w, parts[i].buf, parts[i].len);
 	}
+	o->queued += total;
 	return 0;
 }
 int connection_send(connection *o, char *buf, u32 len) {
@@ -71,6 +90,34 @@ int connection_send(connection *o, char *buf, u32 len) {
 	parts[0].len = len;
 	return connection_send_multi(o, parts, 1);
 }
+// one reference, the caller's
+connection_shared *connection_shared_new(u32 len) {
+	connection_shared *b = (connection_shared*)malloc(sizeof(connection_shared) + len);
+	if (!b) return NULL;
+	atomic_init(&b->refs, 1);
+	b->len = len;
+	return b;
+}
+
+void connection_shared_release(connection_shared *b) {
+	if (atomic_fetch_sub_explicit(&b->refs, 1, memory_order_acq_rel) == 1) free(b);
+}
+
+// queues a reference to b instead of a copy. Shares the send buffer's
+// budget, a slow reader can't pin more than it would have copied
+int connection_send_shared(connection *o, connection_shared *b) {
+	if (o->n_refs == CONNECTION_MAX_SHARED ||
+			ring_buffer_size(&o->w) + o->ref_bytes + b->len > (u32)o->w.cap) {
+		return -1;
+	}
+	atomic_fetch_add_explicit(&b->refs, 1, memory_order_relaxed);
+	connection_ref *ref = o->refs + (o->ref_first + o->n_refs++) % CONNECTION_MAX_SHARED;
+	ref->b = b;
+	ref->mark = o->queued;
+	o->ref_bytes += b->len;
+	return 0;
+}
+
 int connection_peek(connection *o, char **buf, u32 len) {
 	u32 rbsize = ring_buffer_size(&o->r);
 	if (rbsize >= len) {
@@ -126,7 +173,71 @@ int connection_onread(connection *c) {
 	return bytes;
 }
 
+// ring bytes and shared buffers in the order they were queued
+static int connection_writev(connection *c) {
+	struct iovec iov[CONNECTION_MAX_SHARED*2 + 1];
+	u32 n = 0;
+	u8 *data = (u8*)ring_buffer_data(&c->w);
+	u32 size = ring_buffer_size(&c->w);
+	u32 pos = 0; // ring bytes before the next part
+	for (u32 i = 0; i < c->n_refs; i++) {
+		connection_ref *ref = c->refs + (c->ref_first + i) % CONNECTION_MAX_SHARED;
+		u32 before = ref->mark - c->sent;
+		if (before > pos) {
+			iov[n].iov_base = data + pos;
+			iov[n++].iov_len = before - pos;
+			pos = before;
+		}
+		u32 skip = i ? 0 : c->ref_sent;
+		iov[n].iov_base = ref->b->data + skip;
+		iov[n++].iov_len = ref->b->len - skip;
+	}
+	if (size > pos) {
+		iov[n].iov_base = data + pos;
+		iov[n++].iov_len = size - pos;
+	}
+
+	errno = 0;
+	ssize_t bytes = writev(c->io.fd, iov, n);
+	if (bytes < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		}
+		return -1;
+	}
+
+	// consume what went out, in the same order
+	u32 left = bytes;
+	while (left) {
+		u32 ring = c->n_refs ? c->refs[c->ref_first].mark - c->sent : size;
+		if (ring) {
+			u32 k = left < ring ? left : ring;
+			ring_buffer_consume(&c->w, k);
+			c->sent += k;
+			size -= k;
+			left -= k;
+			continue;
+		}
+		connection_ref *ref = c->refs + c->ref_first;
+		u32 rest = ref->b->len - c->ref_sent;
+		if (left < rest) {
+			c->ref_sent += left;
+			c->ref_bytes -= left;
+			break;
+		}
+		left -= rest;
+		c->ref_bytes -= rest;
+		connection_shared_release(ref->b);
+		c->ref_first = (c->ref_first + 1) % CONNECTION_MAX_SHARED;
+		c->n_refs--;
+		c->ref_sent = 0;
+	}
+	return bytes;
+}
+
 int connection_onwrite(connection *c, struct ev_loop *loop) {
+	if (c->n_refs) return connection_writev(c);
+
 	void *data = ring_buffer_data(&c->w);
 	u32 len = ring_buffer_size(&c->w);
 
@@ -144,6 +255,7 @@ int connection_onwrite(connection *c, struct ev_loop *loop) {
 	}
 
 	ring_buffer_consume(&c->w, bytes);
+	c->sent += bytes;
 	/*if (!ring_buffer_size(&c->w)) {
 		ev_io_stop(loop, (ev_io*)c);
 		ev_io_modify((ev_io*)c, EV_READ);
@@ -152,11 +264,35 @@ int connection_onwrite(connection *c, struct ev_loop *loop) {
 	return bytes;
 }
 
+// writes parts straight to the socket, past the send ring, which must be
+// empty so bytes don't go out of order. Returns bytes written, 0 when the
+// ring isn't empty or the socket is full, -1 on error
+int connection_write_direct(connection *c, connection_iovec *parts, u32 n) {
+	if (ring_buffer_size(&c->w) || c->n_refs) return 0;
+
+	struct iovec iov[CONNECTION_MAX_IOV];
+	if (n > CONNECTION_MAX_IOV) n = CONNECTION_MAX_IOV;
+	for (u32 i = 0; i < n; i++) {
+		iov[i].iov_base = parts[i].buf;
+		iov[i].iov_len = parts[i].len;
+	}
+
+	errno = 0;
+	ssize_t bytes = writev(c->io.fd, iov, n);
+	if (bytes < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		}
+		return -1;
+	}
+	return bytes;
+}
+
 int connection_empty_read(connection *c) {
 	return !ring_buffer_size(&c->r);
 }
 
 int connection_empty_send(connection *c) {
-	return !ring_buffer_size(&c->w);
+	return !ring_buffer_size(&c->w) && !c->n_refs;
 }
 
@@ -27,16 +27,42 @@
 #include "la.h"
 #include "ring.h"
 
+#include <stdatomic.h>
+
+#define CONNECTION_MAX_IOV 1024 // parts written at once, IOV_MAX on linux
+#define CONNECTION_MAX_SHARED 256 // shared buffers queued at once
+
 typedef struct connection_iovec {
 	void *buf;
 	u32 len;
 } connection_iovec;
 
+// bytes sent to many connections, freed with the last reference
+typedef struct connection_shared {
+	atomic_uint refs;
+	u32 len;
+	char data[];
+} connection_shared;
+
+// a shared buffer goes out after the ring bytes queued before it
+typedef struct connection_ref {
+	connection_shared *b;
+	u64 mark; // connection.queued when it was queued
+} connection_ref;
+
 typedef struct connection {
 	ev_io io;
 
 	ring_buffer r;
 	ring_buffer w;
+
+	u64 queued; // bytes ever written to w
+	u64 sent; // bytes ever sent from w
+	connection_ref refs[CONNECTION_MAX_SHARED];
+	u32 ref_first;
+	u32 n_refs;
+	u32 ref_sent; // bytes sent of the first one
+	u32 ref_bytes; // bytes queued in refs, not sent
 } connection;
 
 int connection_init(connection *o, u32 size);
@@ -47,6 +73,9 @@ void connection_enable_write(connection *o, struct ev_loop *loop);
 void connection_disable_write(connection *o, struct ev_loop *loop);
 int connection_send_multi(connection *o, connection_iovec *parts, u32 n);
 int connection_send(connection *o, char *buf, u32 len);
+connection_shared *connection_shared_new(u32 len);
+void connection_shared_release(connection_shared *b);
+int connection_send_shared(connection *o, connection_shared *b);
 int connection_peek(connection *o, char **buf, u32 len);
 int connection_peek_multi(connection *o, connection_iovec *parts, u32 n);
 u32 connection_peek_all(connection *o, char **buf);
@@ -54,6 +83,7 @@ void connection_consume(connection *o, u32 len);
 void connection_consume_multi(connection *o, connection_iovec *parts, u32 n);
 int connection_onread(connection *c);
 int connection_onwrite(connection *c, struct ev_loop *loop);
+int connection_write_direct(connection *c, connection_iovec *parts, u32 n);
 
 int connection_empty_read(connection *c);
 int connection_empty_send(connection *c);
@@ -0,0 +1,210 @@
+/* MIT License
+ * 
+ * Copyright (c) 2021 Lucas Amaro
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "la.h"
+
+#include "common.h"
+#include "connection.h"
+#include "ev.h"
+#include "sock.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+connection sock_watcher;
+ev_timer poll_watcher;
+
+char *topic = NULL;
+u32 topic_len = 0;
+int wait_reclaim = 0;
+
+static int send_command(struct ev_loop *loop, char *cmd) {
+	u32 total_len = sizeof(char) + topic_len;
+	connection_iovec parts[3];
+	parts[0].buf = &total_len;
+	parts[0].len = sizeof(u32);
+	parts[1].buf = cmd;
+	parts[1].len = sizeof(char);
+	parts[2].buf = topic;
+	parts[2].len = topic_len;
+	if (connection_send_multi(&sock_watcher, parts, 3)) return 1;
+	connection_enable_write(&sock_watcher, loop);
+	return 0;
+}
+
+static int send_retention(struct ev_loop *loop, u64 *retention) {
+	u32 total_len = sizeof(char) + 3*sizeof(u64) + topic_len;
+	connection_iovec parts[4];
+	parts[0].buf = &total_len;
+	parts[0].len = sizeof(u32);
+	parts[1].buf = "r";
+	parts[1].len = sizeof(char);
+	parts[2].buf = retention;
+	parts[2].len = 3*sizeof(u64);
+	parts[3].buf = topic;
+	parts[3].len = topic_len;
+	if (connection_send_multi(&sock_watcher, parts, 4)) return 1;
+	connection_enable_write(&sock_watcher, loop);
+	return 0;
+}
+
+static u64 status_field(char *status, char *name) {
+	char *p = strstr(status, name);
+	return p ? strtoull(p + strlen(name), NULL, 10) : 0;
+}
+
+void sock_cb(struct ev_loop *loop, struct ev_io *w, int revents) {
+	connection* conn = (connection*)w;
+	if (revents & EV_WRITE) {
+		if (connection_onwrite(conn, loop) < 0) exit(1);
+
+		if (connection_empty_send(conn)) {
+			connection_disable_write(conn, loop);
+		}
+	}
+	if (!(revents & EV_READ)) return;
+
+	if (connection_onread(conn) < 0) exit(1);
+
+	for (;;) {
+		connection_iovec parts[2];
+		parts[0].buf = NULL;
+		parts[0].len = sizeof(u32);
+		parts[1].buf = NULL;
+		parts[1].len = 0;
+		if (connection_peek_multi(conn, parts, 1)) {
+			return;
+		}
+		memcpy(&parts[1].len, parts[0].buf, sizeof(u32));
+		if (connection_peek_multi(conn, parts, 2)) {
+			return;
+		}
+
+		u64 offset;
+		memcpy(&offset, parts[1].buf, sizeof(u64));
+
+		char *str = (char*)parts[1].buf + sizeof(u64);
+		int str_len = (int)(parts[1].len - sizeof(u64));
+
+		if (offset == ~0ULL) { // status
+			char status[1024];
+			snprintf(status, sizeof(status), "%.*s", str_len, str);
+			puts(status);
+			fflush(stdout);
+
+			// done unless still reclaiming, or the drop is still queued
+			static u64 head = ~0ULL;
+			if (head == ~0ULL) head = status_field(status, "\"head\":");
+			if (!wait_reclaim || (!strstr(status, "\"reclaiming\":true") &&
+					status_field(status, "\"low\":") >= head)) {
+				exit(0);
+			}
+			ev_timer_start(loop, &poll_watcher);
+		}
+
+		connection_consume_multi(conn, parts, 2);
+	}
+}
+
+static void poll_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+	ev_timer_stop(loop, w);
+	if (send_command(loop, "s")) exit(1);
+}
+
+void usage() {
+	fprintf(stderr, "Usage: esq-drop [-h host] [-p port] [-s] [-w] [-r maxage:maxbytes:maxevents] topic\n"
+			"       esq-drop [-h host] [-p port] -s\n");
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) usage();
+
+	char *host = "127.0.0.1";
+	char *port = "4000";
+	int status_only = 0;
+	int set_retention = 0;
+	u64 retention[3]; // max age, bytes, events
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-h")) {
+			if (++i >= argc) usage();
+			host = argv[i];
+		} else if (!strcmp(argv[i], "-p")) {
+			if (++i >= argc) usage();
+			port = argv[i];
+		} else if (!strcmp(argv[i], "-s")) {
+			status_only = 1;
+		} else if (!strcmp(argv[i], "-r")) {
+			if (++i >= argc) usage();
+			unsigned long long age, bytes, events;
+			if (sscanf(argv[i], "%llu:%llu:%llu", &age, &bytes, &events) != 3) usage();
+			retention[0] = age;
+			retention[1] = bytes;
+			retention[2] = events;
+			set_retention = 1;
+		} else if (!strcmp(argv[i], "-w")) {
+			wait_reclaim = 1;
+		} else if (!strcmp(argv[i], "--")) {
+			break;
+		} else {
+			if (topic) usage();
+			topic = argv[i];
+		}
+	}
+
+	if (!topic && (!status_only || wait_reclaim || set_retention)) usage();
+
+	topic_len = topic ? strlen(topic) : 0; // none: server status
+
+	unsigned int evflags = ev_recommended_backends() | EVBACKEND_KQUEUE | EVBACKEND_EPOLL;
+	struct ev_loop *loop = ev_default_loop(evflags);
+
+	// connect
+	int sock = socket_connect(host, port);
+	if (sock < 0) return 1;
+
+	connection_init(&sock_watcher, MAX_MESSAGE_SIZE);
+	ev_io_init(&sock_watcher.io, sock_cb, sock, EV_WRITE|EV_READ);
+	ev_io_start(loop, &sock_watcher.io);
+
+	ev_timer_init(&poll_watcher, poll_cb, 0.1, 0.);
+
+	signal(SIGPIPE, SIG_IGN);
+
+	// the drop is queued behind pending writes, status may lag a little
+	if (set_retention) {
+		if (send_retention(loop, retention)) return 1;
+	} else if (!status_only && send_command(loop, "d")) {
+		return 1;
+	}
+	if (send_command(loop, "s")) return 1;
+
+	ev_loop(loop, 0);
+
+	return 0;
+}
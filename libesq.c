@@ -29,17 +29,21 @@
 #define EV_API_STATIC 1
 #include "ev.h"
 #include "ev.c"
+#include "lib/lz4/lz4.c"
 #include "sock.c"
 #include "sock.h"
 
 #include <stdlib.h>
 
+#define ESQ_SEND_BUFFER (MAX_MESSAGE_SIZE * 4) // frames of a producer in flight
+
 struct session {
 	connection conn;
 
 	char *topic;
 	u8 topic_len;
 	int delayed;
+	u8 wire;
 
 	struct session *next;
 };
@@ -53,6 +57,15 @@ void session_destroy(session *s) {
 	connection_destroy(&s->conn);
 }
 
+// events of one topic, sent as one frame once full, for another topic,
+// or before the loop waits
+typedef struct esq_batch {
+	ev_prepare flush_w;
+	session s; // producer connection
+	char frame[MAX_MESSAGE_SIZE];
+	u32 len; // 0 = empty
+} esq_batch;
+
 typedef struct loop_userdata {
 	esq *q;
 	void *ctx;
@@ -104,6 +117,21 @@ static void sock_cb(struct ev_loop *loop, struct ev_io *w, int revents) {
 		char *str = buf + sizeof(u64);
 		int str_len = (int)(len - sizeof(u64));
 
+		// events may come compressed as stored
+		char raw[MAX_MESSAGE_SIZE];
+		if ((s->wire & WIRE_CODEC) && str_len > 0) {
+			u8 codec = *str++;
+			str_len--;
+			if (codec == WIRE_LZ4) {
+				str_len = LZ4_decompress_safe(str, raw, str_len, sizeof(raw));
+				str = raw;
+				if (str_len < 0) { // reported as an event without data, then skipped
+					str = NULL;
+					str_len = 0;
+				}
+			}
+		}
+
 		if (!u->cb(offset, s->topic, s->topic_len, str, str_len, u->ctx)) { // not handled
 			session *n = s->next;
 			if (!n) n = u->q->next;
@@ -121,6 +149,8 @@ int esq_init(esq *q, const char *host, const char *port) {
 	q->next = NULL;
 	q->host = host;
 	q->port = port;
+	q->wire = 0;
+	q->batch = NULL;
 	return 0;
 }
 
@@ -132,10 +162,15 @@ void esq_destroy(esq *q) {
 		free(n);
 		n = next;
 	}
+	if (q->batch) {
+		close(q->batch->s.conn.io.fd);
+		session_destroy(&q->batch->s);
+		free(q->batch);
+	}
 	ev_default_destroy();
 }
 
-int esq_tail(esq *q, const char *topic, u8 topic_len, i64 offset) {
+static int esq_watch(esq *q, char *cmd, const char *topic, u8 topic_len, i64 offset) {
 	int fd = socket_connect(q->host, q->port);
 	if (fd < 0) return 1;
 
@@ -148,6 +183,7 @@ int esq_tail(esq *q, const char *topic, u8 topic_len, i64 offset) {
 
 	s->topic = topic;
 	s->topic_len = topic_len;
+	s->wire = q->wire;
 
 	ev_io_init((ev_io*)s, sock_cb, fd, EV_READ);
 	ev_io_start(q->loop, (ev_io*)s);
@@ -155,12 +191,23 @@ int esq_tail(esq *q, const char *topic, u8 topic_len, i64 offset) {
 	s->next = q->next;
 	q->next = s;
 
+	if (s->wire) {
+		u32 total_len = 2 * sizeof(char);
+		char opts[2] = { 'o', (char)s->wire };
+		connection_iovec parts[2];
+		parts[0].buf = &total_len;
+		parts[0].len = sizeof(u32);
+		parts[1].buf = opts;
+		parts[1].len = sizeof(opts);
+		connection_send_multi((connection*)s, parts, 2);
+	}
+
 	// send watch request
 	u32 total_len = sizeof(char) + sizeof(i64) + topic_len;
 	connection_iovec parts[4];
 	parts[0].buf = &total_len;
 	parts[0].len = sizeof(u32);
-	parts[1].buf = "w";
+	parts[1].buf = cmd;
 	parts[1].len = sizeof(char);
 	parts[2].buf = &offset;
 	parts[2].len = sizeof(i64);
@@ -173,8 +220,99 @@ int esq_tail(esq *q, const char *topic, u8 topic_len, i64 offset) {
 	return 0;
 }
 
+int esq_tail(esq *q, const char *topic, u8 topic_len, i64 offset) {
+	return esq_watch(q, "w", topic, topic_len, offset);
+}
+
+// from the first event stamped at or after time, unix seconds
+int esq_tail_time(esq *q, const char *topic, u8 topic_len, u64 time) {
+	return esq_watch(q, "T", topic, topic_len, (i64)time);
+}
+
+// events of sessions started from now on are sent compressed as stored,
+// and decompressed here: less bandwidth, and less server cpu on replays
+void esq_compressed(esq *q, int on) {
+	q->wire = on ? WIRE_CODEC : 0;
+}
+
+static void flush_cb(struct ev_loop *loop, ev_prepare *w, int revents) {
+	esq_flush((esq*)w->data);
+}
+
+static esq_batch *esq_producer(esq *q) {
+	if (q->batch) return q->batch;
+
+	int fd = socket_connect(q->host, q->port);
+	if (fd < 0) return NULL;
+
+	esq_batch *b = malloc(sizeof(esq_batch));
+	if (!b) {
+		close(fd);
+		return NULL;
+	}
+	b->s.next = NULL;
+	b->s.topic = NULL;
+	b->s.topic_len = 0;
+	b->s.wire = 0;
+	if (connection_init(&b->s.conn, ESQ_SEND_BUFFER)) {
+		close(fd);
+		free(b);
+		return NULL;
+	}
+	b->len = 0;
+
+	ev_io_init((ev_io*)&b->s, sock_cb, fd, EV_READ);
+	ev_io_start(q->loop, (ev_io*)&b->s);
+
+	ev_prepare_init(&b->flush_w, flush_cb);
+	b->flush_w.data = q;
+	ev_prepare_start(q->loop, &b->flush_w);
+
+	q->batch = b;
+	return b;
+}
+
+// queues the pending batch on the producer connection. 1 = its send
+// buffer is full, run the loop and retry
+int esq_flush(esq *q) {
+	esq_batch *b = q->batch;
+	if (!b || !b->len) return 0;
+
+	u32 total_len = b->len - sizeof(u32);
+	memcpy(b->frame, &total_len, sizeof(u32));
+	if (connection_send(&b->s.conn, b->frame, b->len)) return 1;
+	connection_enable_write(&b->s.conn, q->loop);
+	b->len = 0;
+	return 0;
+}
+
+// events are batched per topic and sent from the loop, esq_flush sends them
+// now. 1 = error, or the send buffer is full: run the loop and retry
 int esq_write(esq *q, const char *topic, u8 topic_len, const char *data, u32 data_len) {
-	// TODO
+	if (!data_len || data_len > MAX_EVENT_SIZE) return 1;
+	u32 head = sizeof(u32) + 2 * sizeof(char) + topic_len;
+	if (head + sizeof(u32) + data_len > MAX_MESSAGE_SIZE) return 1;
+
+	esq_batch *b = esq_producer(q);
+	if (!b) return 1;
+
+	// another topic, or no room left
+	if (b->len && ((u8)b->frame[sizeof(u32) + 1] != topic_len ||
+			memcmp(b->frame + sizeof(u32) + 2, topic, topic_len) ||
+			b->len + sizeof(u32) + data_len > MAX_MESSAGE_SIZE)) {
+		if (esq_flush(q)) return 1;
+	}
+
+	if (!b->len) {
+		b->frame[sizeof(u32)] = 'b';
+		b->frame[sizeof(u32) + 1] = (char)topic_len;
+		memcpy(b->frame + sizeof(u32) + 2, topic, topic_len);
+		b->len = head;
+	}
+
+	memcpy(b->frame + b->len, &data_len, sizeof(u32));
+	memcpy(b->frame + b->len + sizeof(u32), data, data_len);
+	b->len += sizeof(u32) + data_len;
 	return 0;
 }
 
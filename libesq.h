@@ -38,19 +38,28 @@ typedef int8_t  i8;
 struct session;
 typedef struct session session;
 struct ev_loop;
+struct esq_batch;
 
 typedef struct esq {
 	struct ev_loop *loop;
 	session *next;
 	char *host;
 	char *port;
+	u8 wire; // options of new sessions
+	struct esq_batch *batch; // written events not sent yet, NULL before the first
 } esq;
 
 int esq_init(esq *q, const char *host, const char *port);
 void esq_destroy(esq *q);
 int esq_tail(esq *q, const char *topic, u8 topic_len, i64 offset);
+int esq_tail_time(esq *q, const char *topic, u8 topic_len, u64 time);
+void esq_compressed(esq *q, int on);
 int esq_write(esq *q, const char *topic, u8 topic_len, const char *data, u32 data_len);
+int esq_flush(esq *q);
 
+// offset ~0 is not an event but a notice, e.g. the topic was dropped and the
+// session tails nothing anymore. data is NULL for an event that could not be
+// decompressed, it is skipped once handled
 typedef int (*esq_event_cb)(u64 offset, const char *topic, u8 topic_len, const char *data, u32 data_len, void *ctx);
 void esq_loop(esq *q, esq_event_cb cb, void *ctx);
 
@@ -0,0 +1,106 @@
+/* MIT License
+ * 
+ * Copyright (c) 2021 Lucas Amaro
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "loop.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+int io_loop_init(io_loop *io, u32 n, u32 first) {
+	if (session_pool_init(&io->pool, n)) {
+		return 1;
+	}
+	for (u32 i = 0; i < n; i++) {
+		io->pool.pool[i].io = io;
+	}
+	io->first = first;
+	atomic_init(&io->n_free, n);
+
+	io->handed = (int*)malloc(n * sizeof(int));
+	io->n_handed = 0;
+	if (!io->handed) {
+		session_pool_destroy(&io->pool);
+		return 1;
+	}
+	if (mtx_init(&io->hmutex, mtx_plain) != thrd_success) {
+		free(io->handed);
+		session_pool_destroy(&io->pool);
+		return 1;
+	}
+
+	session_list_init(&io->dirty);
+	atomic_init(&io->stop, 0);
+	return 0;
+}
+
+void io_loop_destroy(io_loop *io) {
+	for (u32 i = 0; i < io->n_handed; i++) {
+		close(io->handed[i]);
+	}
+	free(io->handed);
+	mtx_destroy(&io->hmutex);
+	session_pool_destroy(&io->pool);
+}
+
+session *io_loop_alloc(io_loop *io) {
+	session *s = session_pool_alloc(&io->pool);
+	if (s) atomic_fetch_sub(&io->n_free, 1);
+	return s;
+}
+
+void io_loop_free(io_loop *io, session *s) {
+	session_pool_free(&io->pool, s);
+	atomic_fetch_add(&io->n_free, 1);
+}
+
+u32 io_loop_session_id(session *s) {
+	return s->io->first + (u32)(s - s->io->pool.pool);
+}
+
+int io_loop_hand_off(io_loop *loops, u32 n, u32 from, int fd) {
+	for (u32 i = 1; i < n; i++) {
+		u32 to = (from + i) % n;
+		io_loop *io = loops + to;
+		if (atomic_load(&io->n_free) <= 0) continue;
+
+		// > hmutex
+		mtx_lock(&io->hmutex);
+		int handed = io->n_handed < io->pool.n;
+		if (handed) io->handed[io->n_handed++] = fd;
+		mtx_unlock(&io->hmutex);
+		// < hmutex
+
+		if (handed) return to;
+	}
+	return -1;
+}
+
+void io_loop_take_handed(io_loop *io, void (*start)(io_loop *io, int fd)) {
+	// > hmutex
+	mtx_lock(&io->hmutex);
+	for (u32 i = 0; i < io->n_handed; i++) {
+		start(io, io->handed[i]);
+	}
+	io->n_handed = 0;
+	mtx_unlock(&io->hmutex);
+	// < hmutex
+}
@@ -0,0 +1,69 @@
+/* MIT License
+ * 
+ * Copyright (c) 2021 Lucas Amaro
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef LOOP_H
+#define LOOP_H
+
+#include "ev.h"
+#include "pool.h"
+#include "session.h"
+#include "threads.h"
+
+// an I/O thread's loop, sessions stay on the one that accepted them
+typedef struct io_loop {
+	struct ev_loop *loop;
+	ev_async async_w; // dirty sessions, handed connections, or stop
+	ev_io accept_w; // own listening socket, the kernel spreads connections
+	session_list dirty; // sessions with bytes to send, armed on async_w
+	session_pool pool;
+	u32 first; // id of the pool's first session
+	atomic_int n_free; // sessions left in the pool, read by other loops
+	mtx_t hmutex;
+	int *handed; // connections a full loop accepted, started on async_w
+	u32 n_handed;
+	atomic_int stop;
+} io_loop;
+
+// n sessions with ids from first on, loop and async_w are left to the caller
+int io_loop_init(io_loop *io, u32 n, u32 first);
+void io_loop_destroy(io_loop *io);
+
+session *io_loop_alloc(io_loop *io);
+void io_loop_free(io_loop *io, session *s);
+
+// unique across the loops, each owns a slice of n ids
+u32 io_loop_session_id(session *s);
+
+// the kernel spreads connections unevenly, one a full loop accepted goes to
+// the next loop after from with room. Returns that loop, or -1 if all are full
+int io_loop_hand_off(io_loop *loops, u32 n, u32 from, int fd);
+
+// > hmutex. start runs on each handed connection, on io's own thread
+void io_loop_take_handed(io_loop *io, void (*start)(io_loop *io, int fd));
+
+// > session. s's loop arms its write interest on its next wakeup, only a
+// loop's own thread touches its watchers
+static inline void loop_write_later(session *s) {
+	if (session_list_push(&s->io->dirty, s)) ev_async_send(s->io->loop, &s->io->async_w);
+}
+
+#endif /* LOOP_H */
@@ -107,6 +107,20 @@ int queue_peek(queue *q, void **buf, u32 *len, int block) {
 	return 0;
 }
 
+// queue_peek, waiting until deadline at most
+int queue_peek_until(queue *q, struct timespec *deadline, void **buf, u32 *len) {
+	mtx_lock(&q->mutex);
+	while (queue_empty(q)) {
+		if (cnd_timedwait(&q->not_empty, &q->mutex, deadline) != thrd_success && queue_empty(q)) {
+			mtx_unlock(&q->mutex);
+			return 1;
+		}
+	}
+	memcpy(len, ring_buffer_data(&q->buffer), sizeof(u32));
+	*buf = (u8*)ring_buffer_data(&q->buffer) + sizeof(u32);
+	return 0;
+}
+
 int queue_peek_next(queue *q, void **buf, u32 *len) {
 	queue_consume(q);
 	if (queue_empty(q)) return 1;
@@ -127,6 +141,38 @@ void queue_drop(queue *q) {
 	mtx_unlock(&q->mutex);
 }
 
+// while peeking: mark the current message, rewind back to it to go over
+// the same messages again
+u32 queue_mark(queue *q) {
+	return ring_buffer_size(&q->buffer);
+}
+
+void queue_rewind(queue *q, u32 mark, void **buf, u32 *len) {
+	ring_buffer_unconsume(&q->buffer, mark - ring_buffer_size(&q->buffer));
+	memcpy(len, ring_buffer_data(&q->buffer), sizeof(u32));
+	*buf = (u8*)ring_buffer_data(&q->buffer) + sizeof(u32);
+}
+
+// while peeking, with every message consumed: wait until deadline for more.
+// Messages since mark are held meanwhile, producers can't overwrite them
+// so a rewind still finds them. mark is moved along with what was pushed.
+int queue_peek_wait(queue *q, u32 *mark, struct timespec *deadline, void **buf, u32 *len) {
+	u32 held = *mark - ring_buffer_size(&q->buffer);
+	ring_buffer_unconsume(&q->buffer, held);
+
+	while (ring_buffer_size(&q->buffer) == *mark) {
+		if (cnd_timedwait(&q->not_empty, &q->mutex, deadline) != thrd_success) break;
+	}
+
+	*mark = ring_buffer_size(&q->buffer);
+	ring_buffer_consume(&q->buffer, held);
+
+	if (queue_empty(q)) return 1;
+	memcpy(len, ring_buffer_data(&q->buffer), sizeof(u32));
+	*buf = (u8*)ring_buffer_data(&q->buffer) + sizeof(u32);
+	return 0;
+}
+
 int queue_size(queue *q) {
 	return ring_buffer_size(&q->buffer);
 }
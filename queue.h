@@ -46,9 +46,13 @@ void queue_clear(queue *q);
 int queue_push_multi(queue *q, queue_buffer_part *parts, u32 n, int block);
 int queue_push(queue *q, void *buf, u32 len, int block);
 int queue_peek(queue *q, void **buf, u32 *len, int block);
+int queue_peek_until(queue *q, struct timespec *deadline, void **buf, u32 *len);
 int queue_peek_next(queue *q, void **buf, u32 *len);
 void queue_pop(queue *q);
 void queue_drop(queue *q);
+u32 queue_mark(queue *q);
+void queue_rewind(queue *q, u32 mark, void **buf, u32 *len);
+int queue_peek_wait(queue *q, u32 *mark, struct timespec *deadline, void **buf, u32 *len);
 
 int queue_size(queue *q);
 
@@ -0,0 +1,119 @@
+/* MIT License
+ * 
+ * Copyright (c) 2021 Lucas Amaro
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "replay.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define replay_item_lt(l, r) ((l).key < (r).key)
+
+la_pqueue(replay_heap, replay_item, replay_item_lt);
+
+int replay_sched_init(replay_sched *q) {
+	q->seq = 0;
+	q->heap = (struct replay_heap_internal*)malloc(sizeof(replay_heap));
+	if (!q->heap) return 1;
+	if (replay_heap_init(q->heap)) {
+		free(q->heap);
+		q->heap = NULL;
+		return 1;
+	}
+	return 0;
+}
+
+void replay_sched_destroy(replay_sched *q) {
+	if (!q->heap) return;
+	replay_heap_destroy(q->heap);
+	free(q->heap);
+	q->heap = NULL;
+}
+
+int replay_sched_push(replay_sched *q, void *s, u64 lag) {
+	u64 lag_class = lag ? 64 - __builtin_clzll(lag) : 0;
+	replay_item it;
+	it.key = q->seq++ + lag_class * REPLAY_LAG_WEIGHT;
+	it.s = s;
+	return replay_heap_insert(q->heap, it);
+}
+
+// back in, keeping its place
+int replay_sched_requeue(replay_sched *q, replay_item it) {
+	return replay_heap_insert(q->heap, it);
+}
+
+int replay_sched_empty(replay_sched *q) {
+	return replay_heap_empty(q->heap);
+}
+
+replay_item replay_sched_pop(replay_sched *q) {
+	return replay_heap_pop(q->heap);
+}
+
+int replay_rate_init(replay_rate *r, u64 rate) {
+	r->rate = rate;
+	r->tokens = 0;
+	r->last = 0;
+	r->bytes = 0;
+	r->waits = 0;
+	return mtx_init(&r->mutex, mtx_plain) != thrd_success;
+}
+
+void replay_rate_destroy(replay_rate *r) {
+	mtx_destroy(&r->mutex);
+}
+
+int replay_skip_trimmed(i64 *offset, u64 from, u64 first) {
+	if (*offset != (i64)from || from >= first) return 0;
+	*offset = first;
+	return 1;
+}
+
+// us to wait before reading more, 0 = go
+u64 replay_rate_delay(replay_rate *r, u64 now) {
+	if (!r->rate) return 0;
+
+	mtx_lock(&r->mutex);
+	if (now > r->last) {
+		if (r->last) {
+			r->tokens += (now - r->last) * r->rate / 1000000;
+			i64 burst = r->rate / REPLAY_BURST_DIV;
+			if (r->tokens > burst) r->tokens = burst;
+		}
+		r->last = now;
+	}
+
+	u64 delay = 0;
+	if (r->tokens < 0) {
+		delay = (u64)-r->tokens * 1000000 / r->rate + 1;
+		r->waits++;
+	}
+	mtx_unlock(&r->mutex);
+	return delay;
+}
+
+void replay_rate_take(replay_rate *r, u64 bytes) {
+	mtx_lock(&r->mutex);
+	r->bytes += bytes;
+	if (r->rate) r->tokens -= bytes;
+	mtx_unlock(&r->mutex);
+}
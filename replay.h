@@ -0,0 +1,76 @@
+/* MIT License
+ * 
+ * Copyright (c) 2021 Lucas Amaro
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "la.h"
+#include "threads.h"
+
+#define REPLAY_LAG_WEIGHT 16 // turns a session twice as far behind yields to later ones
+#define REPLAY_BURST_DIV 10 // unused bandwidth is kept for 1/10 s at most
+
+// sessions waiting for a reader's turn. Ordered by arrival, pushed back
+// by how far behind the head they are: consumers close to live catch up
+// first, a consumer replaying from the start can't hold them back but
+// still gets its turn
+typedef struct replay_item {
+	u64 key;
+	void *s;
+} replay_item;
+
+struct replay_heap_internal;
+
+typedef struct replay_sched {
+	struct replay_heap_internal *heap;
+	u64 seq;
+} replay_sched;
+
+int replay_sched_init(replay_sched *q);
+void replay_sched_destroy(replay_sched *q);
+int replay_sched_push(replay_sched *q, void *s, u64 lag);
+int replay_sched_requeue(replay_sched *q, replay_item it);
+int replay_sched_empty(replay_sched *q);
+replay_item replay_sched_pop(replay_sched *q);
+
+// replay bandwidth shared by every reader, a token bucket readers go into
+// debt with: a read is only held back while earlier ones aren't paid for
+typedef struct replay_rate {
+	mtx_t mutex;
+	u64 rate; // bytes per second, 0 = unlimited
+	i64 tokens;
+	u64 last; // us
+	u64 bytes; // read so far
+	u64 waits; // reads held back
+} replay_rate;
+
+// a read for a session at `from` started at `first`: everything between
+// was trimmed or dropped, nothing will ever send it. The session skips it,
+// unless it moved meanwhile. 1 = skipped
+int replay_skip_trimmed(i64 *offset, u64 from, u64 first);
+
+int replay_rate_init(replay_rate *r, u64 rate);
+void replay_rate_destroy(replay_rate *r);
+u64 replay_rate_delay(replay_rate *r, u64 now);
+void replay_rate_take(replay_rate *r, u64 bytes);
+
+#endif /* REPLAY_H */
@@ -92,6 +92,15 @@ void *ring_buffer_consume(ring_buffer *b, u32 len) {
 	return cur;
 }
 
+// gives back the last len consumed bytes, nothing may be written since
+void ring_buffer_unconsume(ring_buffer *b, u32 len) {
+	b->r -= len;
+	if (b->r < b->buf) {
+		b->r += b->cap;
+		b->w += b->cap;
+	}
+}
+
 #if __linux__
 //#include <sys/memfd.h>
 //#include <linux/memfd.h>
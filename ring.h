@@ -44,6 +44,7 @@ void *ring_buffer_data(ring_buffer *b);
 void *ring_buffer_curw(ring_buffer *b);
 void ring_buffer_addw(ring_buffer *b, u32 len);
 void *ring_buffer_consume(ring_buffer *b, u32 len);
+void ring_buffer_unconsume(ring_buffer *b, u32 len);
 
 #endif /* RING_H */
 
@@ -25,13 +25,17 @@
 #define _POSIX_C_SOURCE 200112L
 #endif
 
+#include "cache.h"
 #include "command.h"
+#include "commit.h"
 #include "common.h"
 #include "ev.h"
 #include "la.h"
 #include "lib/liblmdb/lmdb.h"
+#include "loop.h"
 #include "pool.h"
 #include "queue.h"
+#include "replay.h"
 #include "session.h"
 #include "sock.h"
 #include "store.h"
@@ -55,25 +59,25 @@
 
 #define N_READ_TRDS 4
 #define MAX_READ_TRDS 32
+#define READER_BATCH 64 // sessions taken off a reader queue at once
+#define READER_STEAL_WAIT 64 // ms, longest wait of an idle reader between steal attempts
+#define READER_TURN 16 // sessions served before new ones are scheduled
+
+#define N_WRITE_TRDS 4
+#define MAX_WRITE_TRDS 32
+
+#define N_IO_TRDS 1 // loops, the first runs on the main thread
+#define MAX_IO_TRDS 32
 
 #define READER_WORKER_QUEUE_SIZE ((sizeof(session*)+sizeof(u32))*maxconn * 2)
-#define NOTIFY_READER_WORKER_QUEUE_SIZE (READER_WORKER_QUEUE_SIZE)
+#define NOTIFY_READER_WORKER_QUEUE_SIZE ((sizeof(session*)+sizeof(int)+sizeof(u32))*maxconn * 2)
 #define WRITER_WORKER_QUEUE_SIZE (MAX_MESSAGE_SIZE * 256)
 #define STORE_WORKER_QUEUE_SIZE (WRITER_WORKER_QUEUE_SIZE * 4)
 
 static int store_visitor(u64 offset, char *buf, u32 len, void *ctx) {
 	session *s = (session*)ctx;
-	connection *conn = (connection*)s;
 
-	u32 total_len = sizeof(u64) + len;
-	connection_iovec parts[3];
-	parts[0].buf = &total_len;
-	parts[0].len = sizeof(u32);
-	parts[1].buf = &offset;
-	parts[1].len = sizeof(u64);
-	parts[2].buf = buf;
-	parts[2].len = len;
-	if (connection_send_multi(conn, parts, 3)) { // full send buffer
+	if (session_send_event(s, offset, WIRE_RAW, buf, len)) { // full send buffer
 		return 1;
 	}
 
@@ -82,97 +86,517 @@ static int store_visitor(u64 offset, char *buf, u32 len, void *ctx) {
 	return 0;
 }
 
-int reader_worker(void *arg) {
-	struct ev_loop *loop = (struct ev_loop *)arg;
-	loop_userdata *u = (loop_userdata*)ev_userdata(loop);
+typedef struct wire_context {
+	session *s;
+	u32 bytes;
+	u32 max; // bytes, a session's quantum
+} wire_context;
 
-	MDB_txn *txn;
-	if (mdb_txn_begin(u->s.env, NULL, MDB_RDONLY, &txn)) {
+// events as stored, for sessions decompressing them
+static int wire_visitor(u64 offset, u8 codec, char *buf, u32 len, void *ctx) {
+	wire_context *w = (wire_context*)ctx;
+	if (w->bytes && w->bytes + len > w->max) return 1;
+
+	if (session_send_event(w->s, offset, codec == STORE_CODEC_LZ4 ? WIRE_LZ4 : WIRE_RAW, buf, len)) {
 		return 1;
 	}
 
-	MDB_cursor *mc;
-	if (mdb_cursor_open(txn, u->s.dbi, &mc)) {
-		return 1;
+	w->s->offset = offset+1;
+	w->bytes += len;
+	return 0;
+}
+
+#define REPLAY_BATCH_BYTES (MAX_MESSAGE_SIZE * 4)
+#define REPLAY_BATCH_EVENTS 4096
+
+// events read from the store once, for every session of the topic
+// replaying the same range
+typedef struct reader_context {
+	struct ev_loop *loop;
+	u32 id; // own queue, the others' are stolen from while idle
+} reader_context;
+
+typedef struct replay_batch {
+	u64 first;
+	u32 n;
+	u32 len;
+	u32 max; // bytes, a session's quantum
+	u32 ends[REPLAY_BATCH_EVENTS];
+	char data[REPLAY_BATCH_BYTES];
+} replay_batch;
+
+// compressed events are decompressed right after the batch's data
+static char *replay_reserve(void *ctx, u32 *cap) {
+	replay_batch *b = (replay_batch*)ctx;
+	if (b->n == REPLAY_BATCH_EVENTS) return NULL;
+	*cap = REPLAY_BATCH_BYTES - b->len;
+	return b->data + b->len;
+}
+
+static int replay_visitor(u64 offset, char *buf, u32 len, void *ctx) {
+	replay_batch *b = (replay_batch*)ctx;
+	if (b->n == REPLAY_BATCH_EVENTS || (b->n && b->len + len > b->max)) return 1;
+	if (!b->n) b->first = offset;
+	else if (offset != b->first + b->n) return 1;
+
+	if (buf != b->data + b->len) memcpy(b->data + b->len, buf, len);
+	b->len += len;
+	b->ends[b->n++] = b->len;
+	return 0;
+}
+
+// > watchers_mutex > session_mutex
+static void replay_fanout(session *s, void *ctx) {
+	replay_batch *b = (replay_batch*)ctx;
+
+	session_lock(s);
+	if (!s->live && !s->wire && s->offset >= (i64)b->first && s->offset < (i64)(b->first + b->n)) {
+		int sent = 0;
+		for (u32 i = s->offset - b->first; i < b->n; i++) {
+			u32 begin = i ? b->ends[i-1] : 0;
+			if (store_visitor(b->first + i, b->data + begin, b->ends[i] - begin, s)) break;
+			sent = 1;
+		}
+		if (sent) {
+			loop_write_later(s);
+		}
 	}
+	session_unlock(s);
+}
 
-	mdb_txn_reset(txn);
+typedef struct notify_context {
+	loop_userdata *u;
+	session *s;
+	int itopic;
+} notify_context;
+
+static void notify_waiter(void *ctx) {
+	notify_context *n = (notify_context*)ctx;
+	queue_buffer_part parts[2];
+	parts[0].buf = &n->s;
+	parts[0].len = sizeof(session*);
+	parts[1].buf = &n->itopic;
+	parts[1].len = sizeof(int);
+	if (queue_push_multi(&n->u->notify_worker_queue, parts, 2, 0)) {
+		// should never happen
+	}
+}
 
-	for (;;) {
-		u8 *buf;
-		u32 len;
+// sessions whose read found nothing wait for the next commit, routed back
+// to their topic's reader from there. One that came in since the read
+// is not waited for, nothing may follow it
+static void reader_notify_later(loop_userdata *u, session *s, int itopic, u64 offset) {
+	notify_context n = { u, s, itopic };
+	if (store_wait_commit(&u->s, itopic, offset, notify_waiter, &n)) {
+		queue_push(READER_QUEUE(u, itopic), &s, sizeof(session*), 0);
+	}
+}
+
+// > session_mutex, unlocked on return
+static void reader_done(loop_userdata *u, struct ev_loop *loop, session *s, int rc) {
+	int should_write = 0;
+	switch(rc) {
+	case 1: // done - write
+	case 3: // more - write
+		should_write = 1;
+		break;
+	case 2: // done - nothing to write
+		reader_notify_later(u, s, s->watch, s->offset);
+		break;
+	case 0: // full buffer
+		break;
+	case -1: // error
+		break;
+	}
 
-		// > rqueue
-		queue_peek(&u->reader_worker_queue, (void**)&buf, &len, 1);
+	if (should_write) {
+		loop_write_later(s);
+	}
+
+	session_unlock(s);
+}
+
+// reads a batch once, every session of the topic within its range gets it
+static u32 reader_replay(loop_userdata *u, struct ev_loop *loop, MDB_txn *txn,
+		replay_batch *batch, session *s, int itopic, u64 offset) {
+	batch->n = 0;
+	batch->len = 0;
+	int rc = store_read_into(&u->s, txn, itopic, offset, replay_visitor, replay_reserve, batch);
+
+	if (rc == 2) { // done - nothing to write
+		reader_notify_later(u, s, itopic, offset);
+		return 0;
+	}
+	if (rc == -1 || !batch->n) return 0;
+
+	// trimmed past the session since it was scheduled, the batch starts at
+	// the new watermark. Else the fan out leaves it behind for good
+	if (batch->first > offset) {
+		session_lock(s);
+		if (!s->live && s->watch == itopic) {
+			replay_skip_trimmed(&s->offset, offset, batch->first);
+		}
+		session_unlock(s);
+	}
+
+	// > watchers_mutex > session_mutex
+	watchers_lock(&u->ws, itopic);
+	watchers_foreach(&u->ws, itopic, replay_fanout, batch);
+	watchers_unlock(&u->ws, itopic);
+	// < session_mutex < watchers_mutex
+
+	return batch->len;
+}
+
+// takes up to READER_BATCH sessions off q, waiting until deadline if given.
+// Returns 1 on the close signal, which is left for q's own reader
+static int reader_take(queue *q, struct timespec *deadline, session **ss, u32 *n) {
+	u8 *buf;
+	u32 len;
+
+	// > rqueue
+	if (deadline) {
+		if (queue_peek_until(q, deadline, (void**)&buf, &len)) return 0;
+	} else if (queue_peek(q, (void**)&buf, &len, 0)) {
+		return 0;
+	}
+
+	do {
 		if (!len) { // close signal
-			queue_drop(&u->reader_worker_queue);
-			break;
+			queue_drop(q);
+			return 1;
 		}
+		memcpy(ss + (*n)++, buf, sizeof(session*));
+	} while (*n < READER_BATCH && !queue_peek_next(q, (void**)&buf, &len));
 
-		session *s;
-		memcpy(&s, buf, sizeof(session*));
+	queue_pop(q);
+	// < rqueue
+	return 0;
+}
+
+#define ZEROCOPY_EVENTS (CONNECTION_MAX_IOV / 2) // frame header and data each
+#define ZEROCOPY_FRAME (sizeof(u32) + sizeof(u64))
+
+// a session's events written straight from the store's map. Events that
+// aren't in the map (decompressed) go to the scratch space, pointers only
+// live until the read txn is reset
+typedef struct zerocopy_batch {
+	u32 n;
+	u32 bytes;
+	u32 max; // bytes, a session's quantum
+	u64 offsets[ZEROCOPY_EVENTS];
+	u8 frames[ZEROCOPY_EVENTS][ZEROCOPY_FRAME];
+	connection_iovec parts[ZEROCOPY_EVENTS * 2];
+
+	char *map;
+	size_t mapsize;
+	char *scratch; // [REPLAY_BATCH_BYTES]
+	u32 scratch_len;
+} zerocopy_batch;
+
+static char *zerocopy_reserve(void *ctx, u32 *cap) {
+	zerocopy_batch *z = (zerocopy_batch*)ctx;
+	if (z->n == ZEROCOPY_EVENTS) return NULL;
+	*cap = REPLAY_BATCH_BYTES - z->scratch_len;
+	return z->scratch + z->scratch_len;
+}
+
+static int zerocopy_visitor(u64 offset, char *buf, u32 len, void *ctx) {
+	zerocopy_batch *z = (zerocopy_batch*)ctx;
+	if (z->n == ZEROCOPY_EVENTS || (z->n && z->bytes + ZEROCOPY_FRAME + len > z->max)) return 1;
+	// the rest of a partly sent frame must fit the empty send ring. Events
+	// over MAX_EVENT_SIZE are refused on write, older ones aren't sent
+	if (ZEROCOPY_FRAME + len > MAX_MESSAGE_SIZE) return 1;
+
+	if (buf == z->scratch + z->scratch_len) { // decompressed in place
+		z->scratch_len += len;
+	} else if (buf < z->map || buf + len > z->map + z->mapsize) {
+		if (z->scratch_len + len > REPLAY_BATCH_BYTES) return 1;
+		memcpy(z->scratch + z->scratch_len, buf, len);
+		buf = z->scratch + z->scratch_len;
+		z->scratch_len += len;
+	}
+
+	u32 total_len = sizeof(u64) + len;
+	memcpy(z->frames[z->n], &total_len, sizeof(u32));
+	memcpy(z->frames[z->n] + sizeof(u32), &offset, sizeof(u64));
+	z->parts[z->n*2].buf = z->frames[z->n];
+	z->parts[z->n*2].len = ZEROCOPY_FRAME;
+	z->parts[z->n*2+1].buf = buf;
+	z->parts[z->n*2+1].len = len;
+	z->offsets[z->n++] = offset;
+	z->bytes += ZEROCOPY_FRAME + len;
+	return 0;
+}
+
+// reads a session's events and writes them to its socket from where they
+// are, only what the socket doesn't take goes through the send ring.
+// Returns the bytes read
+static u32 reader_zerocopy(loop_userdata *u, struct ev_loop *loop, MDB_txn *txn,
+		zerocopy_batch *z, session *s, int itopic, u64 offset) {
+	connection *conn = (connection*)s;
+
+	MDB_envinfo info;
+	mdb_env_info(u->s.env, &info);
+	z->map = (char*)info.me_mapaddr;
+	z->mapsize = info.me_mapsize;
+	z->n = 0;
+	z->bytes = 0;
+	z->scratch_len = 0;
+
+	// > session
+	session_lock(s);
+	if (s->live || s->watch != itopic || s->offset != (i64)offset) { // moved meanwhile
+		session_unlock(s);
+		return 0;
+	}
+
+	int rc = store_read_into(&u->s, txn, itopic, offset, zerocopy_visitor, zerocopy_reserve, z);
+	if (rc == 2) { // done - nothing to write
+		reader_notify_later(u, s, itopic, offset);
+		session_unlock(s);
+		return 0;
+	}
+	if (rc == -1 || !z->n) {
+		session_unlock(s);
+		return 0;
+	}
+
+	int bytes = connection_write_direct(conn, z->parts, z->n * 2);
+	if (bytes < 0) bytes = 0; // the loop finds out on its next write
+
+	// sent events are done, the rest of a partly sent one goes to the ring
+	u32 sent = bytes;
+	for (u32 i = 0; i < z->n && sent; i++) {
+		u32 frame = z->parts[i*2].len + z->parts[i*2+1].len;
+		if (sent < frame) {
+			connection_iovec rest[2];
+			u32 n = 0;
+			for (u32 j = i*2; j < i*2+2; j++) {
+				if (sent >= z->parts[j].len) {
+					sent -= z->parts[j].len;
+					continue;
+				}
+				rest[n].buf = (u8*)z->parts[j].buf + sent;
+				rest[n++].len = z->parts[j].len - sent;
+				sent = 0;
+			}
+			if (connection_send_multi(conn, rest, n)) {
+				break; // can't happen for a frame that fits, the ring was empty
+			}
+		} else {
+			sent -= frame;
+		}
+		s->offset = z->offsets[i] + 1;
+	}
+
+	// the loop writes what's left, then enqueues the session again
+	loop_write_later(s);
+
+	session_unlock(s);
+	// < session
+
+	return z->bytes;
+}
+
+// a session's turn: one batch from the cache or the store. Sessions the
+// store would serve while replay bandwidth is used up wait for the next
+// turn, the us to wait for it are returned
+static u64 reader_serve(loop_userdata *u, struct ev_loop *loop, MDB_txn *txn,
+		replay_batch *batch, zerocopy_batch *z, replay_sched *sched) {
+	replay_item held[READER_TURN];
+	u32 n_held = 0;
+	u64 delay = 0;
+	int reading = 0;
 
-		queue_pop(&u->reader_worker_queue);
-		// < rqueue
+	for (u32 turn = 0; turn < READER_TURN && !replay_sched_empty(sched); turn++) {
+		replay_item it = replay_sched_pop(sched);
+		session *s = (session*)it.s;
 
 		// > session
 		session_lock(s);
 
-		s->enqueued = 0;
 		if (s->live || !s->watch) {
+			s->enqueued = 0;
 			session_unlock(s);
 			continue;
 		}
 
-		if (mdb_txn_renew(txn)) {
-			// err
+		// events below the watermark are gone, the store reads from it anyway
+		replay_skip_trimmed(&s->offset, s->offset, u->s.ts[s->watch].low);
+
+		// near the head: served from memory, no txn
+		int rc = event_cache_read(&u->cache, s->watch, s->offset, store_visitor, s);
+		if (rc != -2) {
+			s->enqueued = 0;
+			reader_done(u, loop, s, rc);
+			continue;
 		}
-		if (mdb_cursor_renew(txn, mc)) {
-			// err
+
+		if (!delay) delay = replay_rate_delay(&u->replay, group_commit_now());
+		if (delay) { // still enqueued
+			session_unlock(s);
+			held[n_held++] = it;
+			continue;
 		}
 
-		int should_write = 0;
-		switch(store_read_some(mc, s->watch, s->offset, store_visitor, s)) {
-		case 1: // done - write
-		case 3: // more - write
-			should_write = 1;
-			break;
-		case 2: // done - nothing to write
-			if (queue_push(&u->notify_worker_queue, &s, sizeof(session*), 0)) {
-				// should never happen
+		// holds off map growth until the txn is reset
+		if (!reading) {
+			if (store_read_begin(&u->s, txn)) {
+				s->enqueued = 0;
+				session_unlock(s);
+				continue;
 			}
-			break;
-		case 0: // full buffer
-			break;
-		case -1: // error
-			break;
+			reading = 1;
 		}
 
-		mdb_txn_reset(txn);
+		s->enqueued = 0;
 
-		if (should_write) {
-			mtx_lock(&u->mutex);
-			connection_enable_write((connection*)s, loop);
-			mtx_unlock(&u->mutex);
+		// events as stored: the session's own read, nothing to share
+		if (s->wire) {
+			wire_context w = { s, 0, u->replay_quantum };
+			rc = store_read_stored(&u->s, txn, s->watch, s->offset, wire_visitor, &w);
+			replay_rate_take(&u->replay, w.bytes);
+			reader_done(u, loop, s, rc);
+			continue;
 		}
 
+		int itopic = s->watch;
+		u64 offset = s->offset;
 		session_unlock(s);
+		// < session
 
-		if (should_write) {
-			ev_async_send(loop, &u->async_w);
+		replay_rate_take(&u->replay, z ?
+				reader_zerocopy(u, loop, txn, z, s, itopic, offset) :
+				reader_replay(u, loop, txn, batch, s, itopic, offset));
+	}
+	if (reading) {
+		store_read_end(&u->s, txn);
+	}
+
+	for (u32 i = 0; i < n_held; i++) {
+		if (replay_sched_requeue(sched, held[i])) {
+			// out of memory, dropped until the session is enqueued again
+			session *s = (session*)held[i].s;
+			session_lock(s);
+			s->enqueued = 0;
+			session_unlock(s);
 		}
 	}
+	return delay;
+}
+
+// sessions taken off a queue wait for their turn by lag
+static void reader_schedule(loop_userdata *u, replay_sched *sched, session **ss, u32 n) {
+	for (u32 i = 0; i < n; i++) {
+		session *s = ss[i];
+		session_lock(s);
+		i64 head = u->write_offsets[s->watch];
+		u64 lag = s->watch && head > s->offset ? head - s->offset : 0;
+		if (replay_sched_push(sched, s, lag)) {
+			s->enqueued = 0; // out of memory, dropped until enqueued again
+		}
+		session_unlock(s);
+	}
+}
 
-	mdb_cursor_close(mc);
+int reader_worker(void *arg) {
+	reader_context *ctx = (reader_context*)arg;
+	struct ev_loop *loop = ctx->loop;
+	loop_userdata *u = (loop_userdata*)ev_userdata(loop);
+	queue *own = u->reader_worker_queues + ctx->id;
+
+	replay_batch *batch = (replay_batch*)malloc(sizeof(replay_batch));
+	if (!batch) {
+		return 1;
+	}
+	batch->max = u->replay_quantum;
+
+	// sessions are written to one by one, the batch is scratch space
+	zerocopy_batch *z = NULL;
+	if (u->zerocopy) {
+		z = (zerocopy_batch*)malloc(sizeof(zerocopy_batch));
+		if (!z) {
+			free(batch);
+			return 1;
+		}
+		z->max = u->replay_quantum;
+		z->scratch = batch->data;
+	}
+
+	replay_sched sched;
+	if (replay_sched_init(&sched)) {
+		free(z);
+		free(batch);
+		return 1;
+	}
+
+	MDB_txn *txn;
+	if (mdb_txn_begin(u->s.env, NULL, MDB_RDONLY, &txn)) {
+		replay_sched_destroy(&sched);
+		free(z);
+		free(batch);
+		return 1;
+	}
+
+	mdb_txn_reset(txn);
+
+	u64 wait = 1000; // us
+	u64 throttled = 0; // us
+	for (;;) {
+		session *ss[READER_BATCH];
+		u32 n = 0;
+
+		if (reader_take(own, NULL, ss, &n)) break;
+
+		// idle: help readers that are behind, then wait on our own queue
+		// a while before looking again
+		int idle = replay_sched_empty(&sched);
+		for (u32 i = 1; idle && !n && i < u->n_readers; i++) {
+			reader_take(u->reader_worker_queues + (ctx->id + i) % u->n_readers, NULL, ss, &n);
+		}
+		if (!n && (idle || throttled)) {
+			u64 us = idle ? wait : throttled;
+			if (us > READER_STEAL_WAIT * 1000) us = READER_STEAL_WAIT * 1000;
+			struct timespec deadline;
+			timespec_get(&deadline, TIME_UTC);
+			deadline.tv_sec += us / 1000000;
+			deadline.tv_nsec += (us % 1000000) * 1000;
+			if (deadline.tv_nsec >= 1000000000) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+			if (reader_take(own, &deadline, ss, &n)) break;
+			if (!n && idle) {
+				if (wait < READER_STEAL_WAIT * 1000) wait *= 2;
+				continue;
+			}
+		}
+		if (n) wait = 1000;
+
+		reader_schedule(u, &sched, ss, n);
+		throttled = reader_serve(u, loop, txn, batch, z, &sched);
+	}
 
 	mdb_txn_abort(txn);
+	replay_sched_destroy(&sched);
+	free(z);
+	free(batch);
 
 	return 0;
 }
 
+// a topic's commands, and a session's without one, go to the same writer
+typedef struct writer_context {
+	struct ev_loop *loop;
+	u32 id;
+} writer_context;
+
 int writer_worker(void *arg) {
-	struct ev_loop *loop = (struct ev_loop *)arg;
+	writer_context *ctx = (writer_context*)arg;
+	struct ev_loop *loop = ctx->loop;
 	loop_userdata *u = (loop_userdata*)ev_userdata(loop);
+	queue *q = u->writer_worker_queues + ctx->id;
 
 	char msg[MAX_MESSAGE_SIZE];
 	for (;;) {
@@ -180,10 +604,10 @@ int writer_worker(void *arg) {
 		u32 len;
 
 		// > wqueue
-		queue_peek(&u->writer_worker_queue, (void**)&buf, &len, 1);
+		queue_peek(q, (void**)&buf, &len, 1);
 
 		if (!len) { // close signal
-			queue_drop(&u->writer_worker_queue);
+			queue_drop(q);
 			// << wqueue
 			break;
 		}
@@ -196,7 +620,7 @@ int writer_worker(void *arg) {
 
 		memcpy(msg, buf, len);
 
-		queue_pop(&u->writer_worker_queue);
+		queue_pop(q);
 		// < wqueue
 
 		process_command(loop, s, msg, len);
@@ -205,16 +629,51 @@ int writer_worker(void *arg) {
 	return 0;
 }
 
+// wait for more of the batch, queue drained but the commit can wait a bit
+static int store_linger(loop_userdata *u, u32 *mark, struct timespec *deadline,
+		char **buf, u32 *len) {
+	if (queue_peek_wait(&u->store_worker_queue, mark, deadline, (void**)buf, len)) {
+		group_commit_idle(&u->gc);
+		return 1;
+	}
+	return 0;
+}
+
 int store_worker(void *arg) {
 	struct ev_loop *loop = (struct ev_loop *)arg;
 	loop_userdata *u = (loop_userdata*)ev_userdata(loop);
+	int backlog = 0;
 
 	for (;;) {
 		char *buf;
 		u32 len;
 
-		queue_peek(&u->store_worker_queue, (void**)&buf, &len, 1);
+		// reclaim dropped topics and train dictionaries while there is
+		// nothing to write
+		if (queue_peek(&u->store_worker_queue, (void**)&buf, &len,
+				!store_reclaim_pending(&u->s) && !store_train_pending(&u->s))) {
+			if (store_train_dicts(&u->s)) {
+				puts("dictionary training failed");
+			}
+			if (store_reclaim(&u->s) < 0 && (!u->s.map_full || store_grow(&u->s, 1))) {
+				puts("reclaim failed");
+				goto write_err;
+			}
+			continue;
+		}
+
+		// grow ahead of the batch while there is room, ingest waits meanwhile
+		if (store_grow(&u->s, 0)) {
+			goto write_err_drop;
+		}
+
+		u32 mark = queue_mark(&u->store_worker_queue);
+		struct timespec deadline;
 
+		// trade ratio for speed while writes back up
+		u->s.acceleration = 1 + (int)(16ULL * mark / STORE_WORKER_QUEUE_SIZE);
+		group_commit_begin(&u->gc, group_commit_now(), backlog);
+retry:
 		if (store_write_txn_begin(&u->s)) {
 			goto write_err_drop;
 		}
@@ -228,7 +687,8 @@ int store_worker(void *arg) {
 				goto done;
 			}
 
-			if (*buf != 'e') goto create_drop;
+			if (*buf != 'e' && *buf != 'z' && *buf != 'b') goto create_drop;
+			char cmd = *buf;
 			buf++;
 			len--;
 
@@ -237,9 +697,25 @@ int store_worker(void *arg) {
 			buf += sizeof(int);
 			len -= sizeof(int);
 
-			if (store_write_event(&u->s, itopic, buf, len)) {
-				goto write_err_drop;
+			// the time index follows ingest, not commit times
+			memcpy(&u->s.now, buf, sizeof(u64));
+			buf += sizeof(u64);
+			len -= sizeof(u64);
+
+			if (cmd == 'b') {
+				// a producer's batch, each event with its length, checked by the writer
+				u32 n;
+				if (store_write_batch(&u->s, itopic, buf, len, &n)) {
+					goto batch_err;
+				}
+				group_commit_add_events(&u->gc, n, len - n * sizeof(u32));
+			} else if (cmd == 'z' ? store_write_compressed(&u->s, itopic, buf, len) :
+					store_write_event(&u->s, itopic, buf, len)) {
+				goto batch_err;
+			} else {
+				group_commit_add(&u->gc, len);
 			}
+			if (group_commit_full(&u->gc)) break; // the rest goes to the next batch
 
 			continue;
 create_drop:
@@ -258,27 +734,81 @@ create_drop:
 				}
 				break;
 			case 'd':
-				// TODO
+				{
+				int itopic;
+				memcpy(&itopic, buf+1, sizeof(int));
+
+				if (store_drop(&u->s, itopic)) {
+					goto batch_err;
+				}
+				}
+				break;
+			case 'r':
+				{
+				int itopic;
+				store_retention r;
+				memcpy(&itopic, buf+1, sizeof(int));
+				memcpy(&r, buf+1+sizeof(int), sizeof(store_retention));
+
+				if (store_set_retention(&u->s, itopic, &r)) {
+					goto batch_err;
+				}
+				}
+				break;
+			case 't': // retention tick
 				break;
 			}
 
 
-		} while (!queue_peek_next(&u->store_worker_queue, (void**)&buf, &len));
+		} while (!queue_peek_next(&u->store_worker_queue, (void**)&buf, &len) ||
+				(!group_commit_deadline(&u->gc, &deadline) &&
+				!store_linger(u, &mark, &deadline, &buf, &len)));
 
 		queue_pop(&u->store_worker_queue);
 
+		u64 commit_start = group_commit_now();
 		if (store_write_txn_end(&u->s)) {
 			goto write_err;
 		}
+		u64 committed = group_commit_now();
+		group_commit_done(&u->gc, commit_start, committed);
+
+		// more writes came in meanwhile
+		backlog = queue_size(&u->store_worker_queue) > 0;
+
+		if (store_retain(&u->s)) {
+			puts("retention check failed");
+		}
+
+		// one chunk per commit so a big drop can't starve writers
+		if (store_reclaim(&u->s) < 0 && (!u->s.map_full || store_grow(&u->s, 1))) {
+			puts("reclaim failed");
+			goto write_err;
+		}
 
 		// notify readers
 		if (queue_peek(&u->notify_worker_queue, (void**)&buf, &len, 0)) continue;
 		do {
-			if (queue_push(&u->reader_worker_queue, buf, len, 0)) {
+			session *s;
+			int itopic;
+			memcpy(&s, buf, sizeof(session*));
+			memcpy(&itopic, buf + sizeof(session*), sizeof(int));
+			if (queue_push(READER_QUEUE(u, itopic), &s, sizeof(session*), 0)) {
 				// should not happen
 			}
 		} while (!queue_peek_next(&u->notify_worker_queue, (void**)&buf, &len));
 		queue_pop(&u->notify_worker_queue);
+		continue;
+
+batch_err:
+		// full map: grow it and write the whole batch again
+		store_write_txn_abort(&u->s);
+		if (!u->s.map_full || store_grow(&u->s, 1)) {
+			goto write_err_drop;
+		}
+		queue_rewind(&u->store_worker_queue, mark, (void**)&buf, &len);
+		group_commit_rewind(&u->gc);
+		goto retry;
 	}
 done:
 	return 0;
@@ -290,13 +820,28 @@ write_err:
 	return 1;
 }
 
-// > loop > session > rqueue
-// > loop > session > wqueue
+int sync_worker(void *arg) {
+	struct ev_loop *loop = (struct ev_loop *)arg;
+	loop_userdata *u = (loop_userdata*)ev_userdata(loop);
+
+	for (;;) {
+		int rc = store_sync(&u->s, u->sync_interval);
+		if (rc < 0) {
+			puts("sync failed");
+			ev_async_send(loop, &u->async_close_w);
+			return 1;
+		}
+		if (rc) break; // stopped, after a last flush
+	}
+
+	return 0;
+}
+
+// > session > rqueue
+// > session > wqueue
 void io_cb(struct ev_loop *loop, struct ev_io* watcher, int revents) {
 	loop_userdata *u = (loop_userdata*)ev_userdata(loop);
 
-	mtx_unlock(&u->mutex);
-	// > loop
 	session *s = (session*)watcher;
 	connection *conn = (connection*)s;
 
@@ -304,17 +849,13 @@ void io_cb(struct ev_loop *loop, struct ev_io* watcher, int revents) {
 		// > session
 		session_lock(s);
 
-		//mtx_lock(&u->mutex);
 		if (connection_onwrite(conn, loop) < 0) { // err
-			//mtx_unlock(&u->mutex);
 			goto disconnect;
 		}
-		//mtx_unlock(&u->mutex);
 
 		if (connection_empty_send(conn)) {
-			mtx_lock(&u->mutex);
 			connection_disable_write(conn, loop);
-			mtx_unlock(&u->mutex);
+			s->armed = 0;
 		}
 
 		if (s->watch && !s->live) {
@@ -324,7 +865,7 @@ void io_cb(struct ev_loop *loop, struct ev_io* watcher, int revents) {
 
 			// read some
 			// > rqueue
-			if (queue_push(&u->reader_worker_queue, &s, sizeof(session*), 0)) {
+			if (queue_push(READER_QUEUE(u, s->watch), &s, sizeof(session*), 0)) {
 				// < rqueue
 				// should never happen with a reader queue big enough
 				// but if it happens, disconnect
@@ -344,12 +885,9 @@ unlock:
 	}
 
 	session_lock(s);
-	//mtx_lock(&u->mutex);
 	if (connection_onread(conn) < 0) {
-		//mtx_unlock(&u->mutex);
 		goto disconnect;
 	}
-	//mtx_unlock(&u->mutex);
 
 	for (;;) {
 		connection_iovec parts[2];
@@ -381,33 +919,51 @@ unlock:
 		if (validate_command((char*)parts[1].buf, parts[1].len) == 1) {
 			// writer
 			// > wqueue
-			queue_push_multi(&u->writer_worker_queue, qparts, 2, 1);
+			u32 shard = command_shard((char*)parts[1].buf, parts[1].len, io_loop_session_id(s));
+			queue_push_multi(WRITER_QUEUE(u, shard), qparts, 2, 1);
 		}
 
 		connection_consume_multi(conn, parts, 2);
 	}
 	session_unlock(s);
 done:
-	mtx_lock(&u->mutex);
 	return;
 disconnect:
 	session_unlock(s);
 
 	close(((ev_io*)s)->fd);
 
-	watchers_lock(&u->ws);
-	session_lock(s);
+	int from = watchers_lock_move(&u->ws, 0, s);
 	watchers_update_watcher(&u->ws, 0, 0, 0, s);
-	session_unlock(s);
-	watchers_unlock(&u->ws);
+	watchers_unlock_move(&u->ws, from, 0, s);
 
-	session_pool_free(&u->pool, s);
-
-	mtx_lock(&u->mutex);
 	ev_io_stop(loop, (ev_io*)s);
+	io_loop_free(s->io, s);
 	return;
 }
 
+static void loop_start_session(io_loop *io, int fd) {
+	session *s = io_loop_alloc(io);
+	if (!s) {
+		close(fd);
+		return;
+	}
+
+	ev_io_init((ev_io*)s, io_cb, fd, EV_READ);
+	ev_io_start(io->loop, (ev_io*)s);
+}
+
+// loops only start sessions from their own pool, the one handed fd starts it
+// on its wakeup
+static void loop_hand_off(loop_userdata *u, io_loop *from, int fd) {
+	int to = io_loop_hand_off(u->loops, u->n_loops, from - u->loops, fd);
+	if (to < 0) {
+		close(fd); // every loop is full
+		return;
+	}
+	ev_async_send(u->loops[to].loop, &u->loops[to].async_w);
+}
+
 void accept_cb(struct ev_loop *loop, struct ev_io *w, int revents) {
 	struct sockaddr_in client_addr;
 	socklen_t client_len = sizeof(client_addr);
@@ -422,28 +978,40 @@ void accept_cb(struct ev_loop *loop, struct ev_io *w, int revents) {
 		return;
 	}
 
-	loop_userdata *u = (loop_userdata*)ev_userdata(loop);
-	session *s = session_pool_alloc(&u->pool);
-	if (!s) {
-		close(client_fd);
+	io_loop *io = (io_loop*)w->data;
+	if (atomic_load(&io->n_free) <= 0) {
+		loop_hand_off((loop_userdata*)ev_userdata(loop), io, client_fd);
 		return;
 	}
-
-	ev_io_init((ev_io*)s, io_cb, client_fd, EV_READ);
-	ev_io_start(loop, (ev_io*)s);
+	loop_start_session(io, client_fd);
 }
 
-static void l_release(struct ev_loop *loop) {
-	loop_userdata *u = (loop_userdata*)ev_userdata(loop);
-	mtx_unlock(&u->mutex);
-}
+// arms write interest of the sessions listed since the last wakeup, once
+// each. A closed session is skipped, a reused one gets a spare write event
+static void async_cb(struct ev_loop *loop, ev_async *w, int revents) {
+	io_loop *io = (io_loop*)w->data;
+	if (atomic_load(&io->stop)) {
+		ev_break(loop, EVBREAK_ALL);
+		return;
+	}
 
-static void l_acquire(struct ev_loop *loop) {
-	loop_userdata *u = (loop_userdata*)ev_userdata(loop);
-	mtx_lock(&u->mutex);
+	io_loop_take_handed(io, loop_start_session);
+
+	session *s = session_list_take(&io->dirty);
+	while (s) {
+		session *next = s->dirty_next;
+		atomic_store(&s->dirty, 0);
+		if (!s->armed && ev_is_active((ev_io*)s)) {
+			connection_enable_write((connection*)s, loop);
+			s->armed = 1;
+		}
+		s = next;
+	}
 }
 
-static void async_cb(struct ev_loop *loop, ev_async *w, int revents) {
+static void retention_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+	loop_userdata *u = (loop_userdata*)ev_userdata(loop);
+	queue_push(&u->store_worker_queue, "t", 1, 0); // skipped when busy anyway
 }
 
 static void async_close_cb(struct ev_loop *loop, ev_async *w, int revents) {
@@ -454,6 +1022,12 @@ void sig_cb(struct ev_loop *loop, ev_signal *w, int revents) {
 	ev_break(loop, EVBREAK_ALL);
 }
 
+static int io_worker(void *arg) {
+	io_loop *io = (io_loop*)arg;
+	ev_run(io->loop, 0);
+	return 0;
+}
+
 int setlimits(u64 maxconn) {
 	struct rlimit limit;
 	if (getrlimit(RLIMIT_NOFILE, &limit)) {
@@ -474,7 +1048,7 @@ int setlimits(u64 maxconn) {
 }
 
 void usage() {
-	fprintf(stderr, "Usage: esq-server [-h host] [-p port] [-s size] [-n dbname] [-c maxconnections]\n");
+	fprintf(stderr, "Usage: esq-server [-h host] [-p port] [-s size] [-S maxsize] [-n dbname] [-c maxconnections] [-b] [-D] [-t] [-r maxage:maxbytes:maxevents] [-d full|meta|nosync[:ms]] [-g maxbytes:maxevents:maxlingerus] [-C cacheslots] [-R readers] [-W writers] [-L loops] [-B bytespersec[:quantum]] [-z]\n");
 	exit(1);
 }
 
@@ -483,8 +1057,22 @@ int main(int argc, char **argv) {
 	char *host = "127.0.0.1";
 	char *port = "4000";
 	u64 dbsize = 1ULL<<30;
+	u64 maxdbsize = 0;
 	char *dbname = "db";
 	u64 maxconn = 1024;
+	u32 storeflags = 0;
+	store_retention retention = { 0, 0, 0 };
+	u32 sync_interval = 0;
+	u64 gc_bytes = COMMIT_MAX_BYTES;
+	u64 gc_events = COMMIT_MAX_EVENTS;
+	u64 gc_linger = COMMIT_MAX_LINGER;
+	u32 cache_slots = CACHE_SLOTS;
+	u32 readers = N_READ_TRDS;
+	u32 writers = N_WRITE_TRDS;
+	u32 loops = N_IO_TRDS;
+	u64 replay_rate = 0;
+	u64 replay_quantum = REPLAY_BATCH_BYTES;
+	int zerocopy = 0;
 	for (int i = 1; i < argc; i++) {
 		if (!strcmp(argv[i], "-h")) {
 			if (++i >= argc) usage();
@@ -496,6 +1084,10 @@ int main(int argc, char **argv) {
 			if (++i >= argc) usage();
 			long v = atol(argv[i]);
 			if (v > 0) dbsize *= v;
+		} else if (!strcmp(argv[i], "-S")) {
+			if (++i >= argc) usage();
+			long v = atol(argv[i]);
+			if (v > 0) maxdbsize = v * (1ULL<<30);
 		} else if (!strcmp(argv[i], "-n")) {
 			if (++i >= argc) usage();
 			dbname = argv[i];
@@ -503,6 +1095,65 @@ int main(int argc, char **argv) {
 			if (++i >= argc) usage();
 			long v = atol(argv[i]);
 			maxconn = v;
+		} else if (!strcmp(argv[i], "-b")) {
+			storeflags |= STORE_BLOCKS;
+		} else if (!strcmp(argv[i], "-D")) {
+			storeflags |= STORE_DICTS;
+		} else if (!strcmp(argv[i], "-t")) {
+			storeflags |= STORE_TOPIC_DBS;
+		} else if (!strcmp(argv[i], "-r")) {
+			if (++i >= argc) usage();
+			unsigned long long age, bytes, events;
+			if (sscanf(argv[i], "%llu:%llu:%llu", &age, &bytes, &events) != 3) usage();
+			retention.max_age = age;
+			retention.max_bytes = bytes;
+			retention.max_events = events;
+		} else if (!strcmp(argv[i], "-d")) {
+			if (++i >= argc) usage();
+			if (!strcmp(argv[i], "full")) {
+			} else if (!strcmp(argv[i], "meta")) {
+				storeflags |= STORE_NOMETASYNC;
+			} else if (!strncmp(argv[i], "nosync", 6)) {
+				storeflags |= STORE_NOSYNC;
+				if (argv[i][6] == ':') sync_interval = atol(argv[i] + 7);
+				else if (argv[i][6]) usage();
+			} else {
+				usage();
+			}
+		} else if (!strcmp(argv[i], "-g")) {
+			if (++i >= argc) usage();
+			unsigned long long bytes, events, linger;
+			if (sscanf(argv[i], "%llu:%llu:%llu", &bytes, &events, &linger) != 3) usage();
+			gc_bytes = bytes;
+			gc_events = events;
+			gc_linger = linger;
+		} else if (!strcmp(argv[i], "-C")) {
+			if (++i >= argc) usage();
+			cache_slots = atol(argv[i]);
+		} else if (!strcmp(argv[i], "-R")) {
+			if (++i >= argc) usage();
+			long v = atol(argv[i]);
+			if (v < 1 || v > MAX_READ_TRDS) usage();
+			readers = v;
+		} else if (!strcmp(argv[i], "-W")) {
+			if (++i >= argc) usage();
+			long v = atol(argv[i]);
+			if (v < 1 || v > MAX_WRITE_TRDS) usage();
+			writers = v;
+		} else if (!strcmp(argv[i], "-L")) {
+			if (++i >= argc) usage();
+			long v = atol(argv[i]);
+			if (v < 1 || v > MAX_IO_TRDS) usage();
+			loops = v;
+		} else if (!strcmp(argv[i], "-B")) {
+			if (++i >= argc) usage();
+			unsigned long long rate, quantum;
+			int n = sscanf(argv[i], "%llu:%llu", &rate, &quantum);
+			if (n < 1) usage();
+			replay_rate = rate;
+			if (n == 2) replay_quantum = quantum;
+		} else if (!strcmp(argv[i], "-z")) {
+			zerocopy = 1;
 		} else if (!strcmp(argv[i], "--")) {
 			break;
 		} else {
@@ -518,26 +1169,65 @@ int main(int argc, char **argv) {
 	unsigned int evflags = ev_recommended_backends() | EVBACKEND_KQUEUE | EVBACKEND_EPOLL;
 	struct ev_loop *loop = ev_default_loop (evflags);
 	loop_userdata u;
-	if (mtx_init(&u.mutex, mtx_plain) != thrd_success) {
-		puts("Error creating loop mutex");
-		return 1;
-	}
 
 	if (watchers_init(&u.ws)) {
 		puts("Error creating topic manager");
 		return 1;
 	}
 
-	if (store_init(&u.s, dbname, MAX_TOPICS, dbsize)) {
+	if (store_init(&u.s, dbname, MAX_TOPICS, dbsize, storeflags)) {
 		puts("Error creating store");
 		return 1;
 	}
+	u.s.retention = retention; // default, topics may override it
+	u.s.max_mapsize = maxdbsize; // the map grows up to it, 0 = unlimited
+	u.sync_interval = sync_interval;
+
+	// a batch can't hold more than the store queue anyway
+	if (!gc_bytes || gc_bytes > STORE_WORKER_QUEUE_SIZE / 2) gc_bytes = STORE_WORKER_QUEUE_SIZE / 2;
+	if (group_commit_init(&u.gc, gc_bytes, gc_events, gc_linger)) {
+		puts("Error creating group commit policy");
+		return 1;
+	}
+
+	if (event_cache_init(&u.cache, cache_slots)) {
+		puts("Error creating event cache");
+		return 1;
+	}
+
+	// a turn is one batch at most, and always at least one event
+	if (!replay_quantum || replay_quantum > REPLAY_BATCH_BYTES) replay_quantum = REPLAY_BATCH_BYTES;
+	u.replay_quantum = replay_quantum;
+	u.zerocopy = zerocopy;
+	if (replay_rate_init(&u.replay, replay_rate)) {
+		puts("Error creating replay rate limit");
+		return 1;
+	}
 
-	// pool
-	if (session_pool_init(&u.pool, maxconn)) {
-		puts("Error creating connection pool");
+	// loops, each with its share of the sessions
+	u.n_loops = loops;
+	u.loops = calloc(loops, sizeof(io_loop));
+	if (!u.loops) {
 		return 1;
 	}
+	u32 per_loop = (maxconn + loops - 1) / loops;
+	for (u32 i = 0; i < loops; i++) {
+		io_loop *io = u.loops + i;
+		io->loop = i ? ev_loop_new(evflags) : loop;
+		if (!io->loop) {
+			puts("Error creating loop");
+			return 1;
+		}
+		ev_set_userdata(io->loop, &u);
+
+		if (io_loop_init(io, per_loop, i * per_loop)) {
+			puts("Error creating connection pool");
+			return 1;
+		}
+		ev_async_init(&io->async_w, async_cb);
+		io->async_w.data = io;
+		ev_async_start(io->loop, &io->async_w);
+	}
 
 	// local write offsets copy - begin
 	u.write_offsets = malloc(sizeof(i64) * MAX_TOPICS);
@@ -554,28 +1244,38 @@ int main(int argc, char **argv) {
 	}
 	// local write offsets copy - end
 
-	ev_set_userdata(loop, &u);
-
-	ev_async_init(&u.async_w, async_cb);
-	ev_async_start(loop, &u.async_w);
-
 	ev_async_init(&u.async_close_w, async_close_cb);
 	ev_async_start(loop, &u.async_close_w);
 
-	if (queue_init(&u.reader_worker_queue, READER_WORKER_QUEUE_SIZE)) {
-		puts("Error creating worker queue");
+	// any topic may map to the same reader, each queue holds every session
+	u.n_readers = readers;
+	u.reader_worker_queues = malloc(sizeof(queue) * readers);
+	if (!u.reader_worker_queues) {
 		return 1;
 	}
+	for (u32 i = 0; i < readers; i++) {
+		if (queue_init(u.reader_worker_queues + i, READER_WORKER_QUEUE_SIZE)) {
+			puts("Error creating worker queue");
+			return 1;
+		}
+	}
 
 	if (queue_init(&u.notify_worker_queue, NOTIFY_READER_WORKER_QUEUE_SIZE)) {
 		puts("Error creating notify worker queue");
 		return 1;
 	}
 
-	if (queue_init(&u.writer_worker_queue, WRITER_WORKER_QUEUE_SIZE)) {
-		puts("Error creating writer worker queue");
+	u.n_writers = writers;
+	u.writer_worker_queues = malloc(sizeof(queue) * writers);
+	if (!u.writer_worker_queues) {
 		return 1;
 	}
+	for (u32 i = 0; i < writers; i++) {
+		if (queue_init(u.writer_worker_queues + i, WRITER_WORKER_QUEUE_SIZE)) {
+			puts("Error creating writer worker queue");
+			return 1;
+		}
+	}
 
 	if (queue_init(&u.store_worker_queue, STORE_WORKER_QUEUE_SIZE)) {
 		puts("Error creating store worker queue");
@@ -583,17 +1283,25 @@ int main(int argc, char **argv) {
 	}
 
 	thrd_t read_worker_trds[MAX_READ_TRDS];
-	for (int i = 0; i < N_READ_TRDS; i++) {
-		if (thrd_create(read_worker_trds+i, reader_worker, loop) != thrd_success) {
+	reader_context read_worker_ctxs[MAX_READ_TRDS];
+	for (u32 i = 0; i < readers; i++) {
+		read_worker_ctxs[i].loop = loop;
+		read_worker_ctxs[i].id = i;
+		if (thrd_create(read_worker_trds+i, reader_worker, read_worker_ctxs+i) != thrd_success) {
 			puts("Error creating worker thread");
 			return 1; // TODO: cleanup
 		}
 	}
 
-	thrd_t writer_worker_trd;
-	if (thrd_create(&writer_worker_trd, writer_worker, loop) != thrd_success) {
-		puts("Error creating writer worker thread");
-		return 1;
+	thrd_t write_worker_trds[MAX_WRITE_TRDS];
+	writer_context write_worker_ctxs[MAX_WRITE_TRDS];
+	for (u32 i = 0; i < writers; i++) {
+		write_worker_ctxs[i].loop = loop;
+		write_worker_ctxs[i].id = i;
+		if (thrd_create(write_worker_trds+i, writer_worker, write_worker_ctxs+i) != thrd_success) {
+			puts("Error creating writer worker thread");
+			return 1;
+		}
 	}
 
 	thrd_t store_worker_trd;
@@ -602,12 +1310,27 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 
-	int listen_fd = socket_bindlisten(host, port, BACKLOG_SZ);
-	if (listen_fd < 0) {
-		puts("listen failed");
+	// commits are flushed here unless they flush themselves
+	int syncing = storeflags & (STORE_NOSYNC | STORE_NOMETASYNC);
+	thrd_t sync_worker_trd;
+	if (syncing && thrd_create(&sync_worker_trd, sync_worker, loop) != thrd_success) {
+		puts("Error creating sync worker thread");
 		return 1;
 	}
 
+	// a listening socket per loop, sharing the port
+	for (u32 i = 0; i < loops; i++) {
+		io_loop *io = u.loops + i;
+		int listen_fd = socket_bindlisten(host, port, BACKLOG_SZ);
+		if (listen_fd < 0) {
+			puts("listen failed");
+			return 1;
+		}
+		ev_io_init(&io->accept_w, accept_cb, listen_fd, EV_READ);
+		io->accept_w.data = io;
+		ev_io_start(io->loop, &io->accept_w);
+	}
+
 	signal(SIGPIPE, SIG_IGN);
 
 	ev_signal sigint_watcher;
@@ -618,30 +1341,45 @@ int main(int argc, char **argv) {
 	ev_signal_init(&sigterm_watcher, sig_cb, SIGTERM);
 	ev_signal_start(loop, &sigterm_watcher);
 
-	struct ev_io w_accept;
-	ev_io_init(&w_accept, accept_cb, listen_fd, EV_READ);
-	ev_io_start(loop, &w_accept);
-
-	ev_set_loop_release_cb(loop, l_release, l_acquire);
+	ev_timer retention_watcher;
+	ev_timer_init(&retention_watcher, retention_cb, 1., 1.);
+	ev_timer_start(loop, &retention_watcher);
 
-	mtx_lock(&u.mutex);
+	thrd_t io_trds[MAX_IO_TRDS];
+	for (u32 i = 1; i < loops; i++) {
+		if (thrd_create(io_trds+i, io_worker, u.loops+i) != thrd_success) {
+			puts("Error creating loop thread");
+			return 1;
+		}
+	}
 
 	ev_run(loop, 0);
 
-	mtx_unlock(&u.mutex);
-
-	ev_default_destroy();
-
 	int res;
-	queue_clear(&u.reader_worker_queue);
-	queue_push(&u.reader_worker_queue, NULL, 0, 1);
-	for (int i = 0; i < N_READ_TRDS; i++) {
+	for (u32 i = 1; i < loops; i++) {
+		atomic_store(&u.loops[i].stop, 1);
+		ev_async_send(u.loops[i].loop, &u.loops[i].async_w);
+	}
+	for (u32 i = 1; i < loops; i++) {
+		if (thrd_join(io_trds[i], &res) == thrd_success) {
+		}
+	}
+
+	for (u32 i = 0; i < readers; i++) {
+		queue_clear(u.reader_worker_queues + i);
+		queue_push(u.reader_worker_queues + i, NULL, 0, 1);
+	}
+	for (u32 i = 0; i < readers; i++) {
 		if (thrd_join(read_worker_trds[i], &res) == thrd_success) {
 		}
 	}
 
-	queue_push(&u.writer_worker_queue, NULL, 0, 1);
-	if (thrd_join(writer_worker_trd, &res) == thrd_success) {
+	for (u32 i = 0; i < writers; i++) {
+		queue_push(u.writer_worker_queues + i, NULL, 0, 1);
+	}
+	for (u32 i = 0; i < writers; i++) {
+		if (thrd_join(write_worker_trds[i], &res) == thrd_success) {
+		}
 	}
 
 	queue_push(&u.store_worker_queue, NULL, 0, 1);
@@ -651,18 +1389,38 @@ int main(int argc, char **argv) {
 		fprintf(stderr, "Database full\n");
 	}
 
-	queue_destroy(&u.reader_worker_queue);
+	if (syncing) {
+		store_sync_stop(&u.s);
+		if (thrd_join(sync_worker_trd, &res) == thrd_success) {
+		}
+	}
+
+	for (u32 i = 0; i < readers; i++) {
+		queue_destroy(u.reader_worker_queues + i);
+	}
+	free(u.reader_worker_queues);
 	queue_destroy(&u.notify_worker_queue);
-	queue_destroy(&u.writer_worker_queue);
+	for (u32 i = 0; i < writers; i++) {
+		queue_destroy(u.writer_worker_queues + i);
+	}
+	free(u.writer_worker_queues);
 	queue_destroy(&u.store_worker_queue);
 
 	store_destroy(&u.s);
+	group_commit_destroy(&u.gc);
+	event_cache_destroy(&u.cache);
+	replay_rate_destroy(&u.replay);
 	watchers_destroy(&u.ws);
-	mtx_destroy(&u.mutex);
 
 	free(u.write_offsets);
 
-	session_pool_destroy(&u.pool);
+	// workers are gone, nothing wakes the loops anymore
+	for (u32 i = 0; i < loops; i++) {
+		io_loop_destroy(u.loops + i);
+		if (i) ev_loop_destroy(u.loops[i].loop);
+	}
+	free(u.loops);
+	ev_default_destroy();
 
 	puts("bye");
 
@@ -32,6 +32,11 @@ int session_init(session *s) {
 	s->enqueued = 0;
 	s->watch = 0;
 	s->live = 0;
+	s->wire = 0;
+	atomic_init(&s->dirty, 0);
+	s->dirty_next = NULL;
+	s->armed = 0;
+	s->io = NULL;
 
 	return connection_init(&s->conn, MAX_MESSAGE_SIZE);
 }
@@ -46,6 +51,8 @@ void session_reset(session *s) {
 	s->enqueued = 0;
 	s->watch = 0;
 	s->live = 0;
+	s->wire = 0;
+	s->armed = 0; // a dirty one stays listed until the loop takes it
 
 	connection_reset(&s->conn);
 }
@@ -58,3 +65,38 @@ void session_unlock(session *s) {
 	mtx_unlock(&s->mutex);
 }
 
+// > session. Frames an event for the session's wire format, 1 = full send buffer
+int session_send_event(session *s, u64 offset, u8 codec, char *buf, u32 len) {
+	int tagged = s->wire & WIRE_CODEC;
+	u32 total_len = sizeof(u64) + tagged + len;
+	connection_iovec parts[4];
+	parts[0].buf = &total_len;
+	parts[0].len = sizeof(u32);
+	parts[1].buf = &offset;
+	parts[1].len = sizeof(u64);
+	parts[2].buf = &codec;
+	parts[2].len = tagged;
+	parts[3].buf = buf;
+	parts[3].len = len;
+	return connection_send_multi(&s->conn, parts, 4) ? 1 : 0;
+}
+
+
+void session_list_init(session_list *l) {
+	atomic_init(&l->head, NULL);
+}
+
+// a session is listed once until taken, pushes meanwhile are no-ops
+int session_list_push(session_list *l, session *s) {
+	if (atomic_exchange(&s->dirty, 1)) return 0;
+	session *head = atomic_load(&l->head);
+	do {
+		s->dirty_next = head;
+	} while (!atomic_compare_exchange_weak(&l->head, &head, s));
+	return !head;
+}
+
+// the taker clears dirty once it has read dirty_next
+session *session_list_take(session_list *l) {
+	return atomic_exchange(&l->head, NULL);
+}
@@ -39,12 +39,16 @@ typedef struct session {
 	int enqueued;
 	int watch;
 	int live;
+	u8 wire; // WIRE_ options
 
 	// pool
 	struct session *next;
+	struct io_loop *io; // loop it belongs to
 
-	// bcast
-	struct session *bcast_next;
+	// write interest, armed by the loop
+	atomic_int dirty; // on a session_list
+	struct session *dirty_next;
+	int armed; // loop only
 
 	// watcher tailq
 	SM_TAILQ_ENTRY(session) entries;
@@ -55,5 +59,15 @@ void session_destroy(session *s);
 void session_reset(session *s);
 void session_lock(session *s);
 void session_unlock(session *s);
+int session_send_event(session *s, u64 offset, u8 codec, char *buf, u32 len);
+
+// sessions pushed from any thread without locks, taken all at once
+typedef struct session_list {
+	_Atomic(session*) head;
+} session_list;
+
+void session_list_init(session_list *l);
+int session_list_push(session_list *l, session *s); // 1 = it was empty
+session *session_list_take(session_list *l); // through dirty_next
 
 #endif /* SESSION_H */
@@ -5,10 +5,12 @@
 
 #include "lib/liblmdb/lmdb.h"
 
+#define LZ4_STATIC_LINKING_ONLY
 #include "lib/lz4/lz4.h"
 
 #include <ctype.h>
 #include <stdio.h>
+#include <time.h>
 
 static u64 fnv1a(const void *buf) {
 	const u8 *p = (const u8*)buf;
@@ -30,36 +32,302 @@ static char *la_strdupn(const char *s, u64 len) {
 
 la_hashmap_def(map_str_int, char*, int, fnv1a, la_eq_cstr, -1);
 
-#define STORE_COMPRESSION
+// metadata lives in topic 0's keyspace: topic names are keyed by itopic,
+// every other record by | kind:4 | itopic:16 | arg:28 |
+#define STORE_META_KEY(kind, itopic, arg) \
+	(((u64)(kind) << 44) | ((u64)(itopic) << 28) | (u64)(arg))
+
+#define STORE_META_FORMAT 1
+#define STORE_META_DICTS  2 // first offset of each dictionary version
+#define STORE_META_DICT   3 // arg: version
+#define STORE_META_LOW    4 // first readable offset
+#define STORE_META_TIME   5 // arg: seconds since epoch record, first offset written then
+#define STORE_META_SIZE   6 // bytes stored, then the next offset (checkpoint)
+#define STORE_META_RETENTION 7
+#define STORE_META_EPOCH  8
+
+// block value: header, then (maybe compressed) index of event ends and events
+typedef struct store_block_header {
+	u32 size; // uncompressed size of index + events
+	u16 count;
+	u8 codec;
+	u8 pad;
+} store_block_header;
+
+// dictionary a reader must use for offsets [from, to)
+typedef struct store_dict_ref {
+	u64 from;
+	u64 to;
+	char *data;
+	int size;
+} store_dict_ref;
+
+static void store_find_dict(store *s, MDB_txn *txn, int itopic, u64 offset, store_dict_ref *d) {
+	d->from = 0;
+	d->to = ~0ULL;
+	d->data = NULL;
+	d->size = 0;
+
+	u64 key = STORE_META_KEY(STORE_META_DICTS, itopic, 0);
+	MDB_val k, v;
+	k.mv_data = &key;
+	k.mv_size = sizeof(u64);
+	if (mdb_get(txn, s->dbi, &k, &v)) return;
+
+	u64 *froms = (u64*)v.mv_data;
+	u32 n = v.mv_size / sizeof(u64);
+
+	// last version starting at or before offset
+	u32 lo = 0, hi = n;
+	while (lo < hi) {
+		u32 mid = (lo + hi) / 2;
+		if (froms[mid] <= offset) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo < n) d->to = froms[lo];
+	if (!lo) return;
+	d->from = froms[lo-1];
+
+	key = STORE_META_KEY(STORE_META_DICT, itopic, lo);
+	if (mdb_get(txn, s->dbi, &k, &v)) return;
+	d->data = v.mv_data;
+	d->size = v.mv_size;
+}
+
+static int store_decompress(store_dict_ref *d, char *src, char *dst, int len, int cap) {
+	if (d->data) {
+		return LZ4_decompress_safe_usingDict(src, dst, len, cap, d->data, d->size);
+	}
+	return LZ4_decompress_safe(src, dst, len, cap);
+}
+
+static store_dict *store_dict_new(void) {
+	store_dict *d = (store_dict*)malloc(sizeof(store_dict));
+	if (!d) return NULL;
+	d->stream = LZ4_createStream();
+	if (!d->stream) {
+		free(d);
+		return NULL;
+	}
+	return d;
+}
+
+static void store_dict_free(store_dict *d) {
+	if (!d) return;
+	LZ4_freeStream(d->stream);
+	free(d);
+}
+
+// a new version, its stream is loaded here instead of per compression
+static void store_dict_set(store_dict *d, u32 version, void *data, int size) {
+	d->version = version;
+	d->size = size;
+	d->ratio = 0;
+	memcpy(d->data, data, size);
+	LZ4_loadDict(d->stream, d->data, d->size);
+}
+
+static int store_compressed_size(int csize, int len, int raw_ok) {
+	return raw_ok && csize >= len ? 0 : csize;
+}
+
+// 0: store it raw, lz4 doesn't pay off (only if raw_ok)
+static int store_compress(store *s, int itopic, char *src, char *dst, int len, int cap, int raw_ok) {
+	store_dict *d = s->dicts[itopic];
+	store_ratio *r = s->ratios + itopic;
+
+	if (raw_ok) {
+		if (r->skip) { // incompressible lately
+			r->skip = r->skip > (u32)len ? r->skip - len : 0;
+			return 0;
+		}
+		if (!d && len < STORE_MIN_COMPRESS) return 0;
+	}
+
+	int csize;
+	if (d) {
+		LZ4_resetStream_fast(s->lz4);
+		LZ4_attach_dictionary(s->lz4, d->stream);
+		csize = LZ4_compress_fast_continue(s->lz4, src, dst, len, cap, s->acceleration);
+	} else {
+		csize = LZ4_compress_fast(src, dst, len, cap, s->acceleration);
+	}
+	if (csize <= 0) return csize;
+
+	// schedule a (re)train once a window compresses worse than expected
+	r->raw += len;
+	r->packed += csize;
+	if (r->raw < STORE_DICT_WINDOW) return store_compressed_size(csize, len, raw_ok);
+
+	float ratio = (float)r->packed / r->raw;
+	r->raw = r->packed = 0;
+
+	// not worth it, and no dictionary to come
+	if (raw_ok && ratio >= STORE_RAW_RATIO && (d || !(s->flags & STORE_DICTS))) {
+		r->skip = STORE_RAW_SKIP;
+	}
+
+	if (!(s->flags & STORE_DICTS) || r->pending) return store_compressed_size(csize, len, raw_ok);
+
+	if (d && !d->ratio) {
+		d->ratio = ratio;
+	} else if ((!d || ratio > d->ratio * 1.25f) && s->n_train < STORE_TRAIN_QUEUE) {
+		s->train[s->n_train++] = itopic;
+		r->pending = 1;
+	}
 
-static u64 store_get_offset(store *s, MDB_cursor *mc, u64 itopic) {
+	return store_compressed_size(csize, len, raw_ok);
+}
+
+// write path mdb calls go through here, so the store worker can tell a
+// full map apart from other errors
+static int store_check(store *s, int rc) {
+	if (rc == MDB_MAP_FULL) s->map_full = 1;
+	return rc ? 1 : 0;
+}
+
+static MDB_dbi store_topic_dbi(store *s, int itopic) {
+	return (s->flags & STORE_TOPIC_DBS) ? s->tdbis[itopic] : s->dbi;
+}
+
+// readers only see a topic db once the txn creating it committed, 0 until then
+static MDB_dbi store_topic_rdbi(store *s, int itopic) {
+	return (s->flags & STORE_TOPIC_DBS) ? atomic_load(s->rdbis + itopic) : s->dbi;
+}
+
+static u64 store_get_offset(store *s, MDB_txn *txn, u64 itopic) {
 	i64 offset = s->write_offsets[itopic];
-	if (offset == -1) {
-		u64 max_key = (itopic << 48) | 0xFFFFFFFFFFFF;
-		MDB_val k, v;
-		k.mv_data = &max_key;
-		k.mv_size = sizeof(u64);
-
-		if (mdb_cursor_get(mc, &k, &v, MDB_SET_RANGE)) {
-			if (mdb_cursor_get(mc, &k, &v, MDB_LAST)) {
-				goto err;
+	if (offset != -1) return offset;
+
+	offset = (itopic << 48);
+
+	MDB_cursor *mc;
+	if (mdb_cursor_open(txn, store_topic_dbi(s, itopic), &mc)) return offset;
+
+	u64 max_key = (itopic << 48) | 0xFFFFFFFFFFFF;
+	MDB_val k, v;
+	k.mv_data = &max_key;
+	k.mv_size = sizeof(u64);
+
+	int rc = mdb_cursor_get(mc, &k, &v, MDB_SET_RANGE);
+	if (rc == MDB_SUCCESS) {
+		rc = mdb_cursor_get(mc, &k, &v, MDB_PREV);
+	} else {
+		rc = mdb_cursor_get(mc, &k, &v, MDB_LAST);
+	}
+
+	if (rc == MDB_SUCCESS) {
+		u64 last;
+		memcpy(&last, k.mv_data, sizeof(u64));
+		if ((last >> 48) == itopic) {
+			if (s->flags & STORE_BLOCKS) {
+				store_block_header h;
+				memcpy(&h, v.mv_data, sizeof(store_block_header));
+				offset = last + h.count;
+			} else {
+				offset = last + 1;
 			}
-			goto last;
-		}
-		if (mdb_cursor_get(mc, &k, &v, MDB_PREV)) goto err;
-last:
-		memcpy(&offset, k.mv_data, sizeof(u64));
-		if ((offset >> 48) != itopic) {
-err:
-			offset = (itopic << 48);
-		} else {
-			offset++;
 		}
-		return offset;
 	}
+
+	mdb_cursor_close(mc);
 	return offset;
 }
 
+static int store_open_topic_dbi(store *s, MDB_txn *txn, int itopic, int create) {
+	char name[16];
+	sprintf(name, "t%d", itopic);
+	return mdb_dbi_open(txn, name, MDB_INTEGERKEY | (create ? MDB_CREATE : 0),
+			s->tdbis + itopic) ? 1 : 0;
+}
+
+static void store_mark_dirty(store *s, int itopic) {
+	if (s->ts[itopic].dirty) return;
+	s->ts[itopic].dirty = 1;
+	s->dirty[s->n_dirty++] = itopic;
+}
+
+// remembers what a topic looked like before this write txn
+static void store_touch(store *s, int itopic) {
+	store_topic *t = s->ts + itopic;
+	if (t->touched) return;
+	t->touched = 1;
+	t->saved_offset = s->write_offsets[itopic];
+	t->saved_bytes = t->bytes;
+	t->saved_indexed = t->indexed;
+	s->touched[s->n_touched++] = itopic;
+}
+
+static void store_untouch(store *s, int restore) {
+	int nosync = s->flags & (STORE_NOSYNC | STORE_NOMETASYNC);
+	if (!restore && nosync) mtx_lock(&s->smutex);
+	if (!restore) mtx_lock(&s->mutex); // commit waiters
+
+	for (u32 i = 0; i < s->n_touched; i++) {
+		int itopic = s->touched[i];
+		store_topic *t = s->ts + itopic;
+		t->touched = 0;
+		if (restore) {
+			s->write_offsets[itopic] = t->saved_offset;
+			t->bytes = t->saved_bytes;
+			t->indexed = t->saved_indexed;
+			continue;
+		}
+
+		if ((s->flags & STORE_TOPIC_DBS) && !atomic_load(s->rdbis + itopic)) {
+			atomic_store(s->rdbis + itopic, s->tdbis[itopic]);
+		}
+		if (s->write_offsets[itopic] == -1) continue; // created, nothing written
+
+		// committed, durable once flushed
+		t->committed = s->write_offsets[itopic] & 0xffffffffffffULL;
+		if (!nosync) {
+			t->durable = t->committed;
+		} else if (!t->sync_pending) {
+			t->sync_pending = 1;
+			s->sync_list[s->n_sync++] = itopic;
+		}
+	}
+
+	if (!restore) mtx_unlock(&s->mutex);
+	if (!restore && nosync) {
+		if (s->n_sync) cnd_signal(&s->scnd);
+		mtx_unlock(&s->smutex);
+	}
+	s->n_touched = 0;
+}
+
+static int store_count_bytes(store *s, MDB_txn *txn, int itopic) {
+	MDB_cursor *mc;
+	if (mdb_cursor_open(txn, store_topic_dbi(s, itopic), &mc)) return 1;
+
+	u64 bytes = 0;
+	u64 key = ((u64)itopic) << 48;
+	MDB_val k, v;
+	k.mv_data = &key;
+	k.mv_size = sizeof(u64);
+	int rc = mdb_cursor_get(mc, &k, &v, MDB_SET_RANGE);
+	while (rc == MDB_SUCCESS) {
+		memcpy(&key, k.mv_data, sizeof(u64));
+		if ((key >> 48) != itopic) break;
+		bytes += k.mv_size + v.mv_size;
+		rc = mdb_cursor_get(mc, &k, &v, MDB_NEXT);
+	}
+	mdb_cursor_close(mc);
+
+	s->ts[itopic].bytes = bytes;
+	if (bytes) store_mark_dirty(s, itopic);
+	return 0;
+}
+
+static void store_reclaim_add(store *s, int itopic) {
+	store_topic *t = s->ts + itopic;
+	if (t->reclaiming) return;
+	t->reclaim_from = t->reclaimed;
+	t->reclaiming = 1;
+	s->reclaim[s->n_reclaim++] = itopic;
+}
+
 static int store_load_topics(store *s) {
 	MDB_txn *txn;
 	if (mdb_txn_begin(s->env, NULL, MDB_RDONLY, &txn)) {
@@ -87,45 +355,293 @@ static int store_load_topics(store *s) {
 			goto err;
 		}
 	}
+	atomic_store(&s->n_topics, map_str_int_size(&s->topics));
+
+	// load latest dictionaries
+	u64 key = STORE_META_KEY(STORE_META_DICTS, 0, 0);
+	k.mv_data = &key;
+	k.mv_size = sizeof(u64);
+	int rc = mdb_cursor_get(mc, &k, &v, MDB_SET_RANGE);
+	while (rc == MDB_SUCCESS) {
+		memcpy(&key, k.mv_data, sizeof(u64));
+		if ((key >> 44) != STORE_META_DICTS) break;
+
+		int itopic = (key >> 28) & 0xffff;
+		u32 version = v.mv_size / sizeof(u64);
+
+		u64 dkey = STORE_META_KEY(STORE_META_DICT, itopic, version);
+		MDB_val dk, dv;
+		dk.mv_data = &dkey;
+		dk.mv_size = sizeof(u64);
+		if (mdb_get(txn, s->dbi, &dk, &dv) == MDB_SUCCESS && dv.mv_size <= STORE_DICT_SIZE) {
+			store_dict *d = store_dict_new();
+			if (!d) {
+				ret = 1;
+				goto err;
+			}
+			store_dict_set(d, version, dv.mv_data, dv.mv_size);
+			s->dicts[itopic] = d;
+		}
+
+		rc = mdb_cursor_get(mc, &k, &v, MDB_NEXT);
+	}
+
+	// load low watermarks, sizes and retention policies, anything left
+	// below a watermark is reclaimed again
+	key = STORE_META_KEY(STORE_META_LOW, 0, 0);
+	k.mv_data = &key;
+	k.mv_size = sizeof(u64);
+	rc = mdb_cursor_get(mc, &k, &v, MDB_SET_RANGE);
+	while (rc == MDB_SUCCESS) {
+		memcpy(&key, k.mv_data, sizeof(u64));
+		if ((key >> 44) > STORE_META_RETENTION) break;
+
+		int itopic = (key >> 28) & 0xffff;
+		store_topic *t = s->ts + itopic;
+
+		switch (key >> 44) {
+		case STORE_META_LOW:
+			memcpy(&t->low, v.mv_data, sizeof(u64));
+			store_reclaim_add(s, itopic);
+			break;
+		case STORE_META_TIME: // skip the index
+			key = STORE_META_KEY(STORE_META_TIME + 1, 0, 0);
+			k.mv_data = &key;
+			k.mv_size = sizeof(u64);
+			rc = mdb_cursor_get(mc, &k, &v, MDB_SET_RANGE);
+			continue;
+		case STORE_META_SIZE:
+			memcpy(&t->bytes, v.mv_data, sizeof(u64));
+			t->dirty = -1; // loaded
+			if (v.mv_size >= 2*sizeof(u64)) { // checkpoint
+				memcpy(&s->write_offsets[itopic], (u64*)v.mv_data + 1, sizeof(u64));
+				s->write_offsets[itopic] |= ((u64)itopic) << 48;
+			}
+			break;
+		case STORE_META_RETENTION:
+			memcpy(&t->retention, v.mv_data, sizeof(store_retention));
+			t->has_retention = 1;
+			break;
+		}
+
+		rc = mdb_cursor_get(mc, &k, &v, MDB_NEXT);
+	}
 
-	// load offsets
+	// load offsets, seeking only those without a checkpoint
+	int n_topics = 0, n_seeks = 0;
 	for (u64 i = map_str_int_begin(&s->topics);
 			i != map_str_int_end(&s->topics);
 			i = map_str_int_next(&s->topics, i)) {
 		int itopic = map_str_int_value(&s->topics, i);
-		s->write_offsets[itopic] = store_get_offset(s, mc, itopic);
-		printf("offset of %d -> %lld\n", itopic, s->write_offsets[itopic]&0xffffffffffffull);
+		if (s->flags & STORE_TOPIC_DBS) {
+			if (store_open_topic_dbi(s, txn, itopic, 0)) {
+				ret = 1;
+				goto err;
+			}
+			atomic_store(s->rdbis + itopic, s->tdbis[itopic]);
+		}
+		n_topics++;
+		int seek = s->write_offsets[itopic] == -1;
+		if (seek) {
+			n_seeks++;
+			s->write_offsets[itopic] = store_get_offset(s, txn, itopic);
+		}
+		if ((s->write_offsets[itopic] & 0xffffffffffffULL) < s->ts[itopic].low) {
+			// fully reclaimed, offsets keep going from the watermark
+			s->write_offsets[itopic] = (((u64)itopic) << 48) | s->ts[itopic].low;
+		}
+		s->ts[itopic].committed = s->write_offsets[itopic] & 0xffffffffffffULL;
+		s->ts[itopic].durable = s->ts[itopic].committed;
+		if (s->ts[itopic].dirty < 0) {
+			s->ts[itopic].dirty = 0;
+		} else if (store_count_bytes(s, txn, itopic)) { // created before size records
+			ret = 1;
+			goto err;
+		}
+		// checkpointed by the next commit
+		if (seek && s->ts[itopic].committed) store_mark_dirty(s, itopic);
 	}
+	printf("loaded %d topics, %d without an offset checkpoint\n", n_topics, n_seeks);
+	s->n_seeks = n_seeks;
 
 err:
 	mdb_cursor_close(mc);
-	mdb_txn_abort(txn);
+	if (ret) {
+		mdb_txn_abort(txn);
+	} else if (mdb_txn_commit(txn)) { // keeps the topic dbi handles
+		ret = 1;
+	}
 	return ret;
 }
 
 
-int store_init(store *s, char *name, u32 maxdbs, u64 mapsz) {
-	int maxsz = LZ4_compressBound(MAX_MESSAGE_SIZE);
-	s->compressed = malloc(maxsz);
-	s->max_compressed = maxsz;
-	if (!s->compressed) {
+static int store_load_format(store *s, MDB_txn *txn, MDB_dbi dbi, u32 flags) {
+	u64 key = STORE_META_KEY(STORE_META_FORMAT, 0, 0);
+	MDB_val k, v;
+	k.mv_data = &key;
+	k.mv_size = sizeof(u64);
+
+	int rc = mdb_get(txn, dbi, &k, &v);
+	if (rc == MDB_SUCCESS) {
+		memcpy(&s->flags, v.mv_data, sizeof(u32));
+		s->flags |= flags & ~STORE_FORMAT_FLAGS;
+	} else if (rc == MDB_NOTFOUND) {
+		MDB_stat st;
+		if (mdb_stat(txn, dbi, &st)) return 1;
+		if (st.ms_entries) { // created before format records, per event values
+			s->flags = flags & ~STORE_FORMAT_FLAGS;
+		} else {
+			u32 format = (flags & STORE_FORMAT_FLAGS) | STORE_TAGGED;
+			s->flags = flags | STORE_TAGGED;
+			v.mv_data = &format;
+			v.mv_size = sizeof(u32);
+			if (mdb_put(txn, dbi, &k, &v, 0)) return 1;
+		}
+	} else {
+		return 1;
+	}
+
+	if ((s->flags ^ flags) & (STORE_FORMAT_FLAGS & ~STORE_TAGGED)) {
+		printf("using stored format flags %x\n", s->flags & STORE_FORMAT_FLAGS);
+	}
+
+	key = STORE_META_KEY(STORE_META_EPOCH, 0, 0);
+	rc = mdb_get(txn, dbi, &k, &v);
+	if (rc == MDB_SUCCESS) {
+		memcpy(&s->epoch, v.mv_data, sizeof(u64));
+	} else if (rc == MDB_NOTFOUND) {
+		s->epoch = time(NULL);
+		v.mv_data = &s->epoch;
+		v.mv_size = sizeof(u64);
+		if (mdb_put(txn, dbi, &k, &v, 0)) return 1;
+	} else {
 		return 1;
 	}
 
+	return 0;
+}
+
+static int store_env_open(char *name, u64 mapsz, u32 maxdbs, u32 flags, MDB_env **penv) {
 	MDB_env *env;
 	if (mdb_env_create(&env)) {
 		return 1;
 	}
 
-	if (mdb_env_set_mapsize(env, mapsz)) {
+	if (mdb_env_set_mapsize(env, mapsz) ||
+			(maxdbs && mdb_env_set_maxdbs(env, maxdbs))) {
+		mdb_env_close(env);
+		return 1;
+	}
+
+	unsigned int envflags = MDB_NOSUBDIR | MDB_WRITEMAP | MDB_NOMEMINIT;
+	if (flags & STORE_NOSYNC) envflags |= MDB_NOSYNC;
+	if (flags & STORE_NOMETASYNC) envflags |= MDB_NOMETASYNC;
+	if (mdb_env_open(env, name, envflags, 0664)) {
 		mdb_env_close(env);
 		return 1;
 	}
 
-	if (mdb_env_open(env, name, MDB_NOSUBDIR | MDB_WRITEMAP | MDB_NOMEMINIT, 0664)) {
+	*penv = env;
+	return 0;
+}
+
+// named dbs: an existing database that isn't integer keyed, or a new one
+// asked for them
+static int store_layout(MDB_env *env, u32 flags, int *topic_dbs) {
+	MDB_txn *txn;
+	if (mdb_txn_begin(env, NULL, MDB_RDONLY, &txn)) {
+		return 1;
+	}
+
+	MDB_dbi dbi;
+	unsigned int dbflags;
+	MDB_stat st;
+	int rc = mdb_dbi_open(txn, NULL, 0, &dbi) ||
+			mdb_dbi_flags(txn, dbi, &dbflags) ||
+			mdb_stat(txn, dbi, &st);
+	mdb_txn_abort(txn);
+	if (rc) return 1;
+
+	*topic_dbs = !(dbflags & MDB_INTEGERKEY) &&
+		(st.ms_entries || (flags & STORE_TOPIC_DBS));
+	return 0;
+}
+
+int store_init(store *s, char *name, u32 maxdbs, u64 mapsz, u32 flags) {
+	s->block = NULL;
+	s->staged = NULL;
+	s->staged_events = NULL;
+	s->staged_len = 0;
+	s->n_staged = 0;
+	s->n_train = 0;
+	s->n_seeks = 0;
+	s->acceleration = 1;
+
+	s->n_reclaim = 0;
+	s->n_dirty = 0;
+	s->n_touched = 0;
+	s->max_mapsize = 0;
+	s->map_full = 0;
+	s->readers = 0;
+	s->resizing = 0;
+	s->n_sync = 0;
+	s->sync_stop = 0;
+	memset(&s->retention, 0, sizeof(store_retention));
+	s->retained_at = 0;
+
+	s->tdbis = (MDB_dbi*)calloc(MAX_TOPICS+1, sizeof(MDB_dbi));
+	s->rdbis = (atomic_uint*)calloc(MAX_TOPICS+1, sizeof(atomic_uint));
+	s->ts = (store_topic*)calloc(MAX_TOPICS+1, sizeof(store_topic));
+	s->reclaim = (int*)calloc(MAX_TOPICS+1, sizeof(int));
+	s->dirty = (int*)calloc(MAX_TOPICS+1, sizeof(int));
+	s->touched = (int*)calloc(MAX_TOPICS+1, sizeof(int));
+	s->sync_list = (int*)calloc(MAX_TOPICS+1, sizeof(int));
+	s->sync_flush = (int*)calloc(MAX_TOPICS+1, sizeof(int));
+	s->sync_offsets = (u64*)calloc(MAX_TOPICS+1, sizeof(u64));
+	s->dicts = (store_dict**)calloc(MAX_TOPICS+1, sizeof(store_dict*));
+	s->ratios = (store_ratio*)calloc(MAX_TOPICS+1, sizeof(store_ratio));
+	s->lz4 = LZ4_createStream();
+	if (!s->tdbis || !s->rdbis || !s->ts || !s->reclaim || !s->dirty || !s->touched ||
+			!s->sync_list || !s->sync_flush || !s->sync_offsets ||
+			!s->dicts || !s->ratios || !s->lz4) {
+		return 1;
+	}
+
+	if (mtx_init(&s->mutex, mtx_plain) != thrd_success ||
+			mtx_init(&s->tmutex, mtx_plain) != thrd_success ||
+			mtx_init(&s->rmutex, mtx_plain) != thrd_success ||
+			cnd_init(&s->rcnd) != thrd_success ||
+			mtx_init(&s->smutex, mtx_plain) != thrd_success ||
+			cnd_init(&s->scnd) != thrd_success) {
+		return 1;
+	}
+
+	int maxsz = sizeof(store_block_header) + LZ4_compressBound(STORE_BLOCK_SIZE);
+	s->compressed = malloc(maxsz);
+	s->max_compressed = maxsz;
+	if (!s->compressed) {
+		return 1;
+	}
+
+	// the layout follows the main db: an integer keyed one is the shared
+	// layout, otherwise it holds the named meta and per topic dbs. Only
+	// those size the environment for every topic, each txn copies a table
+	// per db
+	MDB_env *env;
+	int topic_dbs;
+	if (store_env_open(name, mapsz, 0, flags, &env)) {
+		return 1;
+	}
+	if (store_layout(env, flags, &topic_dbs)) {
 		mdb_env_close(env);
 		return 1;
 	}
+	if (topic_dbs) {
+		mdb_env_close(env);
+		if (store_env_open(name, mapsz, maxdbs + 1, flags, &env)) { // topics + meta
+			return 1;
+		}
+	}
 
 	MDB_txn *txn;
 	if (mdb_txn_begin(env, NULL, 0, &txn)) {
@@ -134,7 +650,14 @@ int store_init(store *s, char *name, u32 maxdbs, u64 mapsz) {
 	}
 
 	MDB_dbi dbi;
-	if (mdb_dbi_open(txn, NULL, MDB_INTEGERKEY, &dbi)) {
+	if (mdb_dbi_open(txn, topic_dbs ? "meta" : NULL,
+			MDB_INTEGERKEY | (topic_dbs ? MDB_CREATE : 0), &dbi)) {
+		mdb_txn_abort(txn);
+		mdb_env_close(env);
+		return 1;
+	}
+
+	if (store_load_format(s, txn, dbi, flags)) {
 		mdb_txn_abort(txn);
 		mdb_env_close(env);
 		return 1;
@@ -149,10 +672,21 @@ int store_init(store *s, char *name, u32 maxdbs, u64 mapsz) {
 	s->env = env;
 	s->dbi = dbi;
 
+	if (s->flags & STORE_BLOCKS) {
+		s->block = malloc(sizeof(store_block_header) + STORE_BLOCK_SIZE);
+		s->staged = malloc(STORE_STAGE_SIZE);
+		s->staged_events = malloc(sizeof(store_staged) * STORE_STAGE_EVENTS);
+		if (!s->block || !s->staged || !s->staged_events) {
+			mdb_env_close(env);
+			return 1;
+		}
+	}
+
 	for (int i = 0; i < MAX_TOPICS; i++) {
 		s->write_offsets[i] = -1;
 	}
 
+	atomic_init(&s->n_topics, 0);
 	if (map_str_int_init(&s->topics)) {
 		mdb_env_close(env);
 		return 1;
@@ -167,6 +701,9 @@ int store_init(store *s, char *name, u32 maxdbs, u64 mapsz) {
 }
 
 void store_destroy(store *s) {
+	if (s->flags & (STORE_NOSYNC | STORE_NOMETASYNC)) {
+		mdb_env_sync(s->env, 1);
+	}
 	mdb_dbi_close(s->env, s->dbi);
 	mdb_env_close(s->env);
 
@@ -177,10 +714,36 @@ void store_destroy(store *s) {
 	}
 	map_str_int_destroy(&s->topics);
 
+	for (int i = 0; i <= MAX_TOPICS; i++) {
+		store_dict_free(s->dicts[i]);
+	}
+	mtx_destroy(&s->mutex);
+	mtx_destroy(&s->tmutex);
+	mtx_destroy(&s->rmutex);
+	cnd_destroy(&s->rcnd);
+	mtx_destroy(&s->smutex);
+	cnd_destroy(&s->scnd);
+
+	free(s->tdbis);
+	free(s->rdbis);
+	free(s->ts);
+	free(s->reclaim);
+	free(s->dirty);
+	free(s->touched);
+	free(s->sync_list);
+	free(s->sync_flush);
+	free(s->sync_offsets);
+	free(s->dicts);
+	free(s->ratios);
+	LZ4_freeStream(s->lz4);
+
 	free(s->compressed);
+	free(s->block);
+	free(s->staged);
+	free(s->staged_events);
 }
 
-int store_get_topic(store *s, char *topic, u32 topic_len, int create, int *newtopic) {
+static int store_find_topic(store *s, char *topic, u32 topic_len, int create, int *newtopic) {
 	if (topic_len > MAX_TOPIC_NAME_LEN) {
 		return -1;
 	}
@@ -215,12 +778,29 @@ int store_get_topic(store *s, char *topic, u32 topic_len, int create, int *newto
 	if (map_str_int_set(&s->topics, la_strdupn(topic, topic_len), itopic)) {
 		return -1; // err
 	}
+	atomic_store(&s->n_topics, itopic);
 
 	*newtopic = 1;
 
 	return itopic;
 }
 
+int store_get_topic(store *s, char *topic, u32 topic_len, int create, int *newtopic) {
+	mtx_lock(&s->tmutex);
+	int itopic = store_find_topic(s, topic, topic_len, create, newtopic);
+	mtx_unlock(&s->tmutex);
+	return itopic;
+}
+
+int store_add_topic(store *s, char *topic, u32 topic_len, topic_added fn, void *ctx) {
+	int nt;
+	mtx_lock(&s->tmutex);
+	int itopic = store_find_topic(s, topic, topic_len, 1, &nt);
+	if (nt) fn(itopic, topic, topic_len, ctx);
+	mtx_unlock(&s->tmutex);
+	return itopic;
+}
+
 int store_create_topic(store *s, char *topic, u32 topic_len, int itopic) {
 	printf("creating topic %.*s (%d)\n", (int)topic_len, topic, itopic);
 	u64 key = itopic;
@@ -229,10 +809,17 @@ int store_create_topic(store *s, char *topic, u32 topic_len, int itopic) {
 	k.mv_size = sizeof(u64);
 	v.mv_data = topic;
 	v.mv_size = topic_len;
-	return (mdb_put(s->wtxn, s->dbi, &k, &v, 0) ? 1 : 0);
+	if (store_check(s, mdb_put(s->wtxn, s->dbi, &k, &v, 0))) return 1;
+	if (s->flags & STORE_TOPIC_DBS) {
+		store_touch(s, itopic); // handed to readers on commit
+		return store_open_topic_dbi(s, s->wtxn, itopic, 1);
+	}
+	return 0;
 }
 
 int store_write_txn_begin(store *s) {
+	s->now = time(NULL);
+	s->map_full = 0;
 	if (mdb_txn_begin(s->env, NULL, 0, &s->wtxn)) return 1;
 	if (mdb_cursor_open(s->wtxn, s->dbi, &s->wmc)) {
 		mdb_txn_abort(s->wtxn);
@@ -241,90 +828,1002 @@ int store_write_txn_begin(store *s) {
 	return 0;
 }
 
-int store_write_txn_end(store *s) {
-	mdb_cursor_close(s->wmc);
-	return mdb_txn_commit(s->wtxn);
-}
+// offsets only grow within a topic db, so every put there is an append
+static int store_put(store *s, int itopic, MDB_val *k, MDB_val *v) {
+	store_touch(s, itopic);
+	s->ts[itopic].bytes += k->mv_size + v->mv_size;
+	store_mark_dirty(s, itopic);
 
-int store_write_event(store *s, int itopic, char *buf, u32 len) {
-	MDB_cursor *mc = s->wmc;
+	if (s->flags & STORE_TOPIC_DBS) {
+		return store_check(s, mdb_put(s->wtxn, s->tdbis[itopic], k, v, MDB_APPEND));
+	}
+	return store_check(s, mdb_cursor_put(s->wmc, k, v, 0));
+}
 
-	u64 offset = store_get_offset(s, mc, itopic);
+static int store_cmp_staged(const void *a, const void *b) {
+	const store_staged *l = (const store_staged*)a;
+	const store_staged *r = (const store_staged*)b;
+	if (l->itopic != r->itopic) return l->itopic < r->itopic ? -1 : 1;
+	if (l->offset != r->offset) return l->offset < r->offset ? -1 : 1;
+	return 0;
+}
 
-	// compress
-#ifdef STORE_COMPRESSION
-	int csize = LZ4_compress_default(buf, s->compressed, len, s->max_compressed);
-	// Check return_value to determine what happened.
-	if (csize <= 0) {
-		puts("compress error");
-		return 1;
-		//run_screaming("A 0 or negative result from LZ4_compress_default() indicates a failure trying to compress the data. ", 1);
+// writes events [0, n) of a topic run as one block
+static int store_put_block(store *s, store_staged *events, u32 n) {
+	int itopic = events[0].itopic;
+
+	store_block_header h;
+	memset(&h, 0, sizeof(store_block_header));
+	h.count = n;
+
+	char *raw = s->block + sizeof(store_block_header);
+	u32 index_len = n * sizeof(u32);
+	u32 end = 0;
+	for (u32 i = 0; i < n; i++) {
+		memcpy(raw + index_len + end, s->staged + events[i].pos, events[i].len);
+		end += events[i].len;
+		memcpy(raw + i * sizeof(u32), &end, sizeof(u32));
 	}
+	h.size = index_len + end;
+
+	MDB_val k, v;
+	k.mv_data = &events[0].offset;
+	k.mv_size = sizeof(u64);
+
+	int csize = store_compress(s, itopic, raw, s->compressed + sizeof(store_block_header),
+			h.size, s->max_compressed - sizeof(store_block_header), 1);
 	if (csize > 0) {
-		//printf("We successfully compressed some data! Ratio: %.2f\n", (float) csize/len);
+		h.codec = STORE_CODEC_LZ4;
+		v.mv_data = s->compressed;
+		v.mv_size = sizeof(store_block_header) + csize;
+	} else { // incompressible
+		h.codec = STORE_CODEC_RAW;
+		v.mv_data = s->block;
+		v.mv_size = sizeof(store_block_header) + h.size;
+	}
+	memcpy(v.mv_data, &h, sizeof(store_block_header));
+
+	return store_put(s, itopic, &k, &v);
+}
+
+static int store_flush_blocks(store *s) {
+	qsort(s->staged_events, s->n_staged, sizeof(store_staged), store_cmp_staged);
+
+	u32 i = 0;
+	while (i < s->n_staged) {
+		store_staged *e = s->staged_events + i;
+		u32 n = 0;
+		u32 size = 0;
+		while (i + n < s->n_staged && e[n].itopic == e[0].itopic) {
+			u32 sz = size + sizeof(u32) + e[n].len;
+			if (sz > STORE_BLOCK_SIZE) break;
+			size = sz;
+			n++;
+		}
+		if (store_put_block(s, e, n)) return 1;
+		i += n;
 	}
-#endif
 
+	s->n_staged = 0;
+	s->staged_len = 0;
+	return 0;
+}
 
-	// write to database
+static int store_put_meta(store *s, u64 key, void *buf, u32 len) {
 	MDB_val k, v;
-	k.mv_data = &offset;
+	k.mv_data = &key;
 	k.mv_size = sizeof(u64);
-#ifdef STORE_COMPRESSION
-	v.mv_data = s->compressed;
-	v.mv_size = csize;
-#else
 	v.mv_data = buf;
 	v.mv_size = len;
-#endif
-	if (mdb_cursor_put(mc, &k, &v, 0)) {
+	return store_check(s, mdb_put(s->wtxn, s->dbi, &k, &v, 0));
+}
+
+// with the offset checkpoint: a restart reads offsets instead of seeking
+// the last key of each topic
+static int store_put_sizes(store *s) {
+	for (u32 i = 0; i < s->n_dirty; i++) {
+		int itopic = s->dirty[i];
+		s->ts[itopic].dirty = 0;
+		u64 rec[2];
+		rec[0] = s->ts[itopic].bytes;
+		rec[1] = s->write_offsets[itopic] & 0xffffffffffffULL;
+		if (store_put_meta(s, STORE_META_KEY(STORE_META_SIZE, itopic, 0),
+				rec, s->write_offsets[itopic] == -1 ? sizeof(u64) : sizeof(rec))) {
+			return 1;
+		}
+	}
+	s->n_dirty = 0;
+	return 0;
+}
+
+int store_write_txn_end(store *s) {
+	if ((s->n_staged && store_flush_blocks(s)) || store_put_sizes(s)) {
+		store_write_txn_abort(s);
+		return 1;
+	}
+	mdb_cursor_close(s->wmc);
+	if (store_check(s, mdb_txn_commit(s->wtxn))) {
+		store_untouch(s, 1);
 		return 1;
 	}
+	store_untouch(s, 0);
+	return 0;
+}
+
+// drops the txn and everything staged for it, offsets handed out by it
+// are given out again by the next one
+void store_write_txn_abort(store *s) {
+	s->n_staged = 0;
+	s->staged_len = 0;
+	for (u32 i = 0; i < s->n_dirty; i++) s->ts[s->dirty[i]].dirty = 0;
+	s->n_dirty = 0;
+	store_untouch(s, 1);
+	mdb_cursor_close(s->wmc);
+	mdb_txn_abort(s->wtxn);
+}
+
+static int store_stage_event(store *s, int itopic, u64 offset, char *buf, u32 len) {
+	if (s->n_staged == STORE_STAGE_EVENTS || s->staged_len + len > STORE_STAGE_SIZE) {
+		if (store_flush_blocks(s)) return 1;
+	}
+
+	store_staged *e = s->staged_events + s->n_staged++;
+	e->itopic = itopic;
+	e->pos = s->staged_len;
+	e->len = len;
+	e->offset = offset;
+
+	memcpy(s->staged + s->staged_len, buf, len);
+	s->staged_len += len;
 
 	s->write_offsets[itopic] = offset+1;
 
 	return 0;
 }
 
-int store_read_some(MDB_cursor *mc, int itopic, u64 offset, event_visitor fn, void *ctx) {
-	MDB_val k, v;
+static u64 store_time_arg(store *s, u64 time) {
+	if (time < s->epoch) return 0;
+	time -= s->epoch;
+	return time < (1ULL<<STORE_TIME_BITS) ? time : (1ULL<<STORE_TIME_BITS) - 1;
+}
 
-	offset = offset | (((u64)itopic) << 48);
+// sparse time index: the first offset written in each second with writes
+static int store_index_time(store *s, int itopic, u64 offset) {
+	store_topic *t = s->ts + itopic;
+	u64 arg = store_time_arg(s, s->now);
+	if (t->indexed >= arg+1) return 0; // same second, or the clock went back
 
-	k.mv_data = &offset;
+	offset &= 0xffffffffffffULL;
+	u64 key = STORE_META_KEY(STORE_META_TIME, itopic, arg);
+	MDB_val k, v;
+	k.mv_data = &key;
 	k.mv_size = sizeof(u64);
+	v.mv_data = &offset;
+	v.mv_size = sizeof(u64);
+	int rc = mdb_put(s->wtxn, s->dbi, &k, &v, MDB_NOOVERWRITE);
+	if (rc && rc != MDB_KEYEXIST) return store_check(s, rc); // exists: restarted within the second
 
-	int some = 0;
-	if (mdb_cursor_get(mc, &k, &v, MDB_SET_KEY) != MDB_SUCCESS) {
-		return some ? 1 : 2; // 1 done - write, 2 done - nothing to write
-	}
+	t->indexed = arg+1;
+	return 0;
+}
 
-	do {
-		u64 u;
-		memcpy(&u, k.mv_data, sizeof(u64));
+int store_write_event(store *s, int itopic, char *buf, u32 len) {
+	store_touch(s, itopic);
+	u64 offset = store_get_offset(s, s->wtxn, itopic);
 
-		if ((u>>48) != itopic) {
-			return some ? 1 : 2; // 1 done - write, 2 done - nothing to write
-		}
+	if (store_index_time(s, itopic, offset)) return 1;
 
-#ifdef STORE_COMPRESSION
-		void *buf = v.mv_data;
-		u32 len = v.mv_size;
+	if (s->flags & STORE_BLOCKS) {
+		return store_stage_event(s, itopic, offset, buf, len);
+	}
 
-		char msg[MAX_MESSAGE_SIZE];
+	// compress, untagged databases hold lz4 only
+	int tagged = s->flags & STORE_TAGGED ? 1 : 0;
+	char *dst = s->compressed + tagged;
+	int csize = store_compress(s, itopic, buf, dst, len, s->max_compressed - tagged, tagged);
+	if (csize < 0 || (!csize && !tagged)) {
+		puts("compress error");
+		return 1;
+	}
+	u8 codec = STORE_CODEC_LZ4;
+	if (!csize) {
+		codec = STORE_CODEC_RAW;
+		memcpy(dst, buf, len);
+		csize = len;
+	}
+	if (tagged) *s->compressed = codec;
 
-		int dsize = LZ4_decompress_safe(buf, msg, len, MAX_MESSAGE_SIZE);
-		if (dsize < 0) return -1;
-#else
-		char *msg = v.mv_data;
-		u32 dsize = v.mv_size;
-#endif
-		if (fn(u&0xffffffffffffULL, msg, dsize, ctx)) {
-			break;
-		}
+	// write to database
+	MDB_val k, v;
+	k.mv_data = &offset;
+	k.mv_size = sizeof(u64);
+	v.mv_data = s->compressed;
+	v.mv_size = tagged + csize;
+	if (store_put(s, itopic, &k, &v)) {
+		return 1;
+	}
+
+	s->write_offsets[itopic] = offset+1;
+
+	return 0;
+}
+
+// events of a producer's batch follow each other, each with its u32
+// length. Returns how many, 0 = malformed: an empty, oversized or
+// truncated event
+u32 store_batch_events(char *buf, u32 len) {
+	u32 n = 0;
+	while (len) {
+		u32 event_len;
+		if (len < sizeof(u32)) return 0;
+		memcpy(&event_len, buf, sizeof(u32));
+		buf += sizeof(u32);
+		len -= sizeof(u32);
+		if (!event_len || event_len > MAX_EVENT_SIZE || event_len > len) return 0;
+		buf += event_len;
+		len -= event_len;
+		n++;
+	}
+	return n;
+}
+
+// a checked batch, its events get consecutive offsets. *n = events written
+int store_write_batch(store *s, int itopic, char *buf, u32 len, u32 *n) {
+	*n = 0;
+	while (len) {
+		u32 event_len;
+		memcpy(&event_len, buf, sizeof(u32));
+		if (store_write_event(s, itopic, buf + sizeof(u32), event_len)) return 1;
+		buf += sizeof(u32) + event_len;
+		len -= sizeof(u32) + event_len;
+		(*n)++;
+	}
+	return 0;
+}
+
+// an event its producer compressed already (lz4, no dictionary), stored as
+// is. Blocks are compressed as a whole, they take the event raw
+int store_write_compressed(store *s, int itopic, char *buf, u32 len) {
+	int tagged = s->flags & STORE_TAGGED ? 1 : 0;
+	if ((s->flags & STORE_BLOCKS) || tagged + len > (u32)s->max_compressed) return 1;
+
+	store_touch(s, itopic);
+	u64 offset = store_get_offset(s, s->wtxn, itopic);
+
+	if (store_index_time(s, itopic, offset)) return 1;
+
+	MDB_val k, v;
+	k.mv_data = &offset;
+	k.mv_size = sizeof(u64);
+	v.mv_data = buf;
+	v.mv_size = len;
+	if (tagged) {
+		*s->compressed = STORE_CODEC_LZ4;
+		memcpy(s->compressed + 1, buf, len);
+		v.mv_data = s->compressed;
+		v.mv_size = 1 + len;
+	}
+	if (store_put(s, itopic, &k, &v)) {
+		return 1;
+	}
+
+	s->write_offsets[itopic] = offset+1;
+
+	return 0;
+}
+
+static int store_read_blocks(store *s, MDB_cursor *mc, int itopic, u64 offset, event_visitor fn,
+		stored_visitor sfn, void *ctx) {
+	MDB_val k, v;
+	store_dict_ref d;
+	d.from = ~0ULL;
+	d.to = 0;
+
+	u64 key = offset | (((u64)itopic) << 48);
+
+	k.mv_data = &key;
+	k.mv_size = sizeof(u64);
+
+	// offset lives in the last block starting at or before it
+	int rc = mdb_cursor_get(mc, &k, &v, MDB_SET_RANGE);
+	if (rc == MDB_SUCCESS) {
+		u64 u;
+		memcpy(&u, k.mv_data, sizeof(u64));
+		if (u != key) rc = mdb_cursor_get(mc, &k, &v, MDB_PREV);
+	} else {
+		rc = mdb_cursor_get(mc, &k, &v, MDB_LAST);
+	}
+	if (rc != MDB_SUCCESS) return 2;
+
+	char raw[STORE_BLOCK_SIZE];
+
+	int some = 0;
+	do {
+		u64 u;
+		memcpy(&u, k.mv_data, sizeof(u64));
+
+		if ((u>>48) != itopic) {
+			return some ? 1 : 2; // 1 done - write, 2 done - nothing to write
+		}
+
+		u64 first = u&0xffffffffffffULL;
+
+		store_block_header h;
+		memcpy(&h, v.mv_data, sizeof(store_block_header));
+
+		if (first + h.count <= offset) continue;
+
+		char *data = (char*)v.mv_data + sizeof(store_block_header);
+		if (h.codec == STORE_CODEC_LZ4) {
+			if (first < d.from || first >= d.to) {
+				store_find_dict(s, mdb_cursor_txn(mc), itopic, first, &d);
+			}
+			int dsize = store_decompress(&d, data, raw,
+					v.mv_size - sizeof(store_block_header), STORE_BLOCK_SIZE);
+			if (dsize != (int)h.size) return -1;
+			data = raw;
+		}
+
+		char *events = data + h.count * sizeof(u32);
+
+		u32 i = offset > first ? offset - first : 0;
+		u32 begin = 0;
+		if (i) memcpy(&begin, data + (i-1) * sizeof(u32), sizeof(u32));
+		for (; i < h.count; i++) {
+			u32 end;
+			memcpy(&end, data + i * sizeof(u32), sizeof(u32));
+			if (sfn ? sfn(first + i, STORE_CODEC_RAW, events + begin, end - begin, ctx) :
+					fn(first + i, events + begin, end - begin, ctx)) {
+				return some ? 3 : 0;
+			}
+			some = 1;
+			begin = end;
+		}
+	} while (mdb_cursor_get(mc, &k, &v, MDB_NEXT) == MDB_SUCCESS);
+
+	// the last block may end before offset, full buffers return above
+	return some ? 3 : 2; // more - write, nothing to write
+}
+
+static int store_read_events(store *s, MDB_cursor *mc, int itopic, u64 offset, event_visitor fn,
+		stored_visitor sfn, event_reserve reserve, void *ctx) {
+	MDB_val k, v;
+	store_dict_ref d;
+	d.from = ~0ULL;
+	d.to = 0;
+
+	offset = offset | (((u64)itopic) << 48);
+
+	k.mv_data = &offset;
+	k.mv_size = sizeof(u64);
+
+	int tagged = s->flags & STORE_TAGGED;
+	char raw[MAX_MESSAGE_SIZE];
+
+	int some = 0;
+	if (mdb_cursor_get(mc, &k, &v, MDB_SET_KEY) != MDB_SUCCESS) {
+		return some ? 1 : 2; // 1 done - write, 2 done - nothing to write
+	}
+
+	do {
+		u64 u;
+		memcpy(&u, k.mv_data, sizeof(u64));
+
+		if ((u>>48) != itopic) {
+			return some ? 1 : 2; // 1 done - write, 2 done - nothing to write
+		}
+
+		char *buf = v.mv_data;
+		int len = v.mv_size;
+
+		u8 codec = STORE_CODEC_LZ4;
+		if (tagged) {
+			codec = *buf++;
+			len--;
+		}
+
+		char *msg = buf;
+		int dsize = len;
+		if (codec == STORE_CODEC_LZ4) {
+			u64 o = u&0xffffffffffffULL;
+			if (o < d.from || o >= d.to) {
+				store_find_dict(s, mdb_cursor_txn(mc), itopic, o, &d);
+			}
+
+			// as stored, unless only the dictionary can decompress it
+			if (sfn && !d.data) {
+				if (sfn(o, STORE_CODEC_LZ4, buf, len, ctx)) break;
+				some = 1;
+				continue;
+			}
+
+			// in place when the visitor has room, the scratch buffer else
+			u32 cap = 0;
+			msg = reserve ? reserve(ctx, &cap) : NULL;
+			dsize = msg ? store_decompress(&d, buf, msg, len, cap) : -1;
+			if (dsize < 0) {
+				if (msg && cap >= MAX_MESSAGE_SIZE) return -1;
+				dsize = store_decompress(&d, buf, raw, len, MAX_MESSAGE_SIZE);
+				if (dsize < 0) return -1;
+				msg = raw;
+			}
+		}
+
+		if (sfn ? sfn(u&0xffffffffffffULL, STORE_CODEC_RAW, msg, dsize, ctx) :
+				fn(u&0xffffffffffffULL, msg, dsize, ctx)) {
+			break;
+		}
 		some = 1;
 	} while (mdb_cursor_get(mc, &k, &v, MDB_NEXT) == MDB_SUCCESS);
 
 	return some ? 3 : 0; // more - write, nothing
 }
 
+
+static int store_read(store *s, MDB_txn *txn, int itopic, u64 offset, event_visitor fn,
+		stored_visitor sfn, event_reserve reserve, void *ctx) {
+	u64 low = s->ts[itopic].low;
+	if (offset < low) offset = low;
+
+	MDB_dbi dbi = store_topic_rdbi(s, itopic);
+	if (!dbi) return 2; // topic db not committed yet
+
+	MDB_cursor *mc;
+	if (mdb_cursor_open(txn, dbi, &mc)) return 2;
+
+	int ret;
+	if (s->flags & STORE_BLOCKS) {
+		ret = store_read_blocks(s, mc, itopic, offset, fn, sfn, ctx);
+	} else {
+		ret = store_read_events(s, mc, itopic, offset, fn, sfn, reserve, ctx);
+	}
+
+	mdb_cursor_close(mc);
+	return ret;
+}
+
+int store_read_some(store *s, MDB_txn *txn, int itopic, u64 offset, event_visitor fn, void *ctx) {
+	return store_read(s, txn, itopic, offset, fn, NULL, NULL, ctx);
+}
+
+// store_read_some, lz4 events are decompressed into space reserve gives
+// and passed on from there. Blocks hold many events, they still go
+// through a scratch buffer
+int store_read_into(store *s, MDB_txn *txn, int itopic, u64 offset, event_visitor fn,
+		event_reserve reserve, void *ctx) {
+	return store_read(s, txn, itopic, offset, fn, NULL, reserve, ctx);
+}
+
+// store_read_some, lz4 events are passed on compressed as they are stored.
+// Events of a dictionary, or packed in blocks, are decompressed
+int store_read_stored(store *s, MDB_txn *txn, int itopic, u64 offset, stored_visitor fn, void *ctx) {
+	return store_read(s, txn, itopic, offset, NULL, fn, NULL, ctx);
+}
+
+int store_drop(store *s, int itopic) {
+	u64 low = store_get_offset(s, s->wtxn, itopic) & 0xffffffffffffULL;
+
+	if (store_put_meta(s, STORE_META_KEY(STORE_META_LOW, itopic, 0), &low, sizeof(u64))) {
+		return 1;
+	}
+
+	mtx_lock(&s->mutex);
+	s->ts[itopic].low = low;
+	store_reclaim_add(s, itopic);
+	mtx_unlock(&s->mutex);
+
+	return 0;
+}
+
+int store_reclaim_pending(store *s) {
+	return s->n_reclaim ? 1 : 0;
+}
+
+static store_retention *store_topic_retention(store *s, int itopic) {
+	return s->ts[itopic].has_retention ? &s->ts[itopic].retention : &s->retention;
+}
+
+// deletes time index entries of offsets below low, returns 1 if some remain
+static int store_trim_index(store *s, int itopic, u64 low) {
+	MDB_cursor *mc;
+	if (mdb_cursor_open(s->wtxn, s->dbi, &mc)) return -1;
+
+	int ret = 0;
+	u64 key = STORE_META_KEY(STORE_META_TIME, itopic, 0);
+	MDB_val k, v;
+	k.mv_data = &key;
+	k.mv_size = sizeof(u64);
+	int rc = mdb_cursor_get(mc, &k, &v, MDB_SET_RANGE);
+	for (int n = 0; rc == MDB_SUCCESS; n++) {
+		memcpy(&key, k.mv_data, sizeof(u64));
+		if (key >= STORE_META_KEY(STORE_META_TIME, itopic+1, 0)) break;
+
+		u64 offset;
+		memcpy(&offset, v.mv_data, sizeof(u64));
+		if (offset >= low) break;
+
+		if (n == STORE_RECLAIM_CHUNK) {
+			ret = 1;
+			break;
+		}
+		if (store_check(s, mdb_cursor_del(mc, 0))) {
+			ret = -1;
+			break;
+		}
+		rc = mdb_cursor_get(mc, &k, &v, MDB_NEXT);
+	}
+
+	mdb_cursor_close(mc);
+	return ret;
+}
+
+// deletes up to STORE_RECLAIM_CHUNK values below a topic's low watermark in
+// one small txn, returns 1 while there is more to reclaim. Over max_bytes
+// the oldest values go too, raising the watermark
+int store_reclaim(store *s) {
+	if (!s->n_reclaim) return 0;
+
+	int itopic = s->reclaim[0];
+	store_topic *t = s->ts + itopic;
+	u64 max_bytes = store_topic_retention(s, itopic)->max_bytes;
+
+	MDB_dbi dbi = store_topic_dbi(s, itopic);
+
+	int done = 0;
+	u64 low = t->low;
+	u64 reclaimed = t->reclaimed;
+	u64 bytes = 0;
+
+	if (store_write_txn_begin(s)) return -1;
+
+	MDB_cursor *mc;
+	if (!dbi || mdb_cursor_open(s->wtxn, dbi, &mc)) {
+		done = 1;
+		goto index;
+	}
+
+	u64 key = (((u64)itopic) << 48) | reclaimed;
+	MDB_val k, v;
+	k.mv_data = &key;
+	k.mv_size = sizeof(u64);
+
+	int rc = mdb_cursor_get(mc, &k, &v, MDB_SET_RANGE);
+	for (int n = 0; n < STORE_RECLAIM_CHUNK; n++) {
+		if (rc != MDB_SUCCESS) {
+			done = 1;
+			break;
+		}
+
+		u64 u;
+		memcpy(&u, k.mv_data, sizeof(u64));
+		if ((u>>48) != itopic) {
+			done = 1;
+			break;
+		}
+
+		u64 end = (u&0xffffffffffffULL) + 1;
+		if (s->flags & STORE_BLOCKS) {
+			store_block_header h;
+			memcpy(&h, v.mv_data, sizeof(store_block_header));
+			end += h.count - 1;
+		}
+		if (end > low && !(max_bytes && t->bytes - bytes > max_bytes)) {
+			done = 1;
+			break;
+		}
+
+		bytes += k.mv_size + v.mv_size;
+		if (store_check(s, mdb_cursor_del(mc, 0))) {
+			mdb_cursor_close(mc);
+			goto err;
+		}
+		reclaimed = end;
+		if (end > low) low = end;
+
+		rc = mdb_cursor_get(mc, &k, &v, MDB_NEXT);
+	}
+
+	mdb_cursor_close(mc);
+index:
+	if (done) {
+		int trimmed = store_trim_index(s, itopic, low);
+		if (trimmed < 0) goto err;
+		if (trimmed) done = 0;
+	}
+
+	// retention only raises the watermark in memory, persist it here
+	if (store_put_meta(s, STORE_META_KEY(STORE_META_LOW, itopic, 0), &low, sizeof(u64))) {
+		goto err;
+	}
+	if (bytes) {
+		store_touch(s, itopic);
+		t->bytes -= bytes;
+		store_mark_dirty(s, itopic);
+	}
+
+	if (store_write_txn_end(s)) return -1;
+
+	mtx_lock(&s->mutex);
+	t->low = low;
+	t->reclaimed = done ? low : reclaimed;
+	t->reclaimed_bytes += bytes;
+	if (done) {
+		t->reclaiming = 0;
+		s->reclaim[0] = s->reclaim[--s->n_reclaim];
+	}
+	mtx_unlock(&s->mutex);
+
+	return s->n_reclaim ? 1 : 0;
+err:
+	store_write_txn_abort(s);
+	return -1;
+}
+
+void store_topic_status(store *s, int itopic, store_status *st) {
+	mtx_lock(&s->mutex);
+	store_topic *t = s->ts + itopic;
+	st->low = t->low;
+	st->reclaiming = t->reclaiming;
+	st->reclaimed = t->reclaimed - t->reclaim_from; // by the latest job
+	st->pending = t->reclaiming && t->low > t->reclaimed ? t->low - t->reclaimed : 0;
+	st->reclaimed_bytes = t->reclaimed_bytes;
+	st->bytes = t->bytes;
+	st->retention = *store_topic_retention(s, itopic);
+	st->committed = t->committed;
+	st->durable = t->durable;
+	mtx_unlock(&s->mutex);
+}
+
+int store_wait_commit(store *s, int itopic, u64 offset, commit_waiter fn, void *ctx) {
+	mtx_lock(&s->mutex);
+	int committed = s->ts[itopic].committed > offset;
+	if (!committed) fn(ctx);
+	mtx_unlock(&s->mutex);
+	return committed;
+}
+
+int store_set_retention(store *s, int itopic, store_retention *r) {
+	if (store_put_meta(s, STORE_META_KEY(STORE_META_RETENTION, itopic, 0),
+			r, sizeof(store_retention))) {
+		return 1;
+	}
+
+	mtx_lock(&s->mutex);
+	s->ts[itopic].retention = *r;
+	s->ts[itopic].has_retention = 1;
+	mtx_unlock(&s->mutex);
+
+	s->retained_at = 0; // check on the next call
+	return 0;
+}
+
+// first offset written at or after time, 1 if nothing was written since
+int store_time_offset(store *s, MDB_txn *txn, int itopic, u64 time, u64 *offset) {
+	u64 key = STORE_META_KEY(STORE_META_TIME, itopic, store_time_arg(s, time));
+	MDB_val k, v;
+	k.mv_data = &key;
+	k.mv_size = sizeof(u64);
+
+	MDB_cursor *mc;
+	if (mdb_cursor_open(txn, s->dbi, &mc)) return -1;
+
+	int ret = 1;
+	if (mdb_cursor_get(mc, &k, &v, MDB_SET_RANGE) == MDB_SUCCESS) {
+		memcpy(&key, k.mv_data, sizeof(u64));
+		if (key < STORE_META_KEY(STORE_META_TIME, itopic+1, 0)) {
+			memcpy(offset, v.mv_data, sizeof(u64));
+			ret = 0;
+
+			// entries below the watermark are trimmed, what is left of
+			// their events comes before the first one
+			if (mdb_cursor_get(mc, &k, &v, MDB_PREV) != MDB_SUCCESS) {
+				*offset = s->ts[itopic].low;
+			} else {
+				memcpy(&key, k.mv_data, sizeof(u64));
+				if (key < STORE_META_KEY(STORE_META_TIME, itopic, 0)) *offset = s->ts[itopic].low;
+			}
+			if (*offset < s->ts[itopic].low) *offset = s->ts[itopic].low;
+		}
+	}
+
+	mdb_cursor_close(mc);
+	return ret;
+}
+
+// raises the watermark of topics over their retention policy, once a second
+int store_retain(store *s) {
+	u64 now = time(NULL);
+	if (now == s->retained_at) return 0;
+	s->retained_at = now;
+
+	// topics are numbered from 1 as they are added. Not under tmutex: a
+	// writer holds it while it waits for room in the store queue
+	int n_topics = atomic_load(&s->n_topics);
+
+	MDB_txn *txn = NULL;
+	int ret = 0;
+	for (int itopic = 1; itopic <= n_topics; itopic++) {
+		store_topic *t = s->ts + itopic;
+		store_retention *r = store_topic_retention(s, itopic);
+		if (s->write_offsets[itopic] < 0) continue;
+
+		u64 head = s->write_offsets[itopic] & 0xffffffffffffULL;
+		u64 low = t->low;
+
+		if (r->max_events && head - low > r->max_events) {
+			low = head - r->max_events;
+		}
+		if (r->max_age && now > r->max_age) {
+			if (!txn && mdb_txn_begin(s->env, NULL, MDB_RDONLY, &txn)) return -1;
+
+			u64 offset;
+			int rc = store_time_offset(s, txn, itopic, now - r->max_age, &offset);
+			if (rc < 0) {
+				ret = -1;
+				break;
+			}
+			if (rc) offset = head; // nothing newer
+			if (offset > low) low = offset;
+		}
+
+		if (low > t->low || (r->max_bytes && t->bytes > r->max_bytes)) {
+			mtx_lock(&s->mutex);
+			t->low = low; // persisted by the reclaim
+			store_reclaim_add(s, itopic);
+			mtx_unlock(&s->mutex);
+		}
+	}
+
+	if (txn) mdb_txn_commit(txn);
+	return ret;
+}
+
+// pages on the freelist, reused before the map grows
+static u64 store_free_pages(store *s) {
+	MDB_txn *txn;
+	if (mdb_txn_begin(s->env, NULL, MDB_RDONLY, &txn)) return 0;
+
+	MDB_cursor *mc;
+	if (mdb_cursor_open(txn, 0, &mc)) {
+		mdb_txn_abort(txn);
+		return 0;
+	}
+
+	u64 pages = 0;
+	MDB_val k, v;
+	while (mdb_cursor_get(mc, &k, &v, MDB_NEXT) == MDB_SUCCESS) {
+		size_t n; // each record is an id list, prefixed by its length
+		memcpy(&n, v.mv_data, sizeof(size_t));
+		pages += n;
+	}
+
+	mdb_cursor_close(mc);
+	mdb_txn_abort(txn);
+	return pages;
+}
+
+// doubles the map when forced (a put hit MDB_MAP_FULL) or when less than
+// the headroom is left, between write txns. Readers are held off meanwhile
+int store_grow(store *s, int force) {
+	MDB_envinfo info;
+	MDB_stat st;
+	if (mdb_env_info(s->env, &info) || mdb_env_stat(s->env, &st)) return 1;
+
+	u64 headroom = info.me_mapsize / 8;
+	if (headroom < STORE_MAP_HEADROOM) headroom = STORE_MAP_HEADROOM;
+	u64 used = (info.me_last_pgno + 1) * (u64)st.ms_psize;
+	if (!force) {
+		if (used + headroom <= info.me_mapsize) return 0;
+		used -= store_free_pages(s) * st.ms_psize;
+		if (used + headroom <= info.me_mapsize) return 0;
+	}
+
+	u64 size = info.me_mapsize * 2;
+	while (size < used + headroom) size *= 2;
+	if (s->max_mapsize && size > s->max_mapsize) size = s->max_mapsize;
+	if (size <= info.me_mapsize) return force; // at the limit
+
+	mtx_lock(&s->rmutex);
+	s->resizing = 1;
+	while (s->readers) cnd_wait(&s->rcnd, &s->rmutex);
+	int rc = mdb_env_set_mapsize(s->env, size);
+	s->resizing = 0;
+	cnd_broadcast(&s->rcnd);
+	mtx_unlock(&s->rmutex);
+
+	if (rc) return 1;
+	printf("map grown to %llu bytes\n", (unsigned long long)size);
+	return 0;
+}
+
+// anything using the map outside the store worker holds off growth
+static void store_gate_enter(store *s) {
+	mtx_lock(&s->rmutex);
+	while (s->resizing) cnd_wait(&s->rcnd, &s->rmutex);
+	s->readers++;
+	mtx_unlock(&s->rmutex);
+}
+
+static void store_gate_leave(store *s) {
+	mtx_lock(&s->rmutex);
+	if (!--s->readers) cnd_broadcast(&s->rcnd);
+	mtx_unlock(&s->rmutex);
+}
+
+int store_read_begin(store *s, MDB_txn *txn) {
+	store_gate_enter(s);
+	if (mdb_txn_renew(txn)) {
+		store_gate_leave(s);
+		return 1;
+	}
+	return 0;
+}
+
+void store_read_end(store *s, MDB_txn *txn) {
+	mdb_txn_reset(txn);
+	store_gate_leave(s);
+}
+
+// store_time_offset in a read txn of its own
+int store_time_lookup(store *s, int itopic, u64 time, u64 *offset) {
+	MDB_txn *txn;
+	store_gate_enter(s);
+	if (mdb_txn_begin(s->env, NULL, MDB_RDONLY, &txn)) {
+		store_gate_leave(s);
+		return -1;
+	}
+
+	int rc = store_time_offset(s, txn, itopic, time, offset);
+
+	mdb_txn_abort(txn);
+	store_gate_leave(s);
+	return rc;
+}
+
+// flushes commits of a nosync store, waiting for one when there are none
+// and at most every interval ms. Runs beside the store worker, so txn N+1
+// is built while N is flushed. Returns 1 once stopped
+int store_sync(store *s, u32 interval) {
+	mtx_lock(&s->smutex);
+	while (!s->n_sync && !s->sync_stop) cnd_wait(&s->scnd, &s->smutex);
+	if (interval && !s->sync_stop) { // let more commits in
+		struct timespec ts;
+		timespec_get(&ts, TIME_UTC);
+		ts.tv_sec += interval / 1000;
+		ts.tv_nsec += (interval % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		while (!s->sync_stop && cnd_timedwait(&s->scnd, &s->smutex, &ts) == thrd_success);
+	}
+	int stop = s->sync_stop;
+
+	// commits so far, flushed by this sync
+	u32 n = s->n_sync;
+	int *list = s->sync_flush;
+	u64 *offsets = s->sync_offsets;
+	for (u32 i = 0; i < n; i++) {
+		int itopic = s->sync_list[i];
+		list[i] = itopic;
+		offsets[i] = s->ts[itopic].committed;
+		s->ts[itopic].sync_pending = 0;
+	}
+	s->n_sync = 0;
+	mtx_unlock(&s->smutex);
+
+	store_gate_enter(s);
+	int rc = mdb_env_sync(s->env, 1);
+	store_gate_leave(s);
+
+	if (!rc) {
+		mtx_lock(&s->mutex);
+		for (u32 i = 0; i < n; i++) s->ts[list[i]].durable = offsets[i];
+		mtx_unlock(&s->mutex);
+	}
+
+	if (rc) return -1;
+	return stop;
+}
+
+void store_sync_stop(store *s) {
+	mtx_lock(&s->smutex);
+	s->sync_stop = 1;
+	cnd_signal(&s->scnd);
+	mtx_unlock(&s->smutex);
+}
+
+typedef struct store_sample {
+	char buf[STORE_DICT_SIZE * 2];
+	u32 len;
+} store_sample;
+
+static int store_sample_visitor(u64 offset, char *buf, u32 len, void *ctx) {
+	store_sample *smp = (store_sample*)ctx;
+	if (len > STORE_DICT_SIZE) {
+		buf += len - STORE_DICT_SIZE;
+		len = STORE_DICT_SIZE;
+	}
+	if (smp->len + len > sizeof(smp->buf)) { // keep the newest bytes
+		memmove(smp->buf, smp->buf + smp->len - STORE_DICT_SIZE, STORE_DICT_SIZE);
+		smp->len = STORE_DICT_SIZE;
+	}
+	memcpy(smp->buf + smp->len, buf, len);
+	smp->len += len;
+	return 0;
+}
+
+// builds a dictionary from the most recent events, used from the next offset on
+static int store_train_dict(store *s, int itopic) {
+	if (s->write_offsets[itopic] < 0) return 0;
+	u64 head = s->write_offsets[itopic] & 0xffffffffffffULL;
+
+	store_sample smp;
+	smp.len = 0;
+
+	if (store_write_txn_begin(s)) return 1;
+
+	u64 from = head > STORE_DICT_SAMPLES ? head - STORE_DICT_SAMPLES : 0;
+	if (store_read_some(s, s->wtxn, itopic, from, store_sample_visitor, &smp) < 0 || !smp.len) {
+		store_write_txn_abort(s);
+		return 0;
+	}
+
+	u32 size = smp.len < STORE_DICT_SIZE ? smp.len : STORE_DICT_SIZE;
+	char *dict = smp.buf + smp.len - size;
+
+	u64 key = STORE_META_KEY(STORE_META_DICTS, itopic, 0);
+	MDB_val k, v;
+	k.mv_data = &key;
+	k.mv_size = sizeof(u64);
+
+	u32 n = 0;
+	if (mdb_get(s->wtxn, s->dbi, &k, &v) == MDB_SUCCESS) {
+		n = v.mv_size / sizeof(u64);
+	}
+	u64 *froms = (u64*)malloc((n + 1) * sizeof(u64));
+	if (!froms) goto err;
+	if (n) memcpy(froms, v.mv_data, n * sizeof(u64));
+	if (n && froms[n-1] == head) n--; // nothing written with the previous one
+	froms[n++] = head;
+
+	v.mv_data = froms;
+	v.mv_size = n * sizeof(u64);
+	int rc = store_check(s, mdb_put(s->wtxn, s->dbi, &k, &v, 0));
+	free(froms);
+	if (rc) goto err;
+
+	key = STORE_META_KEY(STORE_META_DICT, itopic, n);
+	v.mv_data = dict;
+	v.mv_size = size;
+	if (store_check(s, mdb_put(s->wtxn, s->dbi, &k, &v, 0))) goto err;
+
+	if (store_write_txn_end(s)) return 1;
+
+	store_dict *d = s->dicts[itopic];
+	if (!d) {
+		d = store_dict_new();
+		if (!d) return 1;
+		s->dicts[itopic] = d;
+	}
+	store_dict_set(d, n, dict, size);
+	s->ratios[itopic].skip = 0; // worth another try
+
+	return 0;
+err:
+	store_write_txn_abort(s);
+	return 1;
+}
+
+int store_train_pending(store *s) {
+	return s->n_train ? 1 : 0;
+}
+
+int store_train_dicts(store *s) {
+	if (!s->n_train) return 0;
+
+	int itopic = s->train[--s->n_train];
+	s->ratios[itopic].pending = 0;
+
+	return store_train_dict(s, itopic);
+}
@@ -2,40 +2,232 @@
 #define STORE_H
 
 #include "lib/liblmdb/lmdb.h"
+#include "lib/lz4/lz4.h"
 
 #include "common.h"
 #include "la.h"
+#include "threads.h"
+
+#include <stdatomic.h>
 
 la_hashmap_dec(map_str_int, char*, int);
 
+// store flags, format ones are persisted on database creation
+#define STORE_BLOCKS 0x1 // pack each topic's events of a commit into one block
+#define STORE_DICTS  0x2 // train per topic compression dictionaries
+#define STORE_TOPIC_DBS 0x4 // one lmdb db per topic
+#define STORE_NOSYNC 0x8 // commits don't flush, store_sync does
+#define STORE_NOMETASYNC 0x10 // commits flush data, store_sync the meta page
+#define STORE_TAGGED 0x20 // values start with a codec tag, set on new databases
+
+#define STORE_FORMAT_FLAGS (STORE_BLOCKS | STORE_TOPIC_DBS | STORE_TAGGED)
+
+#define STORE_CODEC_RAW 0
+#define STORE_CODEC_LZ4 1
+
+#define STORE_BLOCK_SIZE (1<<16) // max uncompressed block (index + events)
+#define STORE_STAGE_SIZE (1<<22) // bytes staged before blocks are flushed
+#define STORE_STAGE_EVENTS (1<<16)
+
+#define STORE_DICT_SIZE (1<<14)
+#define STORE_DICT_SAMPLES 256 // most recent events a dictionary is built from
+#define STORE_DICT_WINDOW (1<<20) // raw bytes between compression ratio checks
+#define STORE_TRAIN_QUEUE 64
+
+#define STORE_MIN_COMPRESS 32 // smaller events are stored raw, unless a dictionary helps
+#define STORE_RAW_RATIO 0.9f // topics compressing worse are stored raw for a while
+#define STORE_RAW_SKIP (STORE_DICT_WINDOW * 8) // raw bytes before lz4 is tried again
+
+#define STORE_RECLAIM_CHUNK 1024 // values deleted per reclaim txn
+
+#define STORE_MAP_HEADROOM (1ULL<<26) // free map kept ahead of a batch, at least
+
+#define STORE_TIME_BITS 28 // time index covers ~8 years of seconds from creation
+
+typedef struct store_staged {
+	int itopic;
+	u32 pos;
+	u32 len;
+	u64 offset;
+} store_staged;
+
+typedef struct store_dict {
+	u32 version;
+	int size;
+	float ratio; // compression ratio right after training
+	LZ4_stream_t *stream; // data loaded, hashed once per version
+	char data[STORE_DICT_SIZE];
+} store_dict;
+
+typedef struct store_ratio {
+	u32 raw;
+	u32 packed;
+	int pending;
+	u32 skip; // bytes left to store raw
+} store_ratio;
+
+// 0 = unlimited
+typedef struct store_retention {
+	u64 max_age; // seconds
+	u64 max_bytes;
+	u64 max_events;
+} store_retention;
+
+typedef struct store_topic {
+	u64 low; // first readable offset, everything below is reclaimed
+	u64 reclaim_from;
+	u64 reclaimed; // reclaim progress, offsets below are deleted
+	u64 reclaimed_bytes;
+	int reclaiming;
+
+	u64 bytes; // keys + values stored
+	int dirty; // size record to be written on commit
+	u64 indexed; // last time index entry + 1
+
+	// state before the write txn, restored if it aborts
+	int touched;
+	u64 committed; // offsets below are committed
+	u64 durable; // offsets below are flushed to disk
+	int sync_pending;
+	i64 saved_offset;
+	u64 saved_bytes;
+	u64 saved_indexed;
+
+	store_retention retention;
+	int has_retention; // else the store's default applies
+} store_topic;
+
+typedef struct store_status {
+	u64 low;
+	int reclaiming;
+	u64 reclaimed;
+	u64 pending;
+	u64 reclaimed_bytes;
+	u64 bytes;
+	store_retention retention;
+	u64 committed;
+	u64 durable;
+} store_status;
+
 typedef struct store {
 	MDB_env *env;
-	MDB_dbi  dbi;
+	MDB_dbi  dbi; // meta, and every topic without STORE_TOPIC_DBS
+	MDB_dbi *tdbis; // the writer's
+	atomic_uint *rdbis; // readers', set once the topic db is committed
 	MDB_txn *wtxn;
 	MDB_cursor *wmc;
 
 	map_str_int topics;
+	mtx_t tmutex; // topic names, every writer looks them up
+	atomic_int n_topics; // highest itopic, read without tmutex
+	int n_seeks; // topics loaded without an offset checkpoint
+
+	u32 flags;
 
 	char *compressed;
 	int max_compressed;
 
+	// dictionaries, latest version of each topic
+	store_dict **dicts;
+	store_ratio *ratios;
+	LZ4_stream_t *lz4;
+	int acceleration; // lz4, 1 = default, raised while writes back up
+	int train[STORE_TRAIN_QUEUE];
+	u32 n_train;
+
+	// reclaim jobs
+	store_topic *ts;
+	int *reclaim;
+	u32 n_reclaim;
+	mtx_t mutex; // reclaim progress
+	int *dirty;
+	u32 n_dirty;
+	int *touched;
+	u32 n_touched;
+
+	// map growth, readers wait while the map is resized
+	u64 max_mapsize; // 0 = unlimited
+	int map_full;
+	mtx_t rmutex;
+	cnd_t rcnd;
+	int readers;
+	int resizing;
+
+	// sync, commits not flushed yet
+	mtx_t smutex;
+	cnd_t scnd;
+	int *sync_list;
+	u32 n_sync;
+	int *sync_flush; // sync thread's copy
+	u64 *sync_offsets;
+	int sync_stop;
+
+	// retention
+	store_retention retention; // default
+	u64 epoch; // time index base
+	u64 now; // write txn time, events may be stamped with their ingest time
+	u64 retained_at;
+
+	// block staging
+	char *block;
+	char *staged;
+	u32 staged_len;
+	store_staged *staged_events;
+	u32 n_staged;
+
 	i64 write_offsets[MAX_TOPICS];
 } store;
 
-int store_init(store *s, char *name, u32 maxdbs, u64 mapsz);
+int store_init(store *s, char *name, u32 maxdbs, u64 mapsz, u32 flags);
 void store_destroy(store *s);
 
 int store_get_topic(store *s, char *topic, u32 topic_len, int create, int *newtopic);
+// creates a topic if needed, fn runs for a new one before anyone else can find it
+typedef void (*topic_added)(int itopic, char *topic, u32 topic_len, void *ctx);
+int store_add_topic(store *s, char *topic, u32 topic_len, topic_added fn, void *ctx);
 int store_create_topic(store *s, char *topic, u32 topic_len, int itopic);
 
 int store_write_txn_begin(store *s);
 int store_write_txn_end(store *s);
+void store_write_txn_abort(store *s);
 int store_write_event(store *s, int itopic, char *buf, u32 len);
+int store_write_compressed(store *s, int itopic, char *buf, u32 len);
+u32 store_batch_events(char *buf, u32 len);
+int store_write_batch(store *s, int itopic, char *buf, u32 len, u32 *n);
+
+int store_drop(store *s, int itopic);
+int store_reclaim(store *s);
+int store_reclaim_pending(store *s);
+void store_topic_status(store *s, int itopic, store_status *st);
+// 1 = committed past offset, else fn ran before the next commit
+typedef void (*commit_waiter)(void *ctx);
+int store_wait_commit(store *s, int itopic, u64 offset, commit_waiter fn, void *ctx);
+
+int store_set_retention(store *s, int itopic, store_retention *r);
+int store_retain(store *s);
+int store_time_offset(store *s, MDB_txn *txn, int itopic, u64 time, u64 *offset);
+int store_time_lookup(store *s, int itopic, u64 time, u64 *offset);
 
-int store_drop(store *s, char *topic);
+int store_train_dicts(store *s);
+int store_train_pending(store *s);
+
+int store_grow(store *s, int force);
+int store_sync(store *s, u32 interval);
+void store_sync_stop(store *s);
+
+int store_read_begin(store *s, MDB_txn *txn);
+void store_read_end(store *s, MDB_txn *txn);
 
 typedef int (*event_visitor)(u64 offset, char *buf, u32 len, void *ctx);
-int store_read_some(MDB_cursor *mc, int itopic, u64 offset, event_visitor fn, void *ctx);
+int store_read_some(store *s, MDB_txn *txn, int itopic, u64 offset, event_visitor fn, void *ctx);
+
+// room for the next event, *cap bytes. NULL = none
+typedef char *(*event_reserve)(void *ctx, u32 *cap);
+int store_read_into(store *s, MDB_txn *txn, int itopic, u64 offset, event_visitor fn,
+		event_reserve reserve, void *ctx);
+
+typedef int (*stored_visitor)(u64 offset, u8 codec, char *buf, u32 len, void *ctx);
+int store_read_stored(store *s, MDB_txn *txn, int itopic, u64 offset, stored_visitor fn, void *ctx);
 
 #endif /* STORE_H */
 
@@ -25,6 +25,7 @@
 #include "common.h"
 #include "connection.h"
 #include "ev.h"
+#include "lib/lz4/lz4.h"
 #include "sock.h"
 
 #include <arpa/inet.h>
@@ -39,11 +40,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 connection sock_watcher;
 connection stdout_watcher;
 
 int bp = 0;
+int dropped = 0; // exit once stdout is written
+int wire = 0; // WIRE_ options asked for
 
 void sock_cb(struct ev_loop *loop, struct ev_io *w, int revents) {
 	connection* conn = (connection*)w;
@@ -88,6 +92,30 @@ void sock_cb(struct ev_loop *loop, struct ev_io *w, int revents) {
 		char *str = buf + sizeof(u64);
 		int str_len = (int)(len - sizeof(u64));
 
+		// events may come compressed as stored
+		char raw[MAX_MESSAGE_SIZE];
+		if ((wire & WIRE_CODEC) && str_len > 0) {
+			u8 codec = *str++;
+			str_len--;
+			if (codec == WIRE_LZ4) {
+				str_len = LZ4_decompress_safe(str, raw, str_len, sizeof(raw));
+				if (str_len < 0) {
+					fprintf(stderr, "bad event at %llu\n", (unsigned long long)offset);
+					exit(1);
+				}
+				str = raw;
+			}
+		}
+
+		if (offset == ~0ULL) { // not an event, the topic is gone
+			fprintf(stderr, "%.*s\n", str_len, str);
+			connection_consume_multi(conn, parts, 2);
+			dropped = 1;
+			if (connection_empty_send(&stdout_watcher)) exit(0);
+			ev_io_stop(loop, w);
+			return;
+		}
+
 #if 1
 		// write stdout
 		connection_iovec wparts[2];
@@ -128,6 +156,7 @@ static void stdout_cb(struct ev_loop *loop, struct ev_io *w, int revents) {
 		connection_onwrite(conn, loop);
 
 		if (connection_empty_send(conn)) {
+			if (dropped) exit(0);
 			connection_disable_write(conn, loop);
 		}
 
@@ -139,7 +168,7 @@ static void stdout_cb(struct ev_loop *loop, struct ev_io *w, int revents) {
 }
 
 void usage() {
-	fprintf(stderr, "Usage: esq-tail [-h host] [-p port] [-n number] topic\n");
+	fprintf(stderr, "Usage: esq-tail [-h host] [-p port] [-n number | -t seconds | -t @time] [-z] topic\n");
 	exit(1);
 }
 
@@ -150,6 +179,7 @@ int main(int argc, char **argv) {
 	char *port = "4000";
 	char *topic = NULL;
 	char *off = "0";
+	char *since = NULL;
 	for (int i = 1; i < argc; i++) {
 		if (!strcmp(argv[i], "-h")) {
 			if (++i >= argc) usage();
@@ -160,6 +190,11 @@ int main(int argc, char **argv) {
 		} else if (!strcmp(argv[i], "-n")) {
 			if (++i >= argc) usage();
 			off = argv[i];
+		} else if (!strcmp(argv[i], "-t")) {
+			if (++i >= argc) usage();
+			since = argv[i];
+		} else if (!strcmp(argv[i], "-z")) {
+			wire |= WIRE_CODEC;
 		} else if (!strcmp(argv[i], "--")) {
 			break;
 		} else {
@@ -185,6 +220,17 @@ int main(int argc, char **argv) {
 	if (begin) offset++;
 	else if (offset > 0) offset = -offset;
 
+	// by time: seconds ago, or @ a unix time
+	char *cmd = "w";
+	if (since) {
+		char *endptr;
+		u64 t = strtoull(since + (*since == '@'), &endptr, 10);
+		if (*endptr || endptr == since + (*since == '@')) usage();
+		if (*since != '@') t = time(NULL) > t ? time(NULL) - t : 0;
+		offset = (i64)t;
+		cmd = "T";
+	}
+
 
 	unsigned int evflags = ev_recommended_backends() | EVBACKEND_KQUEUE | EVBACKEND_EPOLL;
 	struct ev_loop *loop = ev_default_loop(evflags);
@@ -203,12 +249,24 @@ int main(int argc, char **argv) {
 	ev_io_init(&stdout_watcher.io, stdout_cb, 1, 0);
 	ev_io_start(loop, &stdout_watcher.io);
 
+	// events compressed as stored, decompressed here
+	if (wire) {
+		u32 total_len = 2 * sizeof(char);
+		char opts[2] = { 'o', (char)wire };
+		connection_iovec parts[2];
+		parts[0].buf = &total_len;
+		parts[0].len = sizeof(u32);
+		parts[1].buf = opts;
+		parts[1].len = sizeof(opts);
+		connection_send_multi(&sock_watcher, parts, 2);
+	}
+
 	// send watch request
 	u32 total_len = sizeof(char) + sizeof(i64) + strlen(topic);
 	connection_iovec parts[4];
 	parts[0].buf = &total_len;
 	parts[0].len = sizeof(u32);
-	parts[1].buf = "w";
+	parts[1].buf = cmd;
 	parts[1].len = sizeof(char);
 	parts[2].buf = &offset;
 	parts[2].len = sizeof(i64);
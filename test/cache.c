@@ -0,0 +1,138 @@
+#include "munit/munit.h"
+
+#include "../cache.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct read_context {
+	u64 next;
+	int n;
+	int max;
+} read_context;
+
+static int visitor(u64 offset, char *buf, u32 len, void *ctx) {
+	read_context *c = (read_context*)ctx;
+	if (c->n == c->max) return 1;
+
+	char expected[64];
+	int n = sprintf(expected, "event %llu", (unsigned long long)offset);
+	munit_assert(offset == c->next);
+	munit_assert(len == (u32)n);
+	munit_assert(0 == memcmp(buf, expected, n));
+
+	c->next++;
+	c->n++;
+	return 0;
+}
+
+static void put(event_cache *c, int itopic, u64 from, u64 to) {
+	for (u64 i = from; i < to; i++) {
+		char buf[64];
+		int n = sprintf(buf, "event %llu", (unsigned long long)i);
+		event_cache_put(c, itopic, i, buf, n);
+	}
+}
+
+static MunitResult test_rw(const MunitParameter params[], void* data) {
+	event_cache c;
+	munit_assert(0 == event_cache_init(&c, 4));
+
+	munit_assert(-2 == event_cache_read(&c, 1, 0, visitor, NULL));
+
+	put(&c, 1, 100, 200);
+	read_context ctx = { 150, 0, 1000 };
+	munit_assert(1 == event_cache_read(&c, 1, 150, visitor, &ctx));
+	munit_assert(50 == ctx.n);
+	munit_assert(2 == event_cache_read(&c, 1, 200, visitor, &ctx));
+	munit_assert(-2 == event_cache_read(&c, 1, 99, visitor, &ctx));
+	munit_assert(-2 == event_cache_read(&c, 1, 201, visitor, &ctx));
+
+	// full buffer
+	read_context some = { 100, 0, 10 };
+	munit_assert(3 == event_cache_read(&c, 1, 100, visitor, &some));
+	munit_assert(10 == some.n);
+	munit_assert(0 == event_cache_read(&c, 1, some.next, visitor, &some));
+
+	// evicted by count
+	put(&c, 1, 200, 200 + CACHE_SLOT_EVENTS);
+	munit_assert(-2 == event_cache_read(&c, 1, 199, visitor, &ctx));
+	read_context all = { 200, 0, CACHE_SLOT_EVENTS * 2 };
+	munit_assert(1 == event_cache_read(&c, 1, 200, visitor, &all));
+	munit_assert(CACHE_SLOT_EVENTS == all.n);
+
+	// a gap starts over
+	put(&c, 1, 5000, 5010);
+	munit_assert(-2 == event_cache_read(&c, 1, 1000, visitor, &ctx));
+
+	// topics sharing a slot take it over
+	put(&c, 5, 0, 10);
+	munit_assert(-2 == event_cache_read(&c, 1, 5005, visitor, &ctx));
+	read_context other = { 0, 0, 100 };
+	munit_assert(1 == event_cache_read(&c, 5, 0, visitor, &other));
+	munit_assert(10 == other.n);
+
+	munit_assert(0 < c.hits);
+	munit_assert(0 < c.misses);
+
+	event_cache_destroy(&c);
+	return MUNIT_OK;
+}
+
+static MunitResult test_bytes(const MunitParameter params[], void* data) {
+	event_cache c;
+	munit_assert(0 == event_cache_init(&c, 1));
+
+	// big events: evicted by size, wrapping around the buffer
+	static char buf[CACHE_SLOT_BYTES / 3];
+	for (u64 i = 0; i < 100; i++) {
+		memset(buf, (int)i, sizeof(buf));
+		event_cache_put(&c, 1, i, buf, sizeof(buf) - (i % 7));
+
+		cache_slot *sl = c.slots;
+		munit_assert(i + 1 == sl->next);
+		munit_assert(sl->next - sl->first >= (i ? 2 : 1));
+		for (u64 o = sl->first; o < sl->next; o++) {
+			u32 k = o % CACHE_SLOT_EVENTS;
+			u8 *ev = sl->data + sl->starts[k] % CACHE_SLOT_BYTES;
+			munit_assert(sl->starts[k] % CACHE_SLOT_BYTES + sl->lens[k] <= CACHE_SLOT_BYTES);
+			munit_assert((u8)o == ev[0]);
+			munit_assert((u8)o == ev[sl->lens[k] - 1]);
+		}
+	}
+
+	// too big to cache at all
+	static char huge[CACHE_SLOT_BYTES + 1];
+	event_cache_put(&c, 1, 100, huge, sizeof(huge));
+	munit_assert(100 == c.slots->next);
+
+	event_cache_destroy(&c);
+
+	// disabled
+	munit_assert(0 == event_cache_init(&c, 0));
+	put(&c, 1, 0, 10);
+	munit_assert(-2 == event_cache_read(&c, 1, 0, visitor, NULL));
+	event_cache_destroy(&c);
+
+	return MUNIT_OK;
+}
+
+static void* setup(const MunitParameter params[], void* user_data) {
+	return NULL;
+}
+
+static void tear_down(void* fixture) {
+}
+
+static MunitTest test_suite_tests[] = {
+	{ "/test-rw", test_rw, setup, tear_down, 0, NULL },
+	{ "/test-bytes", test_bytes, setup, tear_down, 0, NULL },
+	{ NULL, NULL, NULL, NULL, 0, NULL }
+};
+
+static const MunitSuite test_suite = { "cache", test_suite_tests, NULL, 1, 0 };
+
+int main(int argc, char* argv[MUNIT_ARRAY_PARAM(argc + 1)]) {
+	return munit_suite_main(&test_suite, NULL, argc, argv);
+}
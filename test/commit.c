@@ -0,0 +1,114 @@
+#include "munit/munit.h"
+
+#include "../commit.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static MunitResult test_hist(const MunitParameter params[], void* data) {
+	commit_hist h;
+	memset(&h, 0, sizeof(h));
+
+	munit_assert(0 == commit_hist_quantile(&h, .5));
+
+	for (u64 i = 1; i <= 100; i++) commit_hist_add(&h, i);
+	munit_assert(100 == h.n);
+	munit_assert(100 == h.max);
+
+	// bucket upper bounds
+	munit_assert(63 == commit_hist_quantile(&h, .5));
+	munit_assert(100 == commit_hist_quantile(&h, .99));
+	munit_assert(1 == commit_hist_quantile(&h, 0));
+
+	commit_hist_add(&h, 0);
+	commit_hist_add(&h, ~0ULL);
+	munit_assert(~0ULL == commit_hist_quantile(&h, 1));
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_policy(const MunitParameter params[], void* data) {
+	group_commit gc;
+	munit_assert(0 == group_commit_init(&gc, 100, 10, 1000));
+
+	// caps
+	group_commit_begin(&gc, group_commit_now(), 0);
+	for (int i = 0; i < 9; i++) {
+		group_commit_add(&gc, 1);
+		munit_assert(!group_commit_full(&gc));
+	}
+	group_commit_add(&gc, 1);
+	munit_assert(group_commit_full(&gc));
+
+	group_commit_rewind(&gc);
+	munit_assert(!group_commit_full(&gc));
+	group_commit_add(&gc, 100);
+	munit_assert(group_commit_full(&gc));
+
+	// a batch's events count one by one
+	group_commit_rewind(&gc);
+	group_commit_add_events(&gc, 9, 50);
+	munit_assert(!group_commit_full(&gc));
+	group_commit_add_events(&gc, 1, 0);
+	munit_assert(group_commit_full(&gc));
+
+	// no linger without load
+	struct timespec deadline;
+	group_commit_begin(&gc, group_commit_now(), 0);
+	munit_assert(1 == group_commit_deadline(&gc, &deadline));
+
+	// linger follows the commit time under load, up to the max
+	u64 now = group_commit_now();
+	group_commit_done(&gc, now - 200, now);
+	munit_assert(200 == gc.commit_avg);
+	group_commit_begin(&gc, group_commit_now(), 1);
+	munit_assert(200 == gc.linger);
+	munit_assert(0 == group_commit_deadline(&gc, &deadline));
+
+	for (int i = 0; i < 64; i++) {
+		now = group_commit_now();
+		group_commit_done(&gc, now - 1000000, now);
+	}
+	group_commit_begin(&gc, group_commit_now(), 1);
+	munit_assert(1000 == gc.linger);
+
+	// and backs off when lingering brings nothing
+	group_commit_idle(&gc);
+	group_commit_idle(&gc);
+	munit_assert(250 == gc.linger);
+
+	// past the budget: commit
+	group_commit_begin(&gc, group_commit_now() - 1000000, 0);
+	munit_assert(1 == group_commit_deadline(&gc, &deadline));
+
+	munit_assert(65 == gc.batches);
+	munit_assert(65 == gc.commit_time.n);
+
+	char buf[1024];
+	int n = group_commit_json(&gc, buf, sizeof(buf));
+	munit_assert(n > 0 && n < (int)sizeof(buf));
+	munit_assert_not_null(strstr(buf, "\"batches\":65"));
+
+	group_commit_destroy(&gc);
+	return MUNIT_OK;
+}
+
+static void* setup(const MunitParameter params[], void* user_data) {
+	return NULL;
+}
+
+static void tear_down(void* fixture) {
+}
+
+static MunitTest test_suite_tests[] = {
+	{ "/test-hist", test_hist, setup, tear_down, 0, NULL },
+	{ "/test-policy", test_policy, setup, tear_down, 0, NULL },
+	{ NULL, NULL, NULL, NULL, 0, NULL }
+};
+
+static const MunitSuite test_suite = { "commit", test_suite_tests, NULL, 1, 0 };
+
+int main(int argc, char* argv[MUNIT_ARRAY_PARAM(argc + 1)]) {
+	return munit_suite_main(&test_suite, NULL, argc, argv);
+}
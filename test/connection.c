@@ -0,0 +1,239 @@
+#include "munit/munit.h"
+
+#include "../connection.h"
+
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static connection_shared *shared(char *s) {
+	connection_shared *b = connection_shared_new(strlen(s));
+	munit_assert(NULL != b);
+	memcpy(b->data, s, strlen(s));
+	return b;
+}
+
+static int drain(int fd, char *buf, int cap) {
+	int n = 0, r;
+	while (n < cap && (r = read(fd, buf + n, cap - n)) > 0) n += r;
+	return n;
+}
+
+static MunitResult test_order(const MunitParameter params[], void* data) {
+	int fds[2];
+	munit_assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+	connection c;
+	munit_assert(0 == connection_init(&c, 1<<14));
+	c.io.fd = fds[0];
+
+	// ring bytes and shared buffers go out as queued
+	connection_shared *a = shared("bbbb");
+	connection_shared *b = shared("dd");
+	munit_assert(0 == connection_send(&c, "aa", 2));
+	munit_assert(0 == connection_send_shared(&c, a));
+	munit_assert(0 == connection_send_shared(&c, b));
+	munit_assert(0 == connection_send(&c, "c", 1));
+	munit_assert(0 == connection_send_shared(&c, a));
+	munit_assert(0 == connection_empty_send(&c));
+	munit_assert(2 == atomic_load(&a->refs) - 1);
+
+	// not while references are queued
+	connection_iovec part = { "x", 1 };
+	munit_assert(0 == connection_write_direct(&c, &part, 1));
+
+	munit_assert(13 == connection_onwrite(&c, NULL));
+	munit_assert(1 == connection_empty_send(&c));
+	munit_assert(1 == atomic_load(&a->refs));
+	munit_assert(1 == atomic_load(&b->refs));
+
+	char buf[64];
+	munit_assert(13 == drain(fds[1], buf, sizeof(buf)));
+	munit_assert(0 == memcmp(buf, "aabbbbddcbbbb", 13));
+
+	// references are dropped with the connection's queue
+	munit_assert(0 == connection_send_shared(&c, b));
+	connection_reset(&c);
+	munit_assert(1 == connection_empty_send(&c));
+	munit_assert(1 == atomic_load(&b->refs));
+
+	connection_shared_release(a);
+	connection_shared_release(b);
+	connection_destroy(&c);
+	close(fds[0]);
+	close(fds[1]);
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_partial(const MunitParameter params[], void* data) {
+	int fds[2];
+	munit_assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	int small = 4096;
+	setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &small, sizeof(int));
+
+	connection c;
+	munit_assert(0 == connection_init(&c, 1<<14));
+	c.io.fd = fds[0];
+
+	// more than the socket takes at once, resumed mid buffer
+	int sent = 0, got = 0;
+	char *out = malloc(1<<24);
+	u8 next = 0;
+	for (int round = 0; round < 512; round++) {
+		connection_shared *b = connection_shared_new(1<<13);
+		munit_assert(NULL != b);
+		for (int i = 0; i < (1<<13); i++) b->data[i] = (char)(next + i);
+		if (!connection_send_shared(&c, b)) {
+			sent += 1<<13; // ends right before next again
+		}
+		connection_shared_release(b);
+
+		char tag = (char)next++;
+		if (!connection_send(&c, &tag, 1)) {
+			sent++;
+		} else {
+			next--;
+		}
+
+		munit_assert(connection_onwrite(&c, NULL) >= 0);
+		if (round % 3 == 0) got += drain(fds[1], out + got, (1<<24) - got);
+	}
+	while (!connection_empty_send(&c)) {
+		munit_assert(connection_onwrite(&c, NULL) >= 0);
+		got += drain(fds[1], out + got, (1<<24) - got);
+	}
+	got += drain(fds[1], out + got, (1<<24) - got);
+	munit_assert(sent == got);
+
+	// every byte follows the previous one
+	for (int i = 1; i < got; i++) {
+		munit_assert((u8)out[i] == (u8)(out[i-1] + 1));
+	}
+
+	free(out);
+	connection_destroy(&c);
+	close(fds[0]);
+	close(fds[1]);
+
+	return MUNIT_OK;
+}
+
+#define N_FRAMES 64
+#define FRAME_DATA 1000
+
+static MunitResult test_direct(const MunitParameter params[], void* data) {
+	int fds[2];
+	munit_assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	int small = 4096;
+	setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &small, sizeof(int));
+
+	connection c;
+	munit_assert(0 == connection_init(&c, 1<<14));
+	c.io.fd = fds[0];
+
+	// frames as a reader sends them, a length then the event
+	u32 lens[N_FRAMES];
+	char *events = malloc(N_FRAMES * FRAME_DATA);
+	connection_iovec parts[N_FRAMES * 2];
+	for (int i = 0; i < N_FRAMES; i++) {
+		lens[i] = FRAME_DATA;
+		memset(events + i * FRAME_DATA, 'a' + i % 26, FRAME_DATA);
+		parts[i*2].buf = lens + i;
+		parts[i*2].len = sizeof(u32);
+		parts[i*2+1].buf = events + i * FRAME_DATA;
+		parts[i*2+1].len = FRAME_DATA;
+	}
+
+	// more than the socket takes, it stops somewhere within a frame
+	int bytes = connection_write_direct(&c, parts, N_FRAMES * 2);
+	munit_assert(bytes > 0);
+	munit_assert(bytes < N_FRAMES * (int)(sizeof(u32) + FRAME_DATA));
+
+	// the rest of the partly sent frame goes through the ring
+	u32 sent = bytes;
+	int frames = 0;
+	for (u32 i = 0; i < N_FRAMES && sent; i++) {
+		u32 frame = parts[i*2].len + parts[i*2+1].len;
+		frames++;
+		if (sent >= frame) {
+			sent -= frame;
+			continue;
+		}
+		connection_iovec rest[2];
+		u32 n = 0;
+		for (u32 j = i*2; j < i*2+2; j++) {
+			if (sent >= parts[j].len) {
+				sent -= parts[j].len;
+				continue;
+			}
+			rest[n].buf = (u8*)parts[j].buf + sent;
+			rest[n++].len = parts[j].len - sent;
+			sent = 0;
+		}
+		munit_assert(0 == connection_send_multi(&c, rest, n));
+	}
+	int total = frames * (sizeof(u32) + FRAME_DATA);
+
+	// nothing goes past what the ring holds
+	munit_assert(0 == connection_empty_send(&c) || total == bytes);
+	if (total != bytes) munit_assert(0 == connection_write_direct(&c, parts, 2));
+
+	char *out = malloc(total);
+	int got = 0;
+	while (got < total) {
+		got += drain(fds[1], out + got, total - got);
+		munit_assert(connection_onwrite(&c, NULL) >= 0);
+	}
+	munit_assert(total == got);
+	munit_assert(1 == connection_empty_send(&c));
+	munit_assert(0 == drain(fds[1], out, total));
+
+	// whole frames, in order
+	for (int i = 0; i < frames; i++) {
+		char *frame = out + i * (sizeof(u32) + FRAME_DATA);
+		u32 len;
+		memcpy(&len, frame, sizeof(u32));
+		munit_assert(FRAME_DATA == len);
+		munit_assert(0 == memcmp(frame + sizeof(u32), events + i * FRAME_DATA, FRAME_DATA));
+	}
+
+	// an empty ring lets the next frames go straight out again
+	munit_assert(connection_write_direct(&c, parts + frames * 2, 2) > 0);
+
+	free(out);
+	free(events);
+	connection_destroy(&c);
+	close(fds[0]);
+	close(fds[1]);
+
+	return MUNIT_OK;
+}
+
+static void* setup(const MunitParameter params[], void* user_data) {
+	return NULL;
+}
+
+static void tear_down(void* fixture) {
+}
+
+static MunitTest test_suite_tests[] = {
+	{ "/test-order", test_order, setup, tear_down, 0, NULL },
+	{ "/test-partial", test_partial, setup, tear_down, 0, NULL },
+	{ "/test-direct", test_direct, setup, tear_down, 0, NULL },
+	{ NULL, NULL, NULL, NULL, 0, NULL }
+};
+
+static const MunitSuite test_suite = { "connection", test_suite_tests, NULL, 1, 0 };
+
+int main(int argc, char* argv[MUNIT_ARRAY_PARAM(argc + 1)]) {
+	return munit_suite_main(&test_suite, NULL, argc, argv);
+}
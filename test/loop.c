@@ -0,0 +1,170 @@
+#include "munit/munit.h"
+
+#include "../loop.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define n_loops 3
+#define sz 4
+
+static io_loop *loops_init(io_loop *loops) {
+	for (u32 i = 0; i < n_loops; i++) {
+		munit_assert(0 == io_loop_init(loops + i, sz, i * sz));
+	}
+	return loops;
+}
+
+static void loops_destroy(io_loop *loops) {
+	for (u32 i = 0; i < n_loops; i++) {
+		io_loop_destroy(loops + i);
+	}
+}
+
+static MunitResult test_ids(const MunitParameter params[], void* data) {
+	io_loop loops[n_loops];
+	loops_init(loops);
+
+	// every loop owns its slice, ids cover [0, n_loops * sz) once
+	int seen[n_loops * sz] = {0};
+	for (u32 i = 0; i < n_loops; i++) {
+		for (u32 j = 0; j < sz; j++) {
+			session *s = io_loop_alloc(loops + i);
+			munit_assert_not_null(s);
+			munit_assert(loops + i == s->io);
+
+			u32 id = io_loop_session_id(s);
+			munit_assert(id >= i * sz && id < (i + 1) * sz);
+			munit_assert(!seen[id]++);
+		}
+		munit_assert(0 == atomic_load(&loops[i].n_free));
+		munit_assert_null(io_loop_alloc(loops + i));
+	}
+
+	// a freed session's id comes back with it
+	session *s = loops[1].pool.pool + 2;
+	io_loop_free(loops + 1, s);
+	munit_assert(1 == atomic_load(&loops[1].n_free));
+	munit_assert(s == io_loop_alloc(loops + 1));
+	munit_assert(sz + 2 == io_loop_session_id(s));
+
+	loops_destroy(loops);
+	return MUNIT_OK;
+}
+
+static int started[n_loops * sz];
+static u32 n_started;
+
+static void start(io_loop *io, int fd) {
+	started[n_started++] = fd;
+}
+
+static MunitResult test_hand_off(const MunitParameter params[], void* data) {
+	io_loop loops[n_loops];
+	loops_init(loops);
+
+	// the next loop after the full one takes it
+	munit_assert(1 == io_loop_hand_off(loops, n_loops, 0, 100));
+	munit_assert(0 == io_loop_hand_off(loops, n_loops, 2, 101)); // wraps
+	munit_assert(1 == loops[1].n_handed && 100 == loops[1].handed[0]);
+	munit_assert(1 == loops[0].n_handed && 101 == loops[0].handed[0]);
+
+	// full loops are skipped, never the one handing off
+	for (u32 j = 0; j < sz; j++) io_loop_alloc(loops + 1);
+	munit_assert(2 == io_loop_hand_off(loops, n_loops, 0, 102));
+	munit_assert(2 == io_loop_hand_off(loops, n_loops, 1, 103));
+	for (u32 j = 0; j < sz; j++) io_loop_alloc(loops + 2);
+	munit_assert(-1 == io_loop_hand_off(loops, n_loops, 0, 104));
+
+	// a loop with free sessions but no room for more handed ones
+	munit_assert(1 == loops[0].n_handed);
+	for (int fd = 105; fd < 108; fd++) {
+		munit_assert(0 == io_loop_hand_off(loops, n_loops, 2, fd));
+	}
+	munit_assert(-1 == io_loop_hand_off(loops, n_loops, 2, 108));
+
+	// taken in order, once
+	n_started = 0;
+	io_loop_take_handed(loops, start);
+	munit_assert(sz == n_started);
+	munit_assert(101 == started[0] && 105 == started[1] && 106 == started[2] && 107 == started[3]);
+	munit_assert(0 == loops[0].n_handed);
+	io_loop_take_handed(loops, start);
+	munit_assert(sz == n_started);
+
+	// none left to close, the fds are made up
+	io_loop_take_handed(loops + 1, start);
+	io_loop_take_handed(loops + 2, start);
+	munit_assert(sz + 3 == n_started);
+
+	loops_destroy(loops);
+	return MUNIT_OK;
+}
+
+static void async_cb(struct ev_loop *loop, ev_async *w, int revents) {
+	(*(int*)w->data)++;
+}
+
+static MunitResult test_wakeups(const MunitParameter params[], void* data) {
+	io_loop loops[2];
+	int wakes[2] = {0};
+	for (u32 i = 0; i < 2; i++) {
+		munit_assert(0 == io_loop_init(loops + i, sz, i * sz));
+		loops[i].loop = ev_loop_new(EVFLAG_AUTO);
+		munit_assert_not_null(loops[i].loop);
+		ev_async_init(&loops[i].async_w, async_cb);
+		loops[i].async_w.data = wakes + i;
+		ev_async_start(loops[i].loop, &loops[i].async_w);
+	}
+
+	// only the session's own loop wakes, once for a list
+	session *a = io_loop_alloc(loops);
+	session *b = io_loop_alloc(loops);
+	loop_write_later(a);
+	loop_write_later(b);
+	loop_write_later(a);
+	for (u32 i = 0; i < 2; i++) ev_run(loops[i].loop, EVRUN_NOWAIT);
+	munit_assert(1 == wakes[0]);
+	munit_assert(0 == wakes[1]);
+
+	session *s = session_list_take(&loops[0].dirty);
+	munit_assert(b == s && a == s->dirty_next);
+	atomic_store(&a->dirty, 0);
+	atomic_store(&b->dirty, 0);
+
+	// the next push after a take wakes again
+	session *c = io_loop_alloc(loops + 1);
+	loop_write_later(c);
+	loop_write_later(a);
+	for (u32 i = 0; i < 2; i++) ev_run(loops[i].loop, EVRUN_NOWAIT);
+	munit_assert(2 == wakes[0]);
+	munit_assert(1 == wakes[1]);
+
+	for (u32 i = 0; i < 2; i++) {
+		ev_async_stop(loops[i].loop, &loops[i].async_w);
+		ev_loop_destroy(loops[i].loop);
+		io_loop_destroy(loops + i);
+	}
+	return MUNIT_OK;
+}
+
+static void* setup(const MunitParameter params[], void* user_data) {
+	return NULL;
+}
+
+static void tear_down(void* fixture) {
+}
+
+static MunitTest test_suite_tests[] = {
+	{ "/ids", test_ids, setup, tear_down, 0, NULL },
+	{ "/hand-off", test_hand_off, setup, tear_down, 0, NULL },
+	{ "/wakeups", test_wakeups, setup, tear_down, 0, NULL },
+	{ NULL, NULL, NULL, NULL, 0, NULL }
+};
+
+static const MunitSuite test_suite = { "loop", test_suite_tests, NULL, 1, 0 };
+
+int main(int argc, char* argv[MUNIT_ARRAY_PARAM(argc + 1)]) {
+	return munit_suite_main(&test_suite, NULL, argc, argv);
+}
@@ -32,6 +32,80 @@ static MunitResult test_basic(const MunitParameter params[], void* data) {
 	return MUNIT_OK;
 }
 
+typedef struct pusher {
+	session_list *l;
+	session *ss;
+	int wakes;
+	atomic_int *done;
+} pusher;
+
+static int push_all(void *arg) {
+	pusher *p = (pusher*)arg;
+	for (int round = 0; round < 10000; round++) {
+		for (int i = 0; i < sz; i++) p->wakes += session_list_push(p->l, p->ss + i);
+	}
+	atomic_fetch_add(p->done, 1);
+	return 0;
+}
+
+static MunitResult test_dirty(const MunitParameter params[], void* data) {
+	session_pool p;
+	munit_assert(0 == session_pool_init(&p, sz));
+
+	session_list l;
+	session_list_init(&l);
+
+	// listed once until taken
+	munit_assert(1 == session_list_push(&l, p.pool));
+	munit_assert(0 == session_list_push(&l, p.pool + 1));
+	munit_assert(0 == session_list_push(&l, p.pool));
+	session *s = session_list_take(&l);
+	munit_assert(p.pool + 1 == s);
+	munit_assert(p.pool == s->dirty_next);
+	munit_assert(NULL == s->dirty_next->dirty_next);
+	munit_assert(NULL == session_list_take(&l));
+
+	// still dirty until the taker clears it
+	munit_assert(0 == session_list_push(&l, p.pool));
+	atomic_store(&p.pool[0].dirty, 0);
+	atomic_store(&p.pool[1].dirty, 0);
+
+	// pushes racing takes, a session comes out at most once per take
+	atomic_int done;
+	atomic_init(&done, 0);
+	pusher ps[4];
+	thrd_t ts[4];
+	for (int i = 0; i < 4; i++) {
+		ps[i].l = &l;
+		ps[i].ss = p.pool;
+		ps[i].wakes = 0;
+		ps[i].done = &done;
+		munit_assert(thrd_success == thrd_create(ts + i, push_all, ps + i));
+	}
+	int takes = 0, last = 0;
+	while (!last) {
+		last = 4 == atomic_load(&done);
+		int seen[sz] = {0};
+		s = session_list_take(&l);
+		if (s) takes++;
+		while (s) {
+			session *next = s->dirty_next;
+			munit_assert(!seen[s - p.pool]++);
+			atomic_store(&s->dirty, 0);
+			s = next;
+		}
+	}
+	int wakes = 0;
+	for (int i = 0; i < 4; i++) {
+		munit_assert(thrd_success == thrd_join(ts[i], NULL));
+		wakes += ps[i].wakes;
+	}
+	munit_assert(wakes == takes); // one wake per list taken
+
+	session_pool_destroy(&p);
+	return MUNIT_OK;
+}
+
 static void* setup(const MunitParameter params[], void* user_data) {
 	return NULL;
 }
@@ -41,6 +115,7 @@ static void tear_down(void* fixture) {
 
 static MunitTest test_suite_tests[] = {
 	{ "/basic", test_basic, setup, tear_down, 0, NULL },
+	{ "/dirty", test_dirty, setup, tear_down, 0, NULL },
 	{ NULL, NULL, NULL, NULL, 0, NULL }
 };
 
@@ -16,6 +16,133 @@ static MunitResult test_full(const MunitParameter params[], void* data) {
 	return MUNIT_OK;
 }
 
+static MunitResult test_rewind(const MunitParameter params[], void* data) {
+	queue q;
+	munit_assert(0 == queue_init(&q, 4096));
+
+	// wrap the ring around while a batch is peeked
+	for (int round = 0; round < 64; round++) {
+		for (int i = 0; i < 8; i++) {
+			int v = round * 8 + i;
+			munit_assert(0 == queue_push(&q, &v, sizeof(int), 0));
+		}
+
+		char *buf;
+		u32 len;
+		munit_assert(0 == queue_peek(&q, (void**)&buf, &len, 0));
+		u32 mark = queue_mark(&q);
+
+		for (int pass = 0; pass < 2; pass++) {
+			int n = 0;
+			do {
+				int v;
+				munit_assert(sizeof(int) == len);
+				memcpy(&v, buf, sizeof(int));
+				munit_assert(round * 8 + n == v);
+				n++;
+			} while (!queue_peek_next(&q, (void**)&buf, &len));
+			munit_assert(8 == n);
+
+			if (!pass) queue_rewind(&q, mark, (void**)&buf, &len);
+		}
+
+		queue_pop(&q);
+		munit_assert(0 == queue_size(&q));
+	}
+
+	queue_destroy(&q);
+	return MUNIT_OK;
+}
+
+static int push_later(void *arg) {
+	queue *q = (queue*)arg;
+	thrd_sleep(&(struct timespec){ .tv_nsec = 10000000 }, NULL);
+	int v = 4;
+	return queue_push(q, &v, sizeof(int), 1);
+}
+
+static MunitResult test_linger(const MunitParameter params[], void* data) {
+	queue q;
+	munit_assert(0 == queue_init(&q, 4096));
+
+	for (int i = 0; i < 4; i++) {
+		munit_assert(0 == queue_push(&q, &i, sizeof(int), 0));
+	}
+
+	char *buf;
+	u32 len;
+	munit_assert(0 == queue_peek(&q, (void**)&buf, &len, 0));
+	u32 mark = queue_mark(&q);
+	while (!queue_peek_next(&q, (void**)&buf, &len));
+
+	// nothing comes
+	struct timespec deadline;
+	timespec_get(&deadline, TIME_UTC);
+	munit_assert(1 == queue_peek_wait(&q, &mark, &deadline, (void**)&buf, &len));
+
+	// one more comes while waiting
+	thrd_t t;
+	munit_assert(thrd_success == thrd_create(&t, push_later, &q));
+	timespec_get(&deadline, TIME_UTC);
+	deadline.tv_sec += 5;
+	munit_assert(0 == queue_peek_wait(&q, &mark, &deadline, (void**)&buf, &len));
+	int v;
+	memcpy(&v, buf, sizeof(int));
+	munit_assert(4 == v);
+	munit_assert(1 == queue_peek_next(&q, (void**)&buf, &len));
+
+	// the held messages are still there
+	queue_rewind(&q, mark, (void**)&buf, &len);
+	int n = 0;
+	do {
+		memcpy(&v, buf, sizeof(int));
+		munit_assert(n == v);
+		n++;
+	} while (!queue_peek_next(&q, (void**)&buf, &len));
+	munit_assert(5 == n);
+
+	queue_pop(&q);
+	munit_assert(0 == queue_size(&q));
+
+	int res;
+	thrd_join(t, &res);
+	munit_assert(0 == res);
+
+	queue_destroy(&q);
+	return MUNIT_OK;
+}
+
+static MunitResult test_until(const MunitParameter params[], void* data) {
+	queue q;
+	munit_assert(0 == queue_init(&q, 4096));
+
+	// nothing comes
+	char *buf;
+	u32 len;
+	struct timespec deadline;
+	timespec_get(&deadline, TIME_UTC);
+	munit_assert(1 == queue_peek_until(&q, &deadline, (void**)&buf, &len));
+
+	// one comes while waiting
+	thrd_t t;
+	munit_assert(thrd_success == thrd_create(&t, push_later, &q));
+	timespec_get(&deadline, TIME_UTC);
+	deadline.tv_sec += 5;
+	munit_assert(0 == queue_peek_until(&q, &deadline, (void**)&buf, &len));
+	int v;
+	memcpy(&v, buf, sizeof(int));
+	munit_assert(4 == v);
+	queue_pop(&q);
+	munit_assert(0 == queue_size(&q));
+
+	int res;
+	thrd_join(t, &res);
+	munit_assert(0 == res);
+
+	queue_destroy(&q);
+	return MUNIT_OK;
+}
+
 static void* setup(const MunitParameter params[], void* user_data) {
 	return NULL;
 }
@@ -26,6 +153,9 @@ static void tear_down(void* fixture) {
 static MunitTest test_suite_tests[] = {
 	{ "/test-rw", test_rw, setup, tear_down, 0, NULL },
 	{ "/test-full", test_full, setup, tear_down, 0, NULL },
+	{ "/test-rewind", test_rewind, setup, tear_down, 0, NULL },
+	{ "/test-linger", test_linger, setup, tear_down, 0, NULL },
+	{ "/test-until", test_until, setup, tear_down, 0, NULL },
 	{ NULL, NULL, NULL, NULL, 0, NULL }
 };
 
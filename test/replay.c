@@ -0,0 +1,119 @@
+#include "munit/munit.h"
+
+#include "../replay.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static MunitResult test_sched(const MunitParameter params[], void* data) {
+	replay_sched q;
+	munit_assert(0 == replay_sched_init(&q));
+	munit_assert(replay_sched_empty(&q));
+
+	// arrival order at the same lag
+	long ids[] = { 1, 2, 3 };
+	for (int i = 0; i < 3; i++) {
+		munit_assert(0 == replay_sched_push(&q, ids + i, 10));
+	}
+	for (int i = 0; i < 3; i++) {
+		replay_item it = replay_sched_pop(&q);
+		munit_assert(ids + i == it.s);
+	}
+	munit_assert(replay_sched_empty(&q));
+
+	// far behind yields to those close to the head
+	long far = 0, near = 0;
+	munit_assert(0 == replay_sched_push(&q, &far, 1ULL<<30));
+	munit_assert(0 == replay_sched_push(&q, &near, 3));
+	replay_item it = replay_sched_pop(&q);
+	munit_assert(&near == it.s);
+
+	// ... but not forever
+	int n = 0;
+	for (;; n++) {
+		munit_assert(0 == replay_sched_push(&q, &near, 3));
+		it = replay_sched_pop(&q);
+		if (it.s == &far) break;
+	}
+	munit_assert(n > 0);
+	munit_assert(n < 31 * REPLAY_LAG_WEIGHT);
+
+	// requeued items keep their place
+	while (!replay_sched_empty(&q)) replay_sched_pop(&q);
+	munit_assert(0 == replay_sched_push(&q, &far, 0));
+	it = replay_sched_pop(&q);
+	munit_assert(0 == replay_sched_push(&q, &near, 0));
+	munit_assert(0 == replay_sched_requeue(&q, it));
+	munit_assert(&far == replay_sched_pop(&q).s);
+	munit_assert(&near == replay_sched_pop(&q).s);
+
+	replay_sched_destroy(&q);
+	return MUNIT_OK;
+}
+
+static MunitResult test_rate(const MunitParameter params[], void* data) {
+	replay_rate r;
+
+	// unlimited
+	munit_assert(0 == replay_rate_init(&r, 0));
+	replay_rate_take(&r, 1<<30);
+	munit_assert(0 == replay_rate_delay(&r, 1));
+	munit_assert((1<<30) == r.bytes);
+	replay_rate_destroy(&r);
+
+	// 1 MB/s
+	u64 now = 1000000;
+	munit_assert(0 == replay_rate_init(&r, 1000000));
+	munit_assert(0 == replay_rate_delay(&r, now));
+	replay_rate_take(&r, 500000);
+	u64 d = replay_rate_delay(&r, now);
+	munit_assert(d >= 500000 && d <= 500001);
+	munit_assert(1 == r.waits);
+
+	// paid off
+	now += d;
+	munit_assert(0 == replay_rate_delay(&r, now));
+
+	// idle time only buys a short burst
+	now += 10000000;
+	munit_assert(0 == replay_rate_delay(&r, now));
+	replay_rate_take(&r, 1000000);
+	d = replay_rate_delay(&r, now);
+	munit_assert(d >= 900000 && d <= 900001);
+
+	replay_rate_destroy(&r);
+	return MUNIT_OK;
+}
+
+static void* setup(const MunitParameter params[], void* user_data) {
+	return NULL;
+}
+
+static void tear_down(void* fixture) {
+}
+
+static MunitResult test_skip(const MunitParameter params[], void* data) {
+	i64 offset = 5;
+	munit_assert(0 == replay_skip_trimmed(&offset, 5, 5)); // nothing trimmed
+	munit_assert(0 == replay_skip_trimmed(&offset, 4, 10)); // moved meanwhile
+	munit_assert(5 == offset);
+	munit_assert(1 == replay_skip_trimmed(&offset, 5, 10));
+	munit_assert(10 == offset);
+	munit_assert(0 == replay_skip_trimmed(&offset, 10, 8)); // behind the session
+	munit_assert(10 == offset);
+	return MUNIT_OK;
+}
+
+static MunitTest test_suite_tests[] = {
+	{ "/test-sched", test_sched, setup, tear_down, 0, NULL },
+	{ "/test-rate", test_rate, setup, tear_down, 0, NULL },
+	{ "/test-skip", test_skip, setup, tear_down, 0, NULL },
+	{ NULL, NULL, NULL, NULL, 0, NULL }
+};
+
+static const MunitSuite test_suite = { "replay", test_suite_tests, NULL, 1, 0 };
+
+int main(int argc, char* argv[MUNIT_ARRAY_PARAM(argc + 1)]) {
+	return munit_suite_main(&test_suite, NULL, argc, argv);
+}
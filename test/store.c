@@ -1,12 +1,1002 @@
 #include "munit/munit.h"
 
-#include "../queue.h"
+#include "../replay.h"
+#include "../store.h"
 
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define N_EVENTS 3000
+
+typedef struct fixture {
+	char dir[64];
+	char name[80];
+} fixture;
+
+typedef struct read_context {
+	u64 low; // reads below a dropped topic's watermark start there
+	u64 next;
+	int n;
+	int max;
+} read_context;
+
+static int visitor(u64 offset, char *buf, u32 len, void *ctx) {
+	read_context *c = (read_context*)ctx;
+	if (c->n == c->max) return 1;
+	if (c->next < c->low) c->next = c->low;
+
+	char expected[64];
+	int n = sprintf(expected, "{\"event\":%llu,\"pad\":\"xxxxxxxx\"}", (unsigned long long)offset);
+
+	munit_assert(offset == c->next);
+	munit_assert(len == (u32)n);
+	munit_assert(0 == memcmp(buf, expected, n));
+
+	c->next++;
+	c->n++;
+	return 0;
+}
+
+static int read_all(store *s, int itopic, u64 offset, int max) {
+	MDB_txn *txn;
+	munit_assert(0 == mdb_txn_begin(s->env, NULL, MDB_RDONLY, &txn));
+
+	read_context ctx = { s->ts[itopic].low, offset, 0, max };
+	while (store_read_some(s, txn, itopic, ctx.next, visitor, &ctx) == 3) {
+		if (ctx.n == ctx.max) break;
+	}
+
+	mdb_txn_abort(txn);
+	return ctx.n;
+}
+
+static void write_some(store *s, int *itopics, int ntopics, int from, int to) {
+	munit_assert(0 == store_write_txn_begin(s));
+	for (int i = from; i < to; i++) {
+		for (int t = 0; t < ntopics; t++) {
+			char buf[64];
+			int n = sprintf(buf, "{\"event\":%d,\"pad\":\"xxxxxxxx\"}", i);
+			munit_assert(0 == store_write_event(s, itopics[t], buf, n));
+		}
+	}
+	munit_assert(0 == store_write_txn_end(s));
+}
 
 static MunitResult test_rw(const MunitParameter params[], void* data) {
+	fixture *f = (fixture*)data;
+	u32 flags = atoi(munit_parameters_get(params, "flags"));
+
+	store s;
+	munit_assert(0 == store_init(&s, f->name, MAX_TOPICS, 1ULL<<28, flags));
+	munit_assert((flags | STORE_TAGGED) == s.flags); // new databases tag values
+
+	// only named dbs size the environment for every topic
+	MDB_txn *txn;
+	MDB_dbi dbi;
+	munit_assert(0 == mdb_txn_begin(s.env, NULL, MDB_RDONLY, &txn));
+	int rc = mdb_dbi_open(txn, "t1", 0, &dbi);
+	munit_assert((flags & STORE_TOPIC_DBS) ? MDB_NOTFOUND == rc : MDB_DBS_FULL == rc);
+	mdb_txn_abort(txn);
+
+	int nt;
+	int itopics[2];
+	itopics[0] = store_get_topic(&s, "a", 1, 1, &nt);
+	munit_assert(1 == nt);
+	itopics[1] = store_get_topic(&s, "b", 1, 1, &nt);
+	munit_assert(1 == nt);
+
+	munit_assert(0 == store_write_txn_begin(&s));
+	munit_assert(0 == store_create_topic(&s, "a", 1, itopics[0]));
+	munit_assert(0 == store_create_topic(&s, "b", 1, itopics[1]));
+	munit_assert(0 == store_write_txn_end(&s));
+
+	write_some(&s, itopics, 2, 0, N_EVENTS/2);
+	write_some(&s, itopics, 2, N_EVENTS/2, N_EVENTS);
+
+	for (int t = 0; t < 2; t++) {
+		munit_assert(N_EVENTS == read_all(&s, itopics[t], 0, N_EVENTS*2));
+		munit_assert(N_EVENTS-1 == read_all(&s, itopics[t], 1, N_EVENTS*2));
+		munit_assert(10 == read_all(&s, itopics[t], N_EVENTS/2 - 5, 10));
+		munit_assert(1 == read_all(&s, itopics[t], N_EVENTS-1, N_EVENTS*2));
+		munit_assert(0 == read_all(&s, itopics[t], N_EVENTS, N_EVENTS*2));
+
+		// at the head, readers wait for the next commit
+		MDB_txn *txn;
+		read_context ctx = { 0, N_EVENTS, 0, 1 };
+		munit_assert(0 == mdb_txn_begin(s.env, NULL, MDB_RDONLY, &txn));
+		munit_assert(2 == store_read_some(&s, txn, itopics[t], N_EVENTS, visitor, &ctx));
+		mdb_txn_abort(txn);
+	}
+
+	store_destroy(&s);
+
+	// reopen, format and offsets must survive
+	munit_assert(0 == store_init(&s, f->name, MAX_TOPICS, 1ULL<<28, 0));
+	munit_assert((flags | STORE_TAGGED) == s.flags);
+	munit_assert(itopics[0] == store_get_topic(&s, "a", 1, 0, &nt));
+	for (int t = 0; t < 2; t++) {
+		munit_assert(N_EVENTS == (s.write_offsets[itopics[t]] & 0xffffffffffffULL));
+	}
+
+	write_some(&s, itopics, 1, N_EVENTS, N_EVENTS+1);
+	munit_assert(N_EVENTS+1 == read_all(&s, itopics[0], 0, N_EVENTS*2));
+
+	store_destroy(&s);
+
+	return MUNIT_OK;
+}
+
+// the size record as older versions wrote it, bytes only, | kind:4 | itopic:16 | arg:28 |
+#define OLD_SIZE_KEY(itopic) ((6ULL << 44) | ((u64)(itopic) << 28))
+
+static MunitResult test_checkpoints(const MunitParameter params[], void* data) {
+	fixture *f = (fixture*)data;
+	u32 flags = atoi(munit_parameters_get(params, "flags"));
+
+	store s;
+	munit_assert(0 == store_init(&s, f->name, MAX_TOPICS, 1ULL<<28, flags));
+
+	int nt, itopics[3];
+	u64 heads[3] = { 300, 200, 100 };
+	munit_assert(0 == store_write_txn_begin(&s));
+	for (int t = 0; t < 3; t++) {
+		char name[2] = { 'a' + t, 0 };
+		itopics[t] = store_get_topic(&s, name, 1, 1, &nt);
+		munit_assert(0 == store_create_topic(&s, name, 1, itopics[t]));
+	}
+	munit_assert(0 == store_write_txn_end(&s));
+	for (int t = 0; t < 3; t++) write_some(&s, itopics + t, 1, 0, heads[t]);
+	store_destroy(&s);
+
+	// every topic checkpointed
+	munit_assert(0 == store_init(&s, f->name, MAX_TOPICS, 1ULL<<28, flags));
+	munit_assert(0 == s.n_seeks);
+	for (int t = 0; t < 3; t++) {
+		munit_assert(heads[t] == (s.write_offsets[itopics[t]] & 0xffffffffffffULL));
+	}
+
+	// b and c as an older version left them
+	u64 bytes[3];
+	munit_assert(0 == store_write_txn_begin(&s));
+	for (int t = 0; t < 3; t++) {
+		bytes[t] = s.ts[itopics[t]].bytes;
+		if (!t) continue;
+		u64 key = OLD_SIZE_KEY(itopics[t]);
+		MDB_val k = { sizeof(u64), &key }, v = { sizeof(u64), bytes + t };
+		munit_assert(0 == mdb_put(s.wtxn, s.dbi, &k, &v, 0));
+	}
+	munit_assert(0 == store_write_txn_end(&s));
+	store_destroy(&s);
+
+	// only those are sought, with their sizes kept
+	munit_assert(0 == store_init(&s, f->name, MAX_TOPICS, 1ULL<<28, flags));
+	munit_assert(2 == s.n_seeks);
+	for (int t = 0; t < 3; t++) {
+		munit_assert(heads[t] == (s.write_offsets[itopics[t]] & 0xffffffffffffULL));
+		munit_assert(heads[t] == s.ts[itopics[t]].committed);
+		munit_assert(bytes[t] == s.ts[itopics[t]].bytes);
+	}
+
+	// the next commit checkpoints them again, and writes go on from the head
+	write_some(&s, itopics, 1, heads[0], heads[0] + 1);
+	heads[0]++;
+	store_destroy(&s);
+
+	munit_assert(0 == store_init(&s, f->name, MAX_TOPICS, 1ULL<<28, flags));
+	munit_assert(0 == s.n_seeks);
+	for (int t = 0; t < 3; t++) {
+		munit_assert(heads[t] == (s.write_offsets[itopics[t]] & 0xffffffffffffULL));
+		munit_assert(heads[t] == read_all(&s, itopics[t], 0, N_EVENTS));
+	}
+	store_destroy(&s);
+
+	return MUNIT_OK;
+}
+
+// a 'b' frame's events: each with its u32 length
+static u32 batch_frame(char *buf, int from, int to) {
+	u32 len = 0;
+	for (int i = from; i < to; i++) {
+		u32 n = sprintf(buf + len + sizeof(u32), "{\"event\":%d,\"pad\":\"xxxxxxxx\"}", i);
+		memcpy(buf + len, &n, sizeof(u32));
+		len += sizeof(u32) + n;
+	}
+	return len;
+}
+
+static MunitResult test_batch(const MunitParameter params[], void* data) {
+	fixture *f = (fixture*)data;
+	u32 flags = atoi(munit_parameters_get(params, "flags"));
+
+	store s;
+	munit_assert(0 == store_init(&s, f->name, MAX_TOPICS, 1ULL<<28, flags));
+
+	int nt;
+	int itopic = store_get_topic(&s, "a", 1, 1, &nt);
+	munit_assert(0 == store_write_txn_begin(&s));
+	munit_assert(0 == store_create_topic(&s, "a", 1, itopic));
+	munit_assert(0 == store_write_txn_end(&s));
+
+	char *buf = malloc(MAX_MESSAGE_SIZE * 2);
+	u32 len = batch_frame(buf, 0, 100);
+	munit_assert(100 == store_batch_events(buf, len));
+
+	// truncated, or with a few bytes past the last event
+	munit_assert(0 == store_batch_events(buf, len - 1));
+	munit_assert(0 == store_batch_events(buf, len - 40));
+	munit_assert(0 == store_batch_events(buf, len + 2));
+	munit_assert(0 == store_batch_events(buf, 0));
+
+	// empty and oversized events
+	u32 event_len = 0;
+	char bad[sizeof(u32) + MAX_EVENT_SIZE + 1];
+	memcpy(bad, &event_len, sizeof(u32));
+	munit_assert(0 == store_batch_events(bad, sizeof(u32)));
+	memset(bad + sizeof(u32), 'x', MAX_EVENT_SIZE + 1);
+	event_len = MAX_EVENT_SIZE + 1;
+	memcpy(bad, &event_len, sizeof(u32));
+	munit_assert(0 == store_batch_events(bad, sizeof(bad)));
+	event_len = MAX_EVENT_SIZE;
+	memcpy(bad, &event_len, sizeof(u32));
+	munit_assert(1 == store_batch_events(bad, sizeof(bad) - 1));
+
+	// events of two batches, and a plain one, at consecutive offsets
+	u32 n;
+	munit_assert(0 == store_write_txn_begin(&s));
+	munit_assert(0 == store_write_batch(&s, itopic, buf, len, &n));
+	munit_assert(100 == n);
+	munit_assert(100 == (s.write_offsets[itopic] & 0xffffffffffffULL));
+	len = batch_frame(buf, 100, 250);
+	munit_assert(150 == store_batch_events(buf, len));
+	munit_assert(0 == store_write_batch(&s, itopic, buf, len, &n));
+	munit_assert(150 == n);
+	munit_assert(0 == store_write_txn_end(&s));
+	write_some(&s, &itopic, 1, 250, 251);
+
+	munit_assert(251 == read_all(&s, itopic, 0, N_EVENTS));
+	munit_assert(101 == read_all(&s, itopic, 150, N_EVENTS));
+
+	free(buf);
+	store_destroy(&s);
+	return MUNIT_OK;
+}
+
+static MunitResult test_dicts(const MunitParameter params[], void* data) {
+	fixture *f = (fixture*)data;
+	u32 flags = STORE_DICTS | atoi(munit_parameters_get(params, "flags"));
+
+	store s;
+	munit_assert(0 == store_init(&s, f->name, MAX_TOPICS, 1ULL<<28, flags));
+
+	int nt;
+	int itopic = store_get_topic(&s, "a", 1, 1, &nt);
+	munit_assert(0 == store_write_txn_begin(&s));
+	munit_assert(0 == store_create_topic(&s, "a", 1, itopic));
+	munit_assert(0 == store_write_txn_end(&s));
+
+	// enough data for a few compression ratio windows
+	int n = 0;
+	while (n < 60000) {
+		write_some(&s, &itopic, 1, n, n + 1000);
+		if (store_train_pending(&s)) munit_assert(0 == store_train_dicts(&s));
+		n += 1000;
+	}
+	munit_assert(!store_train_pending(&s));
+	munit_assert(NULL != s.dicts[itopic]);
+	munit_assert(NULL != s.dicts[itopic]->stream);
+	munit_assert(n == read_all(&s, itopic, 0, n*2));
+
+	store_destroy(&s);
+
+	munit_assert(0 == store_init(&s, f->name, MAX_TOPICS, 1ULL<<28, flags));
+	munit_assert(NULL != s.dicts[itopic]);
+	write_some(&s, &itopic, 1, n, n + 10);
+	munit_assert(n + 10 == read_all(&s, itopic, 0, n*2));
+	munit_assert(5 == read_all(&s, itopic, n + 5, n*2));
+	store_destroy(&s);
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_drop(const MunitParameter params[], void* data) {
+	fixture *f = (fixture*)data;
+	u32 flags = atoi(munit_parameters_get(params, "flags"));
+
+	store s;
+	munit_assert(0 == store_init(&s, f->name, MAX_TOPICS, 1ULL<<28, flags));
+
+	int nt;
+	int itopics[2];
+	itopics[0] = store_get_topic(&s, "a", 1, 1, &nt);
+	itopics[1] = store_get_topic(&s, "b", 1, 1, &nt);
+	munit_assert(0 == store_write_txn_begin(&s));
+	munit_assert(0 == store_create_topic(&s, "a", 1, itopics[0]));
+	munit_assert(0 == store_create_topic(&s, "b", 1, itopics[1]));
+	munit_assert(0 == store_write_txn_end(&s));
+
+	for (int i = 0; i < N_EVENTS; i += 100) {
+		write_some(&s, itopics, 2, i, i + 100);
+	}
+
+	munit_assert(0 == store_write_txn_begin(&s));
+	munit_assert(0 == store_drop(&s, itopics[0]));
+	munit_assert(0 == store_write_txn_end(&s));
+
+	// dropped events are gone right away, reclaimed or not
+	munit_assert(0 == read_all(&s, itopics[0], 0, N_EVENTS*2));
+	munit_assert(1 == store_reclaim_pending(&s));
+
+	store_status st;
+	store_topic_status(&s, itopics[0], &st);
+	munit_assert(N_EVENTS == st.low);
+	munit_assert(1 == st.reclaiming);
+	munit_assert(N_EVENTS == st.pending);
+
+	int rc, chunks = 0;
+	while ((rc = store_reclaim(&s)) == 1) chunks++;
+	munit_assert(0 == rc);
+	munit_assert(0 == store_reclaim_pending(&s));
+
+	store_topic_status(&s, itopics[0], &st);
+	munit_assert(0 == st.reclaiming);
+	munit_assert(0 == st.pending);
+	munit_assert(0 < st.reclaimed_bytes);
+
+	// the other topic is untouched, offsets keep growing past the drop
+	munit_assert(N_EVENTS == read_all(&s, itopics[1], 0, N_EVENTS*2));
+	write_some(&s, itopics, 1, N_EVENTS, N_EVENTS+10);
+	munit_assert(10 == read_all(&s, itopics[0], 0, N_EVENTS*2));
+
+	store_destroy(&s);
+
+	// reopen, the watermark survives
+	munit_assert(0 == store_init(&s, f->name, MAX_TOPICS, 1ULL<<28, 0));
+	store_topic_status(&s, itopics[0], &st);
+	munit_assert(N_EVENTS == st.low);
+	munit_assert(N_EVENTS+10 == (s.write_offsets[itopics[0]] & 0xffffffffffffULL));
+	munit_assert(10 == read_all(&s, itopics[0], 0, N_EVENTS*2));
+	while (store_reclaim(&s) == 1);
+
+	// a fully reclaimed topic keeps its offsets across restarts
+	munit_assert(0 == store_write_txn_begin(&s));
+	munit_assert(0 == store_drop(&s, itopics[0]));
+	munit_assert(0 == store_write_txn_end(&s));
+	while (store_reclaim(&s) == 1);
+	store_destroy(&s);
+
+	munit_assert(0 == store_init(&s, f->name, MAX_TOPICS, 1ULL<<28, 0));
+	munit_assert(N_EVENTS+10 == (s.write_offsets[itopics[0]] & 0xffffffffffffULL));
+	munit_assert(0 == read_all(&s, itopics[0], 0, N_EVENTS*2));
+	store_destroy(&s);
+
+	return MUNIT_OK;
+}
+
+static void reclaim_all(store *s) {
+	int rc;
+	while ((rc = store_reclaim(s)) == 1);
+	munit_assert(0 == rc);
+}
+
+static MunitResult test_retention(const MunitParameter params[], void* data) {
+	fixture *f = (fixture*)data;
+	u32 flags = atoi(munit_parameters_get(params, "flags"));
+
+	store s;
+	munit_assert(0 == store_init(&s, f->name, MAX_TOPICS, 1ULL<<28, flags));
+
+	int nt;
+	int itopics[3];
+	itopics[0] = store_get_topic(&s, "events", 6, 1, &nt);
+	itopics[1] = store_get_topic(&s, "bytes", 5, 1, &nt);
+	itopics[2] = store_get_topic(&s, "age", 3, 1, &nt);
+
+	store_retention r[3] = {
+		{ 0, 0, 1000 },
+		{ 0, 50000, 0 },
+		{ 50, 0, 0 },
+	};
+
+	munit_assert(0 == store_write_txn_begin(&s));
+	munit_assert(0 == store_create_topic(&s, "events", 6, itopics[0]));
+	munit_assert(0 == store_create_topic(&s, "bytes", 5, itopics[1]));
+	munit_assert(0 == store_create_topic(&s, "age", 3, itopics[2]));
+	for (int t = 0; t < 3; t++) {
+		munit_assert(0 == store_set_retention(&s, itopics[t], r + t));
+	}
+	munit_assert(0 == store_write_txn_end(&s));
+
+	for (int i = 0; i < N_EVENTS; i += 100) {
+		write_some(&s, itopics, 3, i, i + 100);
+	}
+
+	// pretend a few minutes pass before the next writes
+	s.epoch -= 100;
+	write_some(&s, itopics, 3, N_EVENTS, N_EVENTS + 10);
+
+	munit_assert(0 == store_retain(&s));
+	reclaim_all(&s);
+
+	store_status st;
+	store_topic_status(&s, itopics[0], &st);
+	munit_assert(N_EVENTS + 10 - 1000 == st.low);
+	munit_assert(1000 == read_all(&s, itopics[0], 0, N_EVENTS*2));
+
+	store_topic_status(&s, itopics[1], &st);
+	munit_assert(50000 >= st.bytes);
+	munit_assert(0 < st.bytes);
+	munit_assert(N_EVENTS + 10 - st.low == read_all(&s, itopics[1], 0, N_EVENTS*2));
+
+	store_topic_status(&s, itopics[2], &st);
+	munit_assert(N_EVENTS == st.low);
+	munit_assert(10 == read_all(&s, itopics[2], 0, N_EVENTS*2));
+
+	MDB_txn *txn;
+	u64 offset;
+	munit_assert(0 == mdb_txn_begin(s.env, NULL, MDB_RDONLY, &txn));
+	munit_assert(0 == store_time_offset(&s, txn, itopics[2], time(NULL) - 50, &offset));
+	munit_assert(N_EVENTS == offset);
+	munit_assert(0 == store_time_offset(&s, txn, itopics[0], 0, &offset));
+	munit_assert(N_EVENTS + 10 - 1000 == offset); // clamped to the watermark
+	munit_assert(1 == store_time_offset(&s, txn, itopics[2], time(NULL) + 10, &offset));
+	mdb_txn_abort(txn);
+
+	store_destroy(&s);
+
+	// sizes, policies and watermarks survive a restart
+	munit_assert(0 == store_init(&s, f->name, MAX_TOPICS, 1ULL<<28, 0));
+	store_topic_status(&s, itopics[1], &st);
+	munit_assert(50000 >= st.bytes);
+	munit_assert(r[1].max_bytes == st.retention.max_bytes);
+	store_topic_status(&s, itopics[0], &st);
+	munit_assert(N_EVENTS + 10 - 1000 == st.low);
+	reclaim_all(&s);
+	munit_assert(1000 == read_all(&s, itopics[0], 0, N_EVENTS*2));
+	store_destroy(&s);
+
+	return MUNIT_OK;
+}
+
+static int first_visitor(u64 offset, char *buf, u32 len, void *ctx) {
+	*(u64*)ctx = offset;
+	return 1;
+}
+
+// retention trims past a session halfway through its replay: its next read
+// starts at the watermark, and the session must follow it there
+static MunitResult test_low_moves(const MunitParameter params[], void* data) {
+	fixture *f = (fixture*)data;
+	u32 flags = atoi(munit_parameters_get(params, "flags"));
+
+	store s;
+	munit_assert(0 == store_init(&s, f->name, MAX_TOPICS, 1ULL<<28, flags));
+
+	int nt;
+	int itopic = store_get_topic(&s, "lagging", 7, 1, &nt);
+	munit_assert(0 == store_write_txn_begin(&s));
+	munit_assert(0 == store_create_topic(&s, "lagging", 7, itopic));
+	munit_assert(0 == store_write_txn_end(&s));
+	for (int i = 0; i < N_EVENTS; i += 100) {
+		write_some(&s, &itopic, 1, i, i + 100);
+	}
+
+	// a slow consumer got this far, another one a bit further
+	i64 slow = 0, other = 150;
+	munit_assert(100 == read_all(&s, itopic, slow, 100));
+	slow = 100;
+
+	store_retention r = { 0, 0, 1000 };
+	munit_assert(0 == store_write_txn_begin(&s));
+	munit_assert(0 == store_set_retention(&s, itopic, &r));
+	munit_assert(0 == store_write_txn_end(&s));
+	munit_assert(0 == store_retain(&s));
+	reclaim_all(&s);
+	u64 low = s.ts[itopic].low;
+	munit_assert(N_EVENTS - 1000 == low);
+
+	// read from where the slow one was
+	MDB_txn *txn;
+	u64 first = 0;
+	munit_assert(0 == mdb_txn_begin(s.env, NULL, MDB_RDONLY, &txn));
+	munit_assert(0 <= store_read_some(&s, txn, itopic, slow, first_visitor, &first));
+	mdb_txn_abort(txn);
+	munit_assert(low == first);
+
+	munit_assert(1 == replay_skip_trimmed(&slow, 100, first));
+	munit_assert((i64)low == slow);
+	munit_assert(0 == replay_skip_trimmed(&other, 100, first)); // moved meanwhile
+	munit_assert(150 == other);
+	munit_assert(0 == replay_skip_trimmed(&slow, low, first));
+
+	// and goes on to the head from there
+	munit_assert(1000 == read_all(&s, itopic, slow, N_EVENTS));
+
+	store_destroy(&s);
+	return MUNIT_OK;
+}
+
+static MunitResult test_uncommitted(const MunitParameter params[], void* data) {
+	fixture *f = (fixture*)data;
+	u32 flags = atoi(munit_parameters_get(params, "flags"));
+
+	store s;
+	munit_assert(0 == store_init(&s, f->name, MAX_TOPICS, 1ULL<<28, flags));
+
+	// readers don't see a topic db its txn hasn't committed
+	int nt;
+	int itopic = store_get_topic(&s, "a", 1, 1, &nt);
+	munit_assert(0 == store_write_txn_begin(&s));
+	munit_assert(0 == store_create_topic(&s, "a", 1, itopic));
+	munit_assert(0 == read_all(&s, itopic, 0, N_EVENTS));
+	if (flags & STORE_TOPIC_DBS) munit_assert(0 == atomic_load(s.rdbis + itopic));
+	store_write_txn_abort(&s);
+	if (flags & STORE_TOPIC_DBS) munit_assert(0 == atomic_load(s.rdbis + itopic));
+
+	munit_assert(0 == store_write_txn_begin(&s));
+	munit_assert(0 == store_create_topic(&s, "a", 1, itopic));
+	munit_assert(0 == store_write_txn_end(&s));
+	if (flags & STORE_TOPIC_DBS) munit_assert(0 != atomic_load(s.rdbis + itopic));
+
+	store_status st;
+	store_topic_status(&s, itopic, &st);
+	munit_assert(0 == st.committed); // created, nothing written yet
+
+	write_some(&s, &itopic, 1, 0, 100);
+	munit_assert(100 == read_all(&s, itopic, 0, N_EVENTS));
+
+	store_destroy(&s);
+	return MUNIT_OK;
+}
+
+static MunitResult test_time(const MunitParameter params[], void* data) {
+	fixture *f = (fixture*)data;
+	u32 flags = atoi(munit_parameters_get(params, "flags"));
+
+	store s;
+	munit_assert(0 == store_init(&s, f->name, MAX_TOPICS, 1ULL<<28, flags));
+
+	int nt;
+	int itopic = store_get_topic(&s, "stamped", 7, 1, &nt);
+	munit_assert(0 == store_write_txn_begin(&s));
+	munit_assert(0 == store_create_topic(&s, "stamped", 7, itopic));
+	munit_assert(0 == store_write_txn_end(&s));
+
+	// 10 events a second, stamped on ingest, a few seconds per commit
+	u64 t0 = s.epoch + 10;
+	for (int c = 0; c < 10; c++) {
+		munit_assert(0 == store_write_txn_begin(&s));
+		for (int i = c * 50; i < (c + 1) * 50; i++) {
+			char buf[64];
+			int n = sprintf(buf, "{\"event\":%d,\"pad\":\"xxxxxxxx\"}", i);
+			s.now = t0 + i / 10;
+			if (i == 255) s.now -= 3; // clock went back, not indexed
+			munit_assert(0 == store_write_event(&s, itopic, buf, n));
+		}
+		munit_assert(0 == store_write_txn_end(&s));
+	}
+
+	u64 offset;
+	for (int sec = 0; sec < 50; sec++) {
+		munit_assert(0 == store_time_lookup(&s, itopic, t0 + sec, &offset));
+		munit_assert(sec * 10 == offset);
+	}
+	munit_assert(0 == store_time_lookup(&s, itopic, 0, &offset));
+	munit_assert(0 == offset);
+	munit_assert(1 == store_time_lookup(&s, itopic, t0 + 50, &offset));
+
+	// from the found offset on
+	munit_assert(0 == store_time_lookup(&s, itopic, t0 + 45, &offset));
+	munit_assert(50 == read_all(&s, itopic, offset, 500));
+
+	store_destroy(&s);
+	return MUNIT_OK;
+}
+
+typedef struct codec_context {
+	u64 next;
+	u32 len;
+	int n;
+} codec_context;
+
+static void codec_event(u64 i, char *buf, u32 len) {
+	u64 x = i * 0x9e3779b97f4a7c15ULL + 1;
+	for (u32 j = 0; j < len; j++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		buf[j] = (char)x;
+	}
+}
+
+static int codec_visitor(u64 offset, char *buf, u32 len, void *ctx) {
+	codec_context *c = (codec_context*)ctx;
+	char expected[256];
+	codec_event(offset, expected, c->len);
+	munit_assert(offset == c->next);
+	munit_assert(len == c->len);
+	munit_assert(0 == memcmp(buf, expected, len));
+	c->next++;
+	c->n++;
+	return 0;
+}
+
+static MunitResult test_codecs(const MunitParameter params[], void* data) {
+	fixture *f = (fixture*)data;
+	u32 flags = atoi(munit_parameters_get(params, "flags"));
+
+	store s;
+	munit_assert(0 == store_init(&s, f->name, MAX_TOPICS, 1ULL<<28, flags));
+
+	int nt;
+	int itopics[2];
+	itopics[0] = store_get_topic(&s, "noise", 5, 1, &nt);
+	itopics[1] = store_get_topic(&s, "tiny", 4, 1, &nt);
+	u32 lens[2] = { 200, 8 };
+
+	munit_assert(0 == store_write_txn_begin(&s));
+	munit_assert(0 == store_create_topic(&s, "noise", 5, itopics[0]));
+	munit_assert(0 == store_create_topic(&s, "tiny", 4, itopics[1]));
+	munit_assert(0 == store_write_txn_end(&s));
+
+	// incompressible and tiny events are stored raw, whatever the acceleration
+	for (int c = 0; c < N_EVENTS / 100; c++) {
+		s.acceleration = 1 + c % 8;
+		munit_assert(0 == store_write_txn_begin(&s));
+		for (int i = c * 100; i < (c + 1) * 100; i++) {
+			for (int t = 0; t < 2; t++) {
+				char buf[256];
+				codec_event(i, buf, lens[t]);
+				munit_assert(0 == store_write_event(&s, itopics[t], buf, lens[t]));
+			}
+		}
+		munit_assert(0 == store_write_txn_end(&s));
+	}
+
+	for (int t = 0; t < 2; t++) {
+		store_status st;
+		store_topic_status(&s, itopics[t], &st);
+		if (!(flags & STORE_BLOCKS)) { // key, tag, event
+			munit_assert(N_EVENTS * (sizeof(u64) + 1 + lens[t]) == st.bytes);
+		}
+
+		MDB_txn *txn;
+		munit_assert(0 == mdb_txn_begin(s.env, NULL, MDB_RDONLY, &txn));
+		codec_context ctx = { 0, lens[t], 0 };
+		while (store_read_some(&s, txn, itopics[t], ctx.next, codec_visitor, &ctx) == 3);
+		mdb_txn_abort(txn);
+		munit_assert(N_EVENTS == ctx.n);
+	}
+
+	store_destroy(&s);
+	return MUNIT_OK;
+}
+
+typedef struct into_context {
+	char data[1<<16];
+	u32 len;
+	u32 cap; // room reserve gives, at most
+	u64 next;
+	int in_place;
+} into_context;
+
+static char *into_reserve(void *ctx, u32 *cap) {
+	into_context *c = (into_context*)ctx;
+	*cap = c->cap;
+	return c->data + c->len;
+}
+
+static int into_visitor(u64 offset, char *buf, u32 len, void *ctx) {
+	into_context *c = (into_context*)ctx;
+	if (c->len + len > sizeof(c->data)) return 1;
+
+	char expected[256];
+	memset(expected, 'a' + offset % 26, 200);
+	munit_assert(offset == c->next);
+	munit_assert(200 == len);
+	munit_assert(0 == memcmp(buf, expected, len));
+
+	if (buf == c->data + c->len) c->in_place++;
+	else memcpy(c->data + c->len, buf, len);
+	c->len += len;
+	c->next++;
+	return 0;
+}
+
+static MunitResult test_into(const MunitParameter params[], void* data) {
+	fixture *f = (fixture*)data;
+	u32 flags = atoi(munit_parameters_get(params, "flags"));
+
+	store s;
+	munit_assert(0 == store_init(&s, f->name, MAX_TOPICS, 1ULL<<28, flags));
+
+	int nt;
+	int itopic = store_get_topic(&s, "a", 1, 1, &nt);
+	munit_assert(0 == store_write_txn_begin(&s));
+	munit_assert(0 == store_create_topic(&s, "a", 1, itopic));
+	for (int i = 0; i < 100; i++) {
+		char buf[200];
+		memset(buf, 'a' + i % 26, sizeof(buf));
+		munit_assert(0 == store_write_event(&s, itopic, buf, sizeof(buf)));
+	}
+	munit_assert(0 == store_write_txn_end(&s));
+
+	// lz4 events land in place, blocks go through the scratch buffer
+	MDB_txn *txn;
+	munit_assert(0 == mdb_txn_begin(s.env, NULL, MDB_RDONLY, &txn));
+	into_context *ctx = calloc(1, sizeof(into_context));
+	ctx->cap = sizeof(ctx->data);
+	munit_assert(3 == store_read_into(&s, txn, itopic, 0, into_visitor, into_reserve, ctx));
+	munit_assert(100 == ctx->next);
+	munit_assert((flags & STORE_BLOCKS ? 0 : 100) == ctx->in_place);
+
+	// without room enough, events back out to the scratch buffer
+	memset(ctx, 0, sizeof(into_context));
+	ctx->cap = 100;
+	munit_assert(3 == store_read_into(&s, txn, itopic, 0, into_visitor, into_reserve, ctx));
+	munit_assert(100 == ctx->next);
+	munit_assert(0 == ctx->in_place);
+
+	free(ctx);
+	mdb_txn_abort(txn);
+	store_destroy(&s);
+	return MUNIT_OK;
+}
+
+typedef struct stored_context {
+	u64 next;
+	int lz4;
+} stored_context;
+
+static int stored_visitor_check(u64 offset, u8 codec, char *buf, u32 len, void *ctx) {
+	stored_context *c = (stored_context*)ctx;
+
+	char raw[256];
+	if (codec == STORE_CODEC_LZ4) {
+		int n = LZ4_decompress_safe(buf, raw, len, sizeof(raw));
+		munit_assert(n > 0);
+		munit_assert(len < (u32)n);
+		buf = raw;
+		len = n;
+		c->lz4++;
+	} else {
+		munit_assert(STORE_CODEC_RAW == codec);
+	}
+
+	char expected[256];
+	memset(expected, 'a' + offset % 26, 200);
+	munit_assert(offset == c->next);
+	munit_assert(200 == len);
+	munit_assert(0 == memcmp(buf, expected, len));
+	c->next++;
+	return 0;
+}
+
+static MunitResult test_stored(const MunitParameter params[], void* data) {
+	fixture *f = (fixture*)data;
+	u32 flags = atoi(munit_parameters_get(params, "flags"));
+
+	store s;
+	munit_assert(0 == store_init(&s, f->name, MAX_TOPICS, 1ULL<<28, flags));
+
+	int nt;
+	int itopic = store_get_topic(&s, "a", 1, 1, &nt);
+	munit_assert(0 == store_write_txn_begin(&s));
+	munit_assert(0 == store_create_topic(&s, "a", 1, itopic));
+	for (int i = 0; i < 100; i++) {
+		char buf[200];
+		memset(buf, 'a' + i % 26, sizeof(buf));
+		munit_assert(0 == store_write_event(&s, itopic, buf, sizeof(buf)));
+	}
+	munit_assert(0 == store_write_txn_end(&s));
+
+	// compressed by a producer, blocks take events raw only
+	munit_assert(0 == store_write_txn_begin(&s));
+	for (int i = 100; i < 110; i++) {
+		char buf[200], compressed[256];
+		memset(buf, 'a' + i % 26, sizeof(buf));
+		int csize = LZ4_compress_default(buf, compressed, sizeof(buf), sizeof(compressed));
+		munit_assert(csize > 0);
+		int rc = store_write_compressed(&s, itopic, compressed, csize);
+		munit_assert((flags & STORE_BLOCKS ? 1 : 0) == rc);
+		if (rc) munit_assert(0 == store_write_event(&s, itopic, buf, sizeof(buf)));
+	}
+	munit_assert(0 == store_write_txn_end(&s));
+
+	// lz4 events as stored, blocks decompressed
+	MDB_txn *txn;
+	munit_assert(0 == mdb_txn_begin(s.env, NULL, MDB_RDONLY, &txn));
+	stored_context ctx = { 0, 0 };
+	munit_assert(3 == store_read_stored(&s, txn, itopic, 0, stored_visitor_check, &ctx));
+	munit_assert(110 == ctx.next);
+	munit_assert((flags & STORE_BLOCKS ? 0 : 110) == ctx.lz4);
+
+	// and decompressed for everyone else
+	mdb_txn_reset(txn);
+	munit_assert(0 == mdb_txn_renew(txn));
+	into_context *ictx = calloc(1, sizeof(into_context));
+	ictx->cap = sizeof(ictx->data);
+	munit_assert(3 == store_read_into(&s, txn, itopic, 0, into_visitor, into_reserve, ictx));
+	munit_assert(110 == ictx->next);
+	free(ictx);
+
+	mdb_txn_abort(txn);
+	store_destroy(&s);
+	return MUNIT_OK;
+}
+
+static MunitResult test_grow(const MunitParameter params[], void* data) {
+	fixture *f = (fixture*)data;
+	u32 flags = atoi(munit_parameters_get(params, "flags"));
+
+	store s;
+	munit_assert(0 == store_init(&s, f->name, MAX_TOPICS, 1ULL<<17, flags));
+
+	int nt;
+	int itopics[2];
+	itopics[0] = store_get_topic(&s, "a", 1, 1, &nt);
+	itopics[1] = store_get_topic(&s, "b", 1, 1, &nt);
+	munit_assert(0 == store_write_txn_begin(&s));
+	munit_assert(0 == store_create_topic(&s, "a", 1, itopics[0]));
+	munit_assert(0 == store_create_topic(&s, "b", 1, itopics[1]));
+	munit_assert(0 == store_write_txn_end(&s));
+
+	// a batch that doesn't fit is aborted and written again after growing
+	int grown = 0;
+	for (int i = 0; i < N_EVENTS * 10; i += 1000) {
+		for (;;) {
+			munit_assert(0 == store_write_txn_begin(&s));
+			int failed = 0;
+			for (int j = i; j < i + 1000 && !failed; j++) {
+				for (int t = 0; t < 2 && !failed; t++) {
+					char buf[64];
+					int n = sprintf(buf, "{\"event\":%d,\"pad\":\"xxxxxxxx\"}", j);
+					failed = store_write_event(&s, itopics[t], buf, n);
+				}
+			}
+			if (failed) {
+				store_write_txn_abort(&s);
+			} else if (!store_write_txn_end(&s)) {
+				break;
+			}
+			munit_assert(1 == s.map_full);
+			munit_assert(0 == store_grow(&s, 1));
+			grown++;
+		}
+	}
+	munit_assert(0 < grown);
+
+	for (int t = 0; t < 2; t++) {
+		munit_assert(N_EVENTS * 10 == read_all(&s, itopics[t], 0, N_EVENTS * 20));
+	}
+
+	// growing ahead leaves room for another batch
+	munit_assert(0 == store_grow(&s, 0));
+	MDB_envinfo info;
+	MDB_stat st;
+	munit_assert(0 == mdb_env_info(s.env, &info));
+	munit_assert(0 == mdb_env_stat(s.env, &st));
+	munit_assert((info.me_last_pgno + 1) * st.ms_psize + STORE_MAP_HEADROOM <= info.me_mapsize);
+
+	// capped growth fails once the limit is reached
+	s.max_mapsize = info.me_mapsize;
+	munit_assert(1 == store_grow(&s, 1));
+
+	store_destroy(&s);
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_sync(const MunitParameter params[], void* data) {
+	fixture *f = (fixture*)data;
+	u32 flags = atoi(munit_parameters_get(params, "flags"));
+
+	store s;
+	munit_assert(0 == store_init(&s, f->name, MAX_TOPICS, 1ULL<<28, flags | STORE_NOSYNC));
+
+	int nt;
+	int itopic = store_get_topic(&s, "a", 1, 1, &nt);
+	munit_assert(0 == store_write_txn_begin(&s));
+	munit_assert(0 == store_create_topic(&s, "a", 1, itopic));
+	munit_assert(0 == store_write_txn_end(&s));
+
+	write_some(&s, &itopic, 1, 0, 100);
+	write_some(&s, &itopic, 1, 100, 200);
+
+	// committed but not flushed yet
+	store_status st;
+	store_topic_status(&s, itopic, &st);
+	munit_assert(200 == st.committed);
+	munit_assert(0 == st.durable);
+
+	munit_assert(0 == store_sync(&s, 0));
+	store_topic_status(&s, itopic, &st);
+	munit_assert(200 == st.durable);
+
+	write_some(&s, &itopic, 1, 200, 300);
+	store_sync_stop(&s);
+	munit_assert(1 == store_sync(&s, 10)); // flushes once more
+	store_topic_status(&s, itopic, &st);
+	munit_assert(300 == st.durable);
+
+	store_destroy(&s);
+
+	munit_assert(0 == store_init(&s, f->name, MAX_TOPICS, 1ULL<<28, 0));
+	munit_assert(300 == read_all(&s, itopic, 0, 1000));
+	store_topic_status(&s, itopic, &st);
+	munit_assert(300 == st.durable);
+	store_destroy(&s);
+
+	return MUNIT_OK;
+}
+
+#define N_ADDERS 4
+#define N_ADDED 500
+
+typedef struct add_context {
+	store *s;
+	int added[N_ADDED+1]; // by itopic, counted under the store's topic lock
+	int itopics[N_ADDERS][N_ADDED];
+} add_context;
+
+typedef struct adder {
+	add_context *c;
+	int id;
+} adder;
+
+static void added(int itopic, char *topic, u32 topic_len, void *ctx) {
+	add_context *c = (add_context*)ctx;
+	munit_assert(itopic > 0 && itopic <= N_ADDED);
+	c->added[itopic]++;
+}
+
+static int add_topics(void *arg) {
+	add_context *c = ((adder*)arg)->c;
+	int id = ((adder*)arg)->id;
+	for (int i = 0; i < N_ADDED; i++) {
+		int t = id & 1 ? N_ADDED-1 - i : i; // half of them from the end
+		char topic[16];
+		int n = sprintf(topic, "t%d", t);
+		c->itopics[id][t] = store_add_topic(c->s, topic, n, added, c);
+	}
+	return 0;
+}
+
+static MunitResult test_topics(const MunitParameter params[], void* data) {
+	fixture *f = (fixture*)data;
+	store s;
+	munit_assert(0 == store_init(&s, f->name, MAX_TOPICS, 1ULL<<28, 0));
+
+	// writers add the same topics concurrently, each is added once
+	add_context *c = calloc(1, sizeof(add_context));
+	c->s = &s;
+	thrd_t trds[N_ADDERS];
+	adder adders[N_ADDERS];
+	for (int i = 0; i < N_ADDERS; i++) {
+		adders[i].c = c;
+		adders[i].id = i;
+		munit_assert(thrd_success == thrd_create(trds + i, add_topics, adders + i));
+	}
+	for (int i = 0; i < N_ADDERS; i++) {
+		munit_assert(thrd_success == thrd_join(trds[i], NULL));
+	}
+
+	for (int i = 1; i <= N_ADDED; i++) {
+		munit_assert(1 == c->added[i]);
+	}
+	for (int i = 0; i < N_ADDED; i++) {
+		char topic[16];
+		int nt, n = sprintf(topic, "t%d", i);
+		int itopic = store_get_topic(&s, topic, n, 0, &nt);
+		for (int t = 0; t < N_ADDERS; t++) {
+			munit_assert(itopic == c->itopics[t][i]);
+		}
+	}
+
+	free(c);
+	store_destroy(&s);
 
 	return MUNIT_OK;
 }
@@ -17,14 +1007,46 @@ static MunitResult test_full(const MunitParameter params[], void* data) {
 }
 
 static void* setup(const MunitParameter params[], void* user_data) {
-	return NULL;
+	fixture *f = (fixture*)malloc(sizeof(fixture));
+	strcpy(f->dir, "/tmp/esq-store-XXXXXX");
+	munit_assert(NULL != mkdtemp(f->dir));
+	sprintf(f->name, "%s/db", f->dir);
+	return f;
 }
 
-static void tear_down(void* fixture) {
+static void tear_down(void* data) {
+	fixture *f = (fixture*)data;
+	char lock[96];
+	sprintf(lock, "%s-lock", f->name);
+	unlink(f->name);
+	unlink(lock);
+	rmdir(f->dir);
+	free(f);
 }
 
+static char *flags_params[] = { "0", "1", "4", "5", NULL };
+
+static MunitParameterEnum rw_params[] = {
+	{ "flags", flags_params },
+	{ NULL, NULL },
+};
+
 static MunitTest test_suite_tests[] = {
-	{ "/test-rw", test_rw, setup, tear_down, 0, NULL },
+	{ "/test-rw", test_rw, setup, tear_down, 0, rw_params },
+	{ "/test-dicts", test_dicts, setup, tear_down, 0, rw_params },
+	{ "/test-drop", test_drop, setup, tear_down, 0, rw_params },
+	{ "/test-retention", test_retention, setup, tear_down, 0, rw_params },
+	{ "/test-low-moves", test_low_moves, setup, tear_down, 0, rw_params },
+	{ "/test-uncommitted", test_uncommitted, setup, tear_down, 0, rw_params },
+	{ "/test-checkpoints", test_checkpoints, setup, tear_down, 0, rw_params },
+	{ "/test-batch", test_batch, setup, tear_down, 0, rw_params },
+	{ "/test-time", test_time, setup, tear_down, 0, rw_params },
+	{ "/test-codecs", test_codecs, setup, tear_down, 0, rw_params },
+	{ "/test-into", test_into, setup, tear_down, 0, rw_params },
+	{ "/test-stored", test_stored, setup, tear_down, 0, rw_params },
+	{ "/test-grow", test_grow, setup, tear_down, 0, rw_params },
+	{ "/test-sync", test_sync, setup, tear_down, 0, rw_params },
+	{ "/test-topics", test_topics, setup, tear_down, 0, NULL },
 	{ "/test-full", test_full, setup, tear_down, 0, NULL },
 	{ NULL, NULL, NULL, NULL, 0, NULL }
 };
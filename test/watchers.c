@@ -74,6 +74,123 @@ static MunitResult test_basic(const MunitParameter params[], void* data) {
 	return MUNIT_OK;
 }
 
+static MunitResult test_move(const MunitParameter params[], void* data) {
+	session ss[2];
+	for (int i = 0; i < 2; i++) munit_assert(0 == session_init(ss+i));
+	session *a = ss;
+	session *b = ss+1;
+
+	watchers w;
+	munit_assert(0 == watchers_init(&w));
+
+	// topics sharing a lock, and the same topic again
+	int t1 = 1, t2 = 1 + WATCHERS_STRIPES;
+	int from = watchers_lock_move(&w, t1, a);
+	munit_assert(0 == from);
+	watchers_update_watcher(&w, t1, 5, 1, a);
+	watchers_unlock_move(&w, from, t1, a);
+
+	from = watchers_lock_move(&w, t2, b);
+	watchers_update_watcher(&w, t2, 0, 0, b);
+	watchers_unlock_move(&w, from, t2, b);
+
+	from = watchers_lock_move(&w, t2, a);
+	munit_assert(t1 == from);
+	watchers_update_watcher(&w, t2, 7, 0, a);
+	watchers_unlock_move(&w, from, t2, a);
+
+	context ctx = {0};
+	watchers_foreach(&w, t1, visitor, &ctx);
+	munit_assert(0 == ctx.visited);
+
+	memset(&ctx, 0, sizeof(context));
+	watchers_foreach(&w, t2, visitor, &ctx);
+	munit_assert(2 == ctx.visited);
+	munit_assert(b == ctx.first);
+	munit_assert(a == ctx.last);
+	munit_assert(7 == a->offset);
+
+	from = watchers_lock_move(&w, t2, a);
+	watchers_update_watcher(&w, t2, 9, 1, a);
+	watchers_unlock_move(&w, from, t2, a);
+
+	from = watchers_lock_move(&w, 0, b);
+	munit_assert(t2 == from);
+	watchers_update_watcher(&w, 0, 0, 0, b);
+	watchers_unlock_move(&w, from, 0, b);
+	munit_assert(0 == b->watch);
+
+	memset(&ctx, 0, sizeof(context));
+	watchers_foreach(&w, t2, visitor, &ctx);
+	munit_assert(1 == ctx.visited);
+	munit_assert(a == ctx.first);
+
+	// every lock is free again
+	for (int t = 0; t < WATCHERS_STRIPES; t++) {
+		munit_assert(thrd_success == mtx_trylock(w.mutex + t));
+		mtx_unlock(w.mutex + t);
+	}
+
+	watchers_destroy(&w);
+
+	for (int i = 0; i < 2; i++) session_destroy(ss+i);
+
+	return MUNIT_OK;
+}
+
+static void detached(session *s, void *ctx) {
+	visitor(s, ctx);
+	munit_assert(0 == s->watch);
+	munit_assert(0 == s->live);
+	munit_assert(thrd_busy == mtx_trylock(&s->mutex));
+}
+
+static MunitResult test_detach(const MunitParameter params[], void* data) {
+	session ss[3];
+	for (int i = 0; i < 3; i++) munit_assert(0 == session_init(ss+i));
+	session *a = ss;
+	session *b = ss+1;
+	session *c = ss+2;
+
+	watchers w;
+	munit_assert(0 == watchers_init(&w));
+
+	watchers_update_watcher(&w, 1, 5, 1, a);
+	watchers_update_watcher(&w, 2, 0, 0, b);
+	watchers_update_watcher(&w, 1, 3, 0, c);
+
+	context ctx = {0};
+	watchers_lock(&w, 1);
+	watchers_detach(&w, 1, detached, &ctx);
+	watchers_unlock(&w, 1);
+	munit_assert(2 == ctx.visited);
+	munit_assert(a == ctx.first);
+	munit_assert(c == ctx.last);
+	munit_assert(0 == a->offset);
+
+	memset(&ctx, 0, sizeof(context));
+	watchers_foreach(&w, 1, visitor, &ctx);
+	munit_assert(0 == ctx.visited);
+
+	// other topics keep their watchers
+	memset(&ctx, 0, sizeof(context));
+	watchers_foreach(&w, 2, visitor, &ctx);
+	munit_assert(1 == ctx.visited);
+	munit_assert(2 == b->watch);
+
+	// a detached session watches again
+	watchers_update_watcher(&w, 1, 0, 0, a);
+	memset(&ctx, 0, sizeof(context));
+	watchers_foreach(&w, 1, visitor, &ctx);
+	munit_assert(1 == ctx.visited);
+
+	watchers_destroy(&w);
+
+	for (int i = 0; i < 3; i++) session_destroy(ss+i);
+
+	return MUNIT_OK;
+}
+
 static void* setup(const MunitParameter params[], void* user_data) {
 	return NULL;
 }
@@ -83,6 +200,8 @@ static void tear_down(void* fixture) {
 
 static MunitTest test_suite_tests[] = {
 	{ "/basic", test_basic, setup, tear_down, 0, NULL },
+	{ "/move", test_move, setup, tear_down, 0, NULL },
+	{ "/detach", test_detach, setup, tear_down, 0, NULL },
 	{ NULL, NULL, NULL, NULL, 0, NULL }
 };
 
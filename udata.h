@@ -1,29 +1,45 @@
 #ifndef UDATA_H
 #define UDATA_H
 
+#include "cache.h"
+#include "commit.h"
+#include "loop.h"
 #include "pool.h"
 #include "queue.h"
+#include "replay.h"
 #include "store.h"
 #include "watchers.h"
 #include "threads.h"
 
 typedef struct loop_userdata {
-	ev_async async_w;
-	ev_async async_close_w;
+	ev_async async_close_w; // on the first loop, which also takes signals
 	watchers ws;
 	store s;
 
-	session_pool pool;
+	io_loop *loops;
+	u32 n_loops;
 
 	i64 *write_offsets; //[MAX_TOPICS]; // copy of store->write_offsets
-
-	queue reader_worker_queue;
+	u32 sync_interval; // ms between flushes of a nosync store
+	group_commit gc; // store worker batching
+	event_cache cache; // recent events, for readers near the head
+	replay_rate replay; // store reads of every reader
+	u32 replay_quantum; // bytes a session is sent per turn
+	int zerocopy; // replays written to sockets straight from the map
+
+	queue *reader_worker_queues; // one per reader, sessions go by topic
+	u32 n_readers;
 	queue notify_worker_queue;
-	queue writer_worker_queue;
+	queue *writer_worker_queues; // commands go by topic, or by session without one
+	u32 n_writers;
 	queue store_worker_queue;
-
-	mtx_t mutex;
 } loop_userdata;
 
+// reader queue of a topic's sessions
+#define READER_QUEUE(u, itopic) ((u)->reader_worker_queues + (u32)(itopic) % (u)->n_readers)
+
+// writer queue of a command, see command_shard
+#define WRITER_QUEUE(u, shard) ((u)->writer_worker_queues + (shard) % (u)->n_writers)
+
 #endif /* UDATA_H */
 
@@ -23,8 +23,11 @@
 #include "watchers.h"
 
 int watchers_init(watchers *m) {
-	if (mtx_init(&m->mutex, mtx_plain) != thrd_success) {
-		return 1;
+	for (u32 i = 0; i < WATCHERS_STRIPES; i++) {
+		if (mtx_init(m->mutex+i, mtx_plain) != thrd_success) {
+			while (i--) mtx_destroy(m->mutex+i);
+			return 1;
+		}
 	}
 
 	for (u32 i = 0; i < MAX_TOPICS+1; i++) {
@@ -35,15 +38,54 @@ int watchers_init(watchers *m) {
 }
 
 void watchers_destroy(watchers *m) {
-	mtx_destroy(&m->mutex);
+	for (u32 i = 0; i < WATCHERS_STRIPES; i++) {
+		mtx_destroy(m->mutex+i);
+	}
+}
+
+void watchers_lock(watchers *m, int itopic) {
+	mtx_lock(m->mutex + itopic % WATCHERS_STRIPES);
+}
+
+void watchers_unlock(watchers *m, int itopic) {
+	mtx_unlock(m->mutex + itopic % WATCHERS_STRIPES);
+}
+
+// two topics' stripes, lower first. Topic 0 has no list
+static void watchers_lock_pair(watchers *m, int a, int b) {
+	u32 x = a % WATCHERS_STRIPES, y = b % WATCHERS_STRIPES;
+	if (!a || (b && y < x)) {
+		u32 t = x; x = y; y = t;
+		int ti = a; a = b; b = ti;
+	}
+	if (a) mtx_lock(m->mutex + x);
+	if (b && y != x) mtx_lock(m->mutex + y);
 }
 
-void watchers_lock(watchers *m) {
-	mtx_lock(&m->mutex);
+static void watchers_unlock_pair(watchers *m, int a, int b) {
+	u32 x = a % WATCHERS_STRIPES, y = b % WATCHERS_STRIPES;
+	if (a) mtx_unlock(m->mutex + x);
+	if (b && (!a || y != x)) mtx_unlock(m->mutex + y);
 }
 
-void watchers_unlock(watchers *m) {
-	mtx_unlock(&m->mutex);
+int watchers_lock_move(watchers *m, int itopic, session *s) {
+	for (;;) {
+		session_lock(s);
+		int from = s->watch;
+		session_unlock(s);
+
+		// s only moves with its topic locked, it may have meanwhile
+		watchers_lock_pair(m, from, itopic);
+		session_lock(s);
+		if (s->watch == from) return from;
+		session_unlock(s);
+		watchers_unlock_pair(m, from, itopic);
+	}
+}
+
+void watchers_unlock_move(watchers *m, int from, int itopic, session *s) {
+	session_unlock(s);
+	watchers_unlock_pair(m, from, itopic);
 }
 
 void watchers_foreach(watchers *m, int itopic, session_visitor fn, void *ctx) {
@@ -55,15 +97,13 @@ void watchers_foreach(watchers *m, int itopic, session_visitor fn, void *ctx) {
 }
 
 void watchers_update_watcher(watchers *m, int itopic, i64 offset, int live, session *s) {
-	if (!itopic) {
-		if (s->watch) {
-			SM_TAILQ_REMOVE(m->watchers + s->watch, s, entries);
-			s->offset = 0;
-			s->live = 0;
-			s->watch = 0;
-		}
-		return;
+	if (s->watch) {
+		SM_TAILQ_REMOVE(m->watchers + s->watch, s, entries);
+		s->offset = 0;
+		s->live = 0;
+		s->watch = 0;
 	}
+	if (!itopic) return;
 
 	s->offset = offset;
 	s->live = live;
@@ -71,3 +111,13 @@ void watchers_update_watcher(watchers *m, int itopic, i64 offset, int live, sess
 	SM_TAILQ_INSERT_TAIL(m->watchers + itopic, s, entries);
 }
 
+
+void watchers_detach(watchers *m, int itopic, session_visitor fn, void *ctx) {
+	session *s;
+	while ((s = SM_TAILQ_FIRST(m->watchers + itopic))) {
+		session_lock(s);
+		watchers_update_watcher(m, 0, 0, 0, s);
+		if (fn) fn(s, ctx);
+		session_unlock(s);
+	}
+}
@@ -27,20 +27,27 @@
 #include "session.h"
 #include "threads.h"
 
+#define WATCHERS_STRIPES 256 // topic lists share this many locks
+
 SM_TAILQ_HEAD(session_tailq, session);
 
 typedef struct watchers {
 	struct session_tailq watchers[MAX_TOPICS + 1]; // topics start at 1
-	mtx_t mutex;
+	mtx_t mutex[WATCHERS_STRIPES];
 } watchers;
 
 int watchers_init(watchers *m);
 void watchers_destroy(watchers *m);
-void watchers_lock(watchers *m);
-void watchers_unlock(watchers *m);
+void watchers_lock(watchers *m, int itopic);
+void watchers_unlock(watchers *m, int itopic);
+// > watchers of both topics > session, returns the topic s is moved from
+int watchers_lock_move(watchers *m, int itopic, session *s);
+void watchers_unlock_move(watchers *m, int from, int itopic, session *s);
 typedef void (*session_visitor)(session *s, void *ctx);
 void watchers_foreach(watchers *m, int itopic, session_visitor fn, void *ctx);
 void watchers_update_watcher(watchers *m, int itopic, i64 offset, int live, session *s);
+// > watchers of itopic. Every session leaves the topic, fn sees it locked right after
+void watchers_detach(watchers *m, int itopic, session_visitor fn, void *ctx);
 
 #endif /* WATCHERS_H */
 
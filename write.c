@@ -28,6 +28,7 @@
 #include "connection.h"
 
 #include "ev.h"
+#include "lib/lz4/lz4.h"
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -48,6 +49,7 @@ connection stdin_watcher;
 char *topic = NULL;
 u8 topic_len = 0;
 int done = 0;
+int compress = 0; // lz4 here, the server stores events as sent
 
 void sock_cb(struct ev_loop *loop, struct ev_io *w, int revents) {
 	connection* conn = (connection*)w;
@@ -75,6 +77,43 @@ done:
 	ev_io_stop(loop, &stdin_watcher.io);
 }
 
+// complete lines of buf framed together, as many as fit, empty ones are
+// dropped. *used = bytes of buf taken, 0 when the first line doesn't fit.
+// 1 = full send buffer
+static int send_batch(struct ev_loop *loop, char *buf, u32 len, u32 *used) {
+	static char frame[MAX_MESSAGE_SIZE];
+	u32 pos = sizeof(u32);
+	frame[pos++] = 'b';
+	frame[pos++] = (char)topic_len;
+	memcpy(frame + pos, topic, topic_len);
+	pos += topic_len;
+	u32 first = pos;
+
+	u32 taken = 0;
+	char *end;
+	while ((end = memchr(buf + taken, '\n', len - taken))) {
+		u32 event_len = end - (buf + taken);
+		if (pos + sizeof(u32) + event_len > MAX_MESSAGE_SIZE) break;
+		if (event_len) {
+			memcpy(frame + pos, &event_len, sizeof(u32));
+			memcpy(frame + pos + sizeof(u32), buf + taken, event_len);
+			pos += sizeof(u32) + event_len;
+		}
+		taken += event_len + 1;
+	}
+
+	*used = taken;
+	if (pos == first) return 0;
+
+	u32 total_len = pos - sizeof(u32);
+	memcpy(frame, &total_len, sizeof(u32));
+	if (connection_send(&sock_watcher, frame, pos)) {
+		return 1;
+	}
+	connection_enable_write(&sock_watcher, loop);
+	return 0;
+}
+
 static void stdin_cb(struct ev_loop *loop, struct ev_io *w, int revents) {
 	connection* conn = (connection*)w;
 	if (!(revents & EV_READ)) return;
@@ -108,12 +147,24 @@ again:
 		// send event
 		u32 total_len = sizeof(char) + sizeof(u8) + topic_len + (end-buf);
 
-		if (total_len + sizeof(u32) > MAX_MESSAGE_SIZE) {
+		if (total_len + sizeof(u32) > MAX_MESSAGE_SIZE || end-buf > MAX_EVENT_SIZE) {
 			fprintf(stderr, "skipping message\n");
 			goto skip;
 		}
 
-		connection_iovec parts[5];
+		// one frame for many events, unless compressed one by one
+		if (!compress) {
+			u32 used;
+			if (send_batch(loop, buf, len, &used)) {
+				return; // backpressure
+			}
+			if (used) {
+				connection_consume(conn, used);
+				continue;
+			}
+		}
+
+		connection_iovec parts[6];
 		parts[0].buf = &total_len;
 		parts[0].len = sizeof(u32);
 		parts[1].buf = "e";
@@ -124,8 +175,25 @@ again:
 		parts[3].len = topic_len;
 		parts[4].buf = buf;
 		parts[4].len = end-buf;
+		u32 n = 5;
+
+		// compressed, unless it doesn't pay off
+		char compressed[LZ4_COMPRESSBOUND(MAX_MESSAGE_SIZE)];
+		u32 raw_len = end-buf;
+		if (compress && raw_len <= MAX_EVENT_SIZE) {
+			int csize = LZ4_compress_default(buf, compressed, raw_len, sizeof(compressed));
+			if (csize > 0 && csize + sizeof(u32) < raw_len) {
+				total_len = sizeof(char) + sizeof(u8) + topic_len + sizeof(u32) + csize;
+				parts[1].buf = "z";
+				parts[4].buf = &raw_len;
+				parts[4].len = sizeof(u32);
+				parts[5].buf = compressed;
+				parts[5].len = csize;
+				n = 6;
+			}
+		}
 
-		if (connection_send_multi(&sock_watcher, parts, 5)) {
+		if (connection_send_multi(&sock_watcher, parts, n)) {
 			return; // backpressure
 		}
 		connection_enable_write(&sock_watcher, loop);
@@ -136,7 +204,7 @@ skip:
 }
 
 void usage() {
-	fprintf(stderr, "Usage: esq-write [-h host] [-p port] topic\n");
+	fprintf(stderr, "Usage: esq-write [-h host] [-p port] [-z] topic\n");
 	exit(1);
 }
 
@@ -152,6 +220,8 @@ int main(int argc, char **argv) {
 		} else if (!strcmp(argv[i], "-p")) {
 			if (++i >= argc) usage();
 			port = argv[i];
+		} else if (!strcmp(argv[i], "-z")) {
+			compress = 1;
 		} else if (!strcmp(argv[i], "--")) {
 			break;
 		} else {